@@ -2,11 +2,15 @@
 ** client.c -- a stream socket client demo
 */
 
+#define _GNU_SOURCE  // splice(), fallocate()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <time.h>
 #include <netdb.h>
 #include <sys/types.h>
 #include <netinet/in.h>
@@ -21,7 +25,8 @@
 
 #define PORT "3490" // the port client will be connecting to 
 
-#define MAXDATASIZE 100 // max number of bytes we can get at once 
+#define MAXHEADERSIZE 32 // "<length>\n\n\n", the length in decimal
+#define CHUNK_SIZE (1 << 20) // bytes moved per recv() or splice()
 
 // get sockaddr, IPv4 or IPv6:
 void *get_in_addr(struct sockaddr *sa)
@@ -33,10 +38,187 @@ void *get_in_addr(struct sockaddr *sa)
 	return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
+double now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// write all of buf to fd; returns 0, or -1 on error
+int write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// read the "<length>\n\n\n" header; bytes of the payload that came with it
+// are left in buf, their count in *extra. Returns the length, -1 if the
+// header is malformed or the server hung up first.
+long long read_header(int sockfd, char *buf, size_t *extra)
+{
+	size_t have = 0;
+	char *end;
+	long long len;
+
+	while (1) {
+		char *nl = memmem(buf, have, "\n\n\n", 3);
+		if (nl) {
+			*nl = '\0';
+			len = strtoll(buf, &end, 10);
+			if (end == buf || *end != '\0' || len < 0) {
+				return -1;
+			}
+			*extra = have - (nl + 3 - buf);
+			memmove(buf, nl + 3, *extra);
+			return len;
+		}
+		if (have == MAXHEADERSIZE) {
+			return -1;
+		}
+		ssize_t n = recv(sockfd, buf + have, MAXHEADERSIZE - have, 0);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		have += n;
+	}
+}
+
+// move left more payload bytes from the socket to out: through a pipe with
+// splice() when out is a file, so the bytes never enter user space, else
+// with large reads. Returns the bytes moved, short only on error.
+long long stream_payload(int sockfd, int out, long long left)
+{
+	static char buf[CHUNK_SIZE];
+	long long moved = 0;
+	int pipefd[2], use_splice = 0;
+	ssize_t n;
+
+	if (out != STDOUT_FILENO && pipe(pipefd) == 0) {
+		fcntl(pipefd[1], F_SETPIPE_SZ, CHUNK_SIZE);  // best effort: bigger steps
+		use_splice = 1;
+	}
+
+	while (left > 0) {
+		size_t want = left < CHUNK_SIZE ? left : CHUNK_SIZE;
+		if (use_splice) {
+			n = splice(sockfd, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (n == -1 && errno == EINVAL && moved == 0) {
+				use_splice = 0;  // this kernel or file system won't splice
+				continue;
+			}
+			if (n > 0) {
+				ssize_t in_pipe = n, m;
+				while (in_pipe > 0) {
+					m = splice(pipefd[0], NULL, out, NULL, in_pipe, SPLICE_F_MOVE | SPLICE_F_MORE);
+					if (m == -1 && errno == EINTR) {
+						continue;
+					}
+					if (m <= 0) {
+						perror("splice");
+						return moved;
+					}
+					in_pipe -= m;
+				}
+			}
+		} else {
+			n = recv(sockfd, buf, want, 0);
+			if (n > 0 && write_all(out, buf, n) == -1) {
+				perror("write");
+				return moved;
+			}
+		}
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			if (n == -1) {
+				perror("recv");
+			}
+			break;
+		}
+		moved += n;
+		left -= n;
+	}
+	if (use_splice) {
+		close(pipefd[0]);
+		close(pipefd[1]);
+	}
+	return moved;
+}
+
+// read the length the server announces, then exactly that many bytes into
+// output (or stdout, after the count); returns 0 if all of them arrived
+int receive_message(int sockfd, const char *output)
+{
+	char buf[MAXHEADERSIZE];
+	size_t extra;
+	long long len, got;
+	double start = now_seconds(), secs;
+	int out = STDOUT_FILENO;
+
+	if ((len = read_header(sockfd, buf, &extra)) == -1) {
+		fprintf(stderr, "client: bad length header\n");
+		return 1;
+	}
+	if ((long long)extra > len) {
+		fprintf(stderr, "client: more data than the header announced\n");
+		return 1;
+	}
+
+	if (output) {
+		if ((out = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1) {
+			perror(output);
+			return 1;
+		}
+		// reserve the blocks up front: no ENOSPC half way, and the file
+		// system can lay the file out in one piece
+		if (len > 0 && fallocate(out, 0, 0, len) == -1 && posix_fallocate(out, 0, len) != 0) {
+			perror("fallocate");
+			return 1;
+		}
+		printf("client: receiving %lld bytes into %s\n", len, output);
+	} else {
+		printf("client: received %lld bytes\n", len);
+		fflush(stdout);  // ahead of the payload, which bypasses stdio
+	}
+
+	if (write_all(out, buf, extra) == -1) {
+		perror("write");
+		return 1;
+	}
+	got = extra + stream_payload(sockfd, out, len - extra);
+	if (out != STDOUT_FILENO && close(out) == -1) {
+		perror(output);
+		return 1;
+	}
+
+	secs = now_seconds() - start;
+	fprintf(stderr, "client: %lld of %lld bytes in %.3f s (%.1f MB/s)\n",
+			got, len, secs, secs > 0 ? got / secs / 1e6 : 0.0);
+	if (got != len) {
+		fprintf(stderr, "client: connection closed %lld bytes short\n", len - got);
+		return 1;
+	}
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
-	int sockfd, numbytes;  
-	char buf[MAXDATASIZE];
+	int sockfd;
 	struct addrinfo hints, *servinfo, *p;
 	int rv;
 	char s[INET6_ADDRSTRLEN];
@@ -55,8 +237,9 @@ int main(int argc, char *argv[])
 
 
 
-	if (argc != 2) {
-	    fprintf(stderr,"usage: client hostname\n");
+	if (argc != 2 && argc != 3) {
+	    fprintf(stderr,"usage: client hostname [output_file]\n");
+	    fprintf(stderr,"  the payload goes to output_file, or after the byte count on stdout\n");
 	    exit(1);
 	}
 
@@ -97,22 +280,10 @@ int main(int argc, char *argv[])
 
 	freeaddrinfo(servinfo); // all done with this structure
 
-	if ((numbytes = recv(sockfd, buf, MAXDATASIZE-1, 0)) == -1) {
-	    perror("recv");
-	    exit(1);
+	if ((rv = receive_message(sockfd, argc == 3 ? argv[2] : NULL)) != 0) {
+		return rv;
 	}
 
-	buf[numbytes] = '\0';
-
-	char * pos;
-	pos=strchr(buf,'\n');
-	//printf("found at %zu\n",pos-buf+1);	
-	unsigned int str_position = pos-buf;
-	//printf("%zu \n\n",str_position);
-	printf("client: received %.*s bytes",str_position,buf);
-	printf("%s",buf+str_position+2);
-
-
 	close(sockfd);
 
 	// Start of listener Code
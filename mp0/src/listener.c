@@ -2,20 +2,59 @@
 ** listener.c -- a datagram sockets "server" demo
 */
 
+#define _GNU_SOURCE  // recvmmsg()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <endian.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 
+#include "udp_load.h"
+#include "mcast.h"
+#include "timing.h"
+
 #define MYPORT "4950"	// the port users will be connecting to
 
-#define MAXBUFLEN 100
+#define MAXBUFLEN (LOAD_MAX_SIZE + 1)  // one more, to see a message end
+#define MAX_BATCH 1024        // datagrams per recvmmsg() at most
+#define RCVBUF_SIZE (8 << 20) // asked for, so a burst isn't dropped between drains
+#define IDLE_REPORT_NS 2000000000LL  // a run is over after this long without datagrams
+#define SEQ_WINDOW 4096  // sequence numbers below the highest that are told apart
+#define MCAST_QUIET_NS 100000000LL   // a sender this long silent has missing blocks to NACK
+#define MCAST_NACK_INTERVAL_NS 50000000LL  // NACKs at least this far apart, plus up to as much again
+
+// what the load datagrams have shown, for one interval or a whole run
+struct load_stats {
+	long long packets, bytes;
+	long long lost;       // sequence numbers skipped over, and not seen since
+	long long late;       // filled a gap: came after a later one
+	long long duplicates; // seen before
+};
+
+// the talker run being measured
+struct load_run {
+	int active;
+	uint32_t id;
+	uint64_t next_seq;    // one past the highest sequence number seen
+	uint64_t seen[SEQ_WINDOW / 64]; // bit seq % SEQ_WINDOW: for the SEQ_WINDOW
+	                                // sequence numbers below next_seq, arrived
+	long long transit;    // last arrival minus send time, in ns
+	double jitter;        // RFC 3550 interarrival jitter, in ns
+	long long last_arrival; // monotonic ns
+	struct load_stats interval, total;
+};
 
 // get sockaddr, IPv4 or IPv6:
 void *get_in_addr(struct sockaddr *sa)
@@ -27,16 +66,397 @@ void *get_in_addr(struct sockaddr *sa)
 	return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
-int main(void)
+double loss_percent(const struct load_stats *s)
+{
+	// of the sequence numbers expected, i.e. those that arrived, once each,
+	// plus those that didn't
+	long long expected = s->packets - s->duplicates + s->lost;
+	return s->lost > 0 && expected > 0 ? 100.0 * s->lost / expected : 0.0;
+}
+
+void end_run(struct load_run *r)
+{
+	if (r->active) {
+		printf("listener: run %08x done: %lld datagrams, %lld lost (%.3f%%), %lld late, %lld duplicates, jitter %.1f us\n",
+				r->id, r->total.packets, r->total.lost, loss_percent(&r->total),
+				r->total.late, r->total.duplicates, r->jitter / 1000);
+	}
+	memset(r, 0, sizeof *r);
+}
+
+// once a second: what arrived in the interval
+void report_interval(struct load_run *r, double seconds)
+{
+	struct load_stats *s = &r->interval;
+
+	if (!r->active) {
+		return;
+	}
+	printf("listener: %.0f pps, %.3f Gbps, %lld lost (%.3f%%), %lld late, %lld duplicates, jitter %.1f us\n",
+			s->packets / seconds, s->bytes * 8 / seconds / 1e9,
+			s->lost, loss_percent(s), s->late, s->duplicates, r->jitter / 1000);
+	fflush(stdout);
+	memset(s, 0, sizeof *s);
+}
+
+// account for one load datagram received at arrival_ns (CLOCK_REALTIME)
+void count_datagram(struct load_run *r, const struct load_header *h, int len,
+		long long arrival_ns)
+{
+	uint32_t id = ntohl(h->run);
+	uint64_t seq = be64toh(h->seq);
+	long long transit = arrival_ns - (long long)be64toh(h->sent_ns);
+
+	if (!r->active || id != r->id) {
+		end_run(r);
+		r->active = 1;
+		r->id = id;
+		r->next_seq = seq;
+		r->transit = transit;
+		printf("listener: run %08x started\n", id);
+	}
+
+	if (seq >= r->next_seq) {
+		uint64_t skipped;
+		r->interval.lost += seq - r->next_seq;
+		r->total.lost += seq - r->next_seq;
+		// the bits of the skipped ones, reused from SEQ_WINDOW back, are cleared
+		if (seq - r->next_seq >= SEQ_WINDOW) {
+			memset(r->seen, 0, sizeof r->seen);
+		} else {
+			for (skipped = r->next_seq; skipped < seq; skipped++) {
+				r->seen[skipped % SEQ_WINDOW / 64] &= ~(1ULL << skipped % 64);
+			}
+		}
+		r->seen[seq % SEQ_WINDOW / 64] |= 1ULL << seq % 64;
+		r->next_seq = seq + 1;
+	} else if (r->next_seq - seq > SEQ_WINDOW) {
+		// too far back to tell a gap from a repeat; it stays counted as lost
+		r->interval.late++;
+		r->total.late++;
+	} else if (r->seen[seq % SEQ_WINDOW / 64] & (1ULL << seq % 64)) {
+		r->interval.duplicates++;
+		r->total.duplicates++;
+	} else {
+		// counted as lost when it was skipped; it only came late
+		r->seen[seq % SEQ_WINDOW / 64] |= 1ULL << seq % 64;
+		r->interval.late++;
+		r->total.late++;
+		if (r->interval.lost > 0) {
+			r->interval.lost--;  // the gap may have been in an earlier interval
+		}
+		r->total.lost--;
+	}
+	r->interval.packets++;
+	r->total.packets++;
+	r->interval.bytes += len;
+	r->total.bytes += len;
+
+	// J += (|D| - J) / 16, D the change in one-way transit time; a constant
+	// clock offset between the hosts cancels out
+	long long d = transit - r->transit;
+	r->jitter += ((d < 0 ? -d : d) - r->jitter) / 16;
+	r->transit = transit;
+}
+
+// kernel receive time of a datagram, if SO_TIMESTAMPNS gave one
+long long arrival_time(struct msghdr *msg, long long fallback)
+{
+	struct cmsghdr *cm;
+
+	for (cm = CMSG_FIRSTHDR(msg); cm != NULL; cm = CMSG_NXTHDR(msg, cm)) {
+		if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS) {
+			struct timespec ts;
+			memcpy(&ts, CMSG_DATA(cm), sizeof ts);
+			return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+		}
+	}
+	return fallback;
+}
+
+// one file coming in from server's multicast mode
+struct mcast_receiver {
+	int group_fd;              // the group's datagrams
+	int repair_fd;             // sends the NACKs, gets unicast repairs
+	const char *output;
+	int have_session;
+	uint32_t session;
+	uint64_t size;
+	uint32_t blocks, missing;
+	char *data;                // the output file, mapped; blocks go straight in
+	unsigned char *have;       // bitmap of the blocks in data
+	struct sockaddr_in sender; // where NACKs go: the address the data came from
+	int end_seen;              // an END since the last NACK
+	long long last_datagram, next_nack;
+	long long datagrams, duplicates, nacks;
+};
+
+// the first datagram of a session gives the file's size: make room for it
+int start_session(struct mcast_receiver *r, const struct mcast_header *h)
+{
+	int fd;
+
+	r->session = ntohl(h->session);
+	r->size = be64toh(h->size);
+	r->blocks = r->missing = (r->size + MCAST_BLOCK - 1) / MCAST_BLOCK;
+	if ((fd = open(r->output, O_RDWR | O_CREAT | O_TRUNC, 0666)) == -1) {
+		perror(r->output);
+		return -1;
+	}
+	if (r->size > 0) {
+		if (ftruncate(fd, r->size) == -1) {
+			perror("ftruncate");
+			return -1;
+		}
+		r->data = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (r->data == MAP_FAILED) {
+			perror("mmap");
+			return -1;
+		}
+	}
+	close(fd);
+	if ((r->have = calloc(r->blocks / 8 + 1, 1)) == NULL) {
+		perror("calloc");
+		return -1;
+	}
+	r->have_session = 1;
+	printf("listener: receiving %llu bytes in %u blocks, session %08x\n",
+			(unsigned long long)r->size, r->blocks, r->session);
+	fflush(stdout);
+	return 0;
+}
+
+// take in one datagram from the group or the repair socket
+int handle_block(struct mcast_receiver *r, const char *buf, int len,
+		const struct sockaddr_in *from, long long now)
+{
+	const struct mcast_header *h = (const struct mcast_header *)buf;
+
+	if (len < (int)sizeof *h || ntohl(h->magic) != MCAST_MAGIC) {
+		return 0;
+	}
+	if (!r->have_session && start_session(r, h) == -1) {
+		return -1;
+	}
+	if (ntohl(h->session) != r->session) {
+		return 0;  // another sender's, or from before the sender restarted
+	}
+	r->sender = *from;
+	r->last_datagram = now;
+	r->datagrams++;
+
+	if (ntohs(h->type) == MCAST_END) {
+		r->end_seen = 1;
+		return 0;
+	}
+
+	uint32_t block = ntohl(h->block);
+	uint64_t off = (uint64_t)block * MCAST_BLOCK;
+	int count = ntohs(h->count);
+	if (ntohs(h->type) != MCAST_DATA || block >= r->blocks ||
+			count != (int)(r->size - off < MCAST_BLOCK ? r->size - off : MCAST_BLOCK) ||
+			len != (int)sizeof *h + count) {
+		return 0;
+	}
+	if (r->have[block / 8] & (1 << block % 8)) {
+		r->duplicates++;
+		return 0;
+	}
+	memcpy(r->data + off, h + 1, count);
+	r->have[block / 8] |= 1 << block % 8;
+	r->missing--;
+	return 0;
+}
+
+// ask for what is missing, once the sender has said it is done or has gone
+// quiet; the wait is randomized so that receivers missing the same blocks
+// don't all ask at once
+void send_nack(struct mcast_receiver *r, long long now)
+{
+	char buf[sizeof(struct mcast_header) + MCAST_MAX_RANGES * sizeof(struct mcast_range)];
+	struct mcast_header *h = (struct mcast_header *)buf;
+	struct mcast_range *ranges = (struct mcast_range *)(h + 1);
+	uint32_t b = 0;
+	int n = 0;
+
+	if (!r->have_session || r->missing == 0 || now < r->next_nack ||
+			!(r->end_seen || now - r->last_datagram >= MCAST_QUIET_NS)) {
+		return;
+	}
+
+	while (b < r->blocks && n < MCAST_MAX_RANGES) {
+		if (r->have[b / 8] & (1 << b % 8)) {
+			b++;
+			continue;
+		}
+		ranges[n].first = htonl(b);
+		while (b < r->blocks && !(r->have[b / 8] & (1 << b % 8))) {
+			b++;
+		}
+		ranges[n++].last = htonl(b - 1);
+	}
+
+	memset(h, 0, sizeof *h);
+	h->magic = htonl(MCAST_MAGIC);
+	h->session = htonl(r->session);
+	h->type = htons(MCAST_NACK);
+	h->count = htons(n);
+	if (sendto(r->repair_fd, buf, sizeof *h + n * sizeof *ranges, 0,
+			(struct sockaddr *)&r->sender, sizeof r->sender) == -1) {
+		perror("sendto");
+	}
+	r->nacks++;
+	r->end_seen = 0;
+	r->next_nack = now + MCAST_NACK_INTERVAL_NS + rand() % MCAST_NACK_INTERVAL_NS;
+}
+
+// read everything queued on fd; returns -1 on a fatal error
+int drain(struct mcast_receiver *r, int fd)
+{
+	static char bufs[MAX_BATCH][MCAST_BLOCK + sizeof(struct mcast_header)];
+	static struct mmsghdr msgs[MAX_BATCH];
+	static struct iovec iovs[MAX_BATCH];
+	static struct sockaddr_in addrs[MAX_BATCH];
+	int i, n;
+
+	while (1) {
+		for (i = 0; i < MAX_BATCH; i++) {
+			iovs[i].iov_base = bufs[i];
+			iovs[i].iov_len = sizeof bufs[i];
+			memset(&msgs[i].msg_hdr, 0, sizeof msgs[i].msg_hdr);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &addrs[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof addrs[i];
+		}
+		n = recvmmsg(fd, msgs, MAX_BATCH, MSG_DONTWAIT, NULL);
+		if (n == -1) {
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+		}
+		long long now = now_ns(CLOCK_MONOTONIC);
+		for (i = 0; i < n; i++) {
+			if (handle_block(r, bufs[i], msgs[i].msg_len, &addrs[i], now) == -1) {
+				return -1;
+			}
+		}
+	}
+}
+
+// multicast mode: join the group and put the file together in output,
+// NACKing the blocks that didn't come; returns once all of it is there
+int receive_multicast(const struct sockaddr_in *group, const char *interface,
+		const char *output)
+{
+	struct mcast_receiver r;
+	struct ip_mreq mreq;
+	struct pollfd pfds[2];
+	int yes = 1, rcvbuf = RCVBUF_SIZE;
+	long long start = now_ns(CLOCK_MONOTONIC);
+
+	memset(&r, 0, sizeof r);
+	r.output = output;
+
+	memset(&mreq, 0, sizeof mreq);
+	mreq.imr_multiaddr = group->sin_addr;
+	mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+	if (interface && inet_pton(AF_INET, interface, &mreq.imr_interface) != 1) {
+		fprintf(stderr, "listener: bad interface address %s\n", interface);
+		return 1;
+	}
+
+	// several receivers may share a host, so the group's port is shared; the
+	// repairs come to a port of this receiver's own
+	if ((r.group_fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1 ||
+			(r.repair_fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+		perror("listener: socket");
+		return 1;
+	}
+	setsockopt(r.group_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+	setsockopt(r.group_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);  // best effort
+	if (bind(r.group_fd, (const struct sockaddr *)group, sizeof *group) == -1) {
+		perror("listener: bind");
+		return 1;
+	}
+	if (setsockopt(r.group_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof mreq) == -1) {
+		perror("listener: IP_ADD_MEMBERSHIP");
+		return 1;
+	}
+	struct sockaddr_in any = { .sin_family = AF_INET };
+	if (bind(r.repair_fd, (struct sockaddr *)&any, sizeof any) == -1) {
+		perror("listener: bind");
+		return 1;
+	}
+
+	srand(now_ns(CLOCK_REALTIME) ^ getpid());
+	pfds[0].fd = r.group_fd;
+	pfds[1].fd = r.repair_fd;
+	pfds[0].events = pfds[1].events = POLLIN;
+
+	printf("listener: joined %s:%d\n", inet_ntoa(group->sin_addr), ntohs(group->sin_port));
+	fflush(stdout);
+
+	while (!r.have_session || r.missing > 0) {
+		if (poll(pfds, 2, MCAST_QUIET_NS / 1000000) == -1 && errno != EINTR) {
+			perror("poll");
+			return 1;
+		}
+		if (drain(&r, r.group_fd) == -1 || drain(&r, r.repair_fd) == -1) {
+			perror("recvmmsg");
+			return 1;
+		}
+		send_nack(&r, now_ns(CLOCK_MONOTONIC));
+	}
+
+	if (r.size > 0 && munmap(r.data, r.size) == -1) {
+		perror("munmap");
+		return 1;
+	}
+	double secs = (now_ns(CLOCK_MONOTONIC) - start) / 1e9;
+	printf("listener: got all %llu bytes in %.3f s (%.1f MB/s): %lld datagrams, %lld duplicates, %lld NACKs\n",
+			(unsigned long long)r.size, secs, secs > 0 ? r.size / secs / 1e6 : 0.0,
+			r.datagrams, r.duplicates, r.nacks);
+	return 0;
+}
+
+int main(int argc, char *argv[])
 {
 	int sockfd;
 	struct addrinfo hints, *servinfo, *p;
-	int rv;
-	int numbytes;
-	struct sockaddr_storage their_addr;
-	char buf[MAXBUFLEN];
-	socklen_t addr_len;
+	int rv, opt, i, n;
+	int batch = 64;
+	char *bufs;
 	char s[INET6_ADDRSTRLEN];
+	static struct mmsghdr msgs[MAX_BATCH];
+	static struct iovec iovs[MAX_BATCH];
+	static struct sockaddr_storage addrs[MAX_BATCH];
+	static char controls[MAX_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+	struct load_run run;
+	struct sockaddr_in group;
+	const char *group_spec = NULL, *interface = NULL;
+
+	while ((opt = getopt(argc, argv, "b:m:i:")) != -1) {
+		switch (opt) {
+		case 'b': batch = atoi(optarg); break;
+		case 'm': group_spec = optarg; break;
+		case 'i': interface = optarg; break;
+		default: batch = 0; break;
+		}
+	}
+	if (batch < 1 || batch > MAX_BATCH || optind != argc - (group_spec != NULL) ||
+			(!group_spec && interface) ||
+			(group_spec && parse_group(group_spec, &group) == -1)) {
+		fprintf(stderr, "usage: listener [-b batch]\n");
+		fprintf(stderr, "       listener -m group[:port] [-i address] output_file\n");
+		fprintf(stderr, "  the first form prints plain datagrams; measures rate, loss and jitter of\n");
+		fprintf(stderr, "  talker's load datagrams, draining up to batch (default 64) per recvmmsg()\n");
+		fprintf(stderr, "  the second receives a file from server -m into output_file, asking for\n");
+		fprintf(stderr, "  what goes missing; -i is the local address of the interface to join on\n");
+		exit(1);
+	}
+
+	if (group_spec) {
+		return receive_multicast(&group, interface, argv[optind]);
+	}
 
 	memset(&hints, 0, sizeof hints);
 	hints.ai_family = AF_UNSPEC; // set to AF_INET to force IPv4
@@ -72,22 +492,80 @@ int main(void)
 
 	freeaddrinfo(servinfo);
 
-	printf("listener: waiting to recvfrom...\n");
+	// all best effort: a smaller buffer drops more, and without kernel
+	// timestamps a whole batch shares one arrival time
+	int rcvbuf = RCVBUF_SIZE, yes = 1;
+	struct timeval tick = { 0, 100000 };  // wake to report even when idle
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+	setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &yes, sizeof yes);
+	if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tick, sizeof tick) == -1) {
+		perror("setsockopt");
+		exit(1);
+	}
 
-	addr_len = sizeof their_addr;
-	if ((numbytes = recvfrom(sockfd, buf, MAXBUFLEN-1 , 0,
-		(struct sockaddr *)&their_addr, &addr_len)) == -1) {
-		perror("recvfrom");
+	if ((bufs = malloc((size_t)batch * MAXBUFLEN)) == NULL) {
+		perror("malloc");
 		exit(1);
 	}
+	for (i = 0; i < batch; i++) {
+		iovs[i].iov_base = bufs + (size_t)i * MAXBUFLEN;
+		iovs[i].iov_len = MAXBUFLEN - 1;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	memset(&run, 0, sizeof run);
+	long long interval_start = now_ns(CLOCK_MONOTONIC);
+
+	printf("listener: waiting to recvfrom...\n");
+	fflush(stdout);
+
+	while (1) {
+		for (i = 0; i < batch; i++) {
+			msgs[i].msg_hdr.msg_name = &addrs[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof addrs[i];
+			msgs[i].msg_hdr.msg_control = controls[i];
+			msgs[i].msg_hdr.msg_controllen = sizeof controls[i];
+		}
+		// blocks for the first datagram only, then takes what is queued
+		n = recvmmsg(sockfd, msgs, batch, MSG_WAITFORONE, NULL);
+		if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			perror("recvmmsg");
+			exit(1);
+		}
 
-	printf("listener: got packet from %s\n",
-		inet_ntop(their_addr.ss_family,
-			get_in_addr((struct sockaddr *)&their_addr),
-			s, sizeof s));
-	printf("listener: packet is %d bytes long\n", numbytes);
-	buf[numbytes] = '\0';
-	printf("listener: packet contains \"%s\"\n", buf);
+		long long received = now_ns(CLOCK_REALTIME), now = now_ns(CLOCK_MONOTONIC);
+		for (i = 0; i < n; i++) {
+			char *buf = iovs[i].iov_base;
+			int numbytes = msgs[i].msg_len;
+
+			if (numbytes >= LOAD_MIN_SIZE &&
+					ntohl(((struct load_header *)buf)->magic) == LOAD_MAGIC) {
+				count_datagram(&run, (struct load_header *)buf, numbytes,
+						arrival_time(&msgs[i].msg_hdr, received));
+				run.last_arrival = now;
+				continue;
+			}
+
+			printf("listener: got packet from %s\n",
+				inet_ntop(addrs[i].ss_family,
+					get_in_addr((struct sockaddr *)&addrs[i]),
+					s, sizeof s));
+			printf("listener: packet is %d bytes long\n", numbytes);
+			buf[numbytes] = '\0';
+			printf("listener: packet contains \"%s\"\n", buf);
+			fflush(stdout);
+		}
+
+		if (now - interval_start >= 1000000000LL) {
+			report_interval(&run, (now - interval_start) / 1e9);
+			interval_start = now;
+		}
+		if (run.active && now - run.last_arrival >= IDLE_REPORT_NS) {
+			end_run(&run);
+			fflush(stdout);
+		}
+	}
 
 	close(sockfd);
 
@@ -0,0 +1,66 @@
+/*
+** mcast.h -- the datagrams of server's multicast file push and listener's
+**            NACKs for repair
+*/
+#ifndef MCAST_H
+#define MCAST_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MCAST_PORT "4951"       // the group's port, unless the group says otherwise
+#define MCAST_MAGIC 0x4d434153u // "MCAS"
+#define MCAST_BLOCK 1200        // file bytes per datagram: under the MTU, tunnels included
+#define MCAST_MAX_RANGES 128    // missing ranges per NACK
+
+enum mcast_type {
+	MCAST_DATA = 1,  // one block of the file, sender to group (or to one receiver)
+	MCAST_END,       // the file has been sent; sender to group, repeated while idle
+	MCAST_NACK       // blocks a receiver is missing, receiver to sender
+};
+
+/*
+ * at the front of every datagram, all fields in network byte order; a DATA
+ * datagram's block follows, a NACK's ranges follow
+ */
+struct mcast_header {
+	uint32_t magic;
+	uint32_t session;  // random per server run; other sessions are ignored
+	uint16_t type;
+	uint16_t count;    // DATA: bytes of the block, NACK: ranges
+	uint32_t block;    // DATA: the block's index, its offset over MCAST_BLOCK
+	uint64_t size;     // DATA, END: the file's size in bytes
+};
+
+// blocks first to last, both included
+struct mcast_range {
+	uint32_t first;
+	uint32_t last;
+};
+
+// "group[:port]" into an IPv4 multicast address; returns 0 on success
+static int parse_group(const char *spec, struct sockaddr_in *sa)
+{
+	char host[INET_ADDRSTRLEN];
+	const char *colon = strchr(spec, ':');
+	size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+
+	if (len >= sizeof host) {
+		return -1;
+	}
+	memcpy(host, spec, len);
+	host[len] = '\0';
+	memset(sa, 0, sizeof *sa);
+	sa->sin_family = AF_INET;
+	sa->sin_port = htons(atoi(colon ? colon + 1 : MCAST_PORT));
+	if (inet_pton(AF_INET, host, &sa->sin_addr) != 1 ||
+			!IN_MULTICAST(ntohl(sa->sin_addr.s_addr)) || sa->sin_port == 0) {
+		return -1;
+	}
+	return 0;
+}
+
+#endif
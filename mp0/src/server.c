@@ -2,24 +2,60 @@
 ** server.c -- a stream socket server demo
 */
 
+#define _GNU_SOURCE  // memfd_create(), sendfile(), sendmmsg()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <time.h>
+#include <endian.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <signal.h>
-#include <assert.h>
+
+#include "mcast.h"
+#include "timing.h"
 
 #define PORT "3490"  // the port users will be connecting to
 #define SERVERPORT "4950" // Server for talking
 
 #define BACKLOG 10	 // how many pending connections queue will hold
+#define FANOUT_BACKLOG SOMAXCONN  // subscribers arrive in bursts in fan-out mode
+#define MAX_EVENTS 256  // ready sockets handled per epoll_wait()
+#define SEND_CHUNK (1 << 20)  // bytes handed to one sendfile() call
+#define MCAST_BATCH 32  // blocks per sendmmsg() in multicast mode
+#define MCAST_END_INTERVAL_NS 500000000LL  // END repeats this often while idle
+
+/*
+ * What every client gets: the payload's length in decimal, "\n\n\n", then the
+ * payload itself, byte for byte. The length comes from the file's size, never
+ * from the contents, so payloads may hold NULs or anything else.
+ */
+struct message {
+	int fd;          // sealed memfd holding the whole message
+	const char *mem; // the same bytes, mapped read-only
+	size_t len;      // header plus payload
+	size_t header_len; // the "<length>\n\n\n" part
+};
+
+// one fan-out subscriber
+struct subscriber {
+	int fd;
+	off_t sent;      // bytes of the message already out
+};
 
 void sigchld_handler(int s)
 {
@@ -36,71 +72,495 @@ void *get_in_addr(struct sockaddr *sa)
 	return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
+// build the message for the file at path into a sealed, read-only memfd;
+// returns 0 on success. Sealing keeps it immutable however long a slow
+// subscriber takes, and later changes to the file don't reach it.
+int load_message(const char *path, struct message *m)
+{
+	struct stat st;
+	char header[32];
+	char *mem;
+	int file_fd, hlen;
+	size_t done;
+	ssize_t n;
+
+	if ((file_fd = open(path, O_RDONLY)) == -1 || fstat(file_fd, &st) == -1) {
+		perror(path);
+		return -1;
+	}
+	hlen = snprintf(header, sizeof header, "%lld\n\n\n", (long long)st.st_size);
+	m->len = hlen + st.st_size;
+	m->header_len = hlen;
+
+	if ((m->fd = memfd_create("message", MFD_CLOEXEC | MFD_ALLOW_SEALING)) == -1 ||
+			ftruncate(m->fd, m->len) == -1) {
+		perror("memfd");
+		return -1;
+	}
+	mem = mmap(NULL, m->len, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	memcpy(mem, header, hlen);
+	for (done = 0; done < (size_t)st.st_size; done += n) {
+		if ((n = read(file_fd, mem + hlen + done, st.st_size - done)) <= 0) {
+			fprintf(stderr, "%s: short read\n", path);
+			return -1;
+		}
+	}
+	close(file_fd);
 
-char* concat(const char *s1, const char *s2, const char *s3)
+	// a write seal needs the writable mapping gone first
+	munmap(mem, m->len);
+	if (fcntl(m->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1) {
+		perror("fcntl");
+		return -1;
+	}
+	m->mem = mmap(NULL, m->len, PROT_READ, MAP_SHARED, m->fd, 0);
+	if (m->mem == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	return 0;
+}
+
+// push as much of the message as the socket takes, starting at *sent;
+// returns 1 once all of it is out, 0 if the socket would block, -1 on error
+int send_message(int fd, const struct message *m, off_t *sent)
 {
-    char *result = malloc(strlen(s1)+strlen(s2)+strlen(s3)+1);//+1 for the zero-terminator
-    //in real code you would check for errors in malloc here
-    strcpy(result, s1);
-    strcat(result, s2);
-    strcat(result, s3);
-    return result;
+	while ((size_t)*sent < m->len) {
+		size_t want = m->len - *sent;
+		if (want > SEND_CHUNK) {
+			want = SEND_CHUNK;
+		}
+		// straight from the memfd's pages; the mapping is only needed for
+		// kernels that can't sendfile() from one
+		ssize_t n = sendfile(fd, m->fd, sent, want);
+		if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+			n = send(fd, m->mem + *sent, want, MSG_NOSIGNAL);
+			if (n > 0) {
+				*sent += n;
+			}
+		}
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+		if (n == 0) {
+			return -1;
+		}
+	}
+	return 1;
 }
 
+// subscribers by the thousand want more than the default descriptor limit
+void raise_fd_limit(void)
+{
+	struct rlimit rl;
 
-int main(int argc, char *argv[])
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+// accept everything queued on the non-blocking listener into the epoll set
+void accept_subscribers(int sockfd, int epfd)
 {
+	struct sockaddr_storage their_addr;
+	socklen_t sin_size;
 
-	if (argc != 2) {
-	    fprintf(stderr,"File Name not specified\n");
-	    exit(1);
+	while (1) {
+		sin_size = sizeof their_addr;
+		int new_fd = accept4(sockfd, (struct sockaddr *)&their_addr, &sin_size,
+				SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (new_fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror("accept");
+			}
+			return;
+		}
+
+		struct subscriber *sub = malloc(sizeof *sub);
+		struct epoll_event ev;
+		if (!sub) {
+			close(new_fd);
+			continue;
+		}
+		sub->fd = new_fd;
+		sub->sent = 0;
+		ev.events = EPOLLOUT | EPOLLET;
+		ev.data.ptr = sub;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, new_fd, &ev) == -1) {
+			perror("epoll_ctl");
+			close(new_fd);
+			free(sub);
+		}
 	}
+}
 
-	//char ch;
+// fan-out mode: one process, one non-blocking loop, every subscriber fed
+// from the same sealed message
+int serve_fanout(int sockfd, const struct message *m)
+{
+	struct epoll_event ev, events[MAX_EVENTS];
+	int epfd, n, i;
 
-	FILE *fptr;
-	fptr = fopen(argv[1],"r");
-	fseek(fptr, 0, SEEK_END);
-	unsigned long len = (unsigned long)ftell(fptr);	
-	fseek (fptr, 0, SEEK_SET);
+	int flags = fcntl(sockfd, F_GETFL, 0);
+	if (flags == -1 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		perror("fcntl");
+		return 1;
+	}
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		perror("epoll_create1");
+		return 1;
+	}
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = NULL;  // the listener; every other entry is a subscriber
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev) == -1) {
+		perror("epoll_ctl");
+		return 1;
+	}
 
-	char *string = malloc(len+1);
-	fread(string,len,1,fptr);
-	string[len] = 0;
+	printf("server: fanning out %zu bytes, waiting for connections...\n", m->len);
 
-	// Need to send len-1 as length 
+	while(1) {
+		if ((n = epoll_wait(epfd, events, MAX_EVENTS, -1)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait");
+			return 1;
+		}
+		for (i = 0; i < n; i++) {
+			struct subscriber *sub = events[i].data.ptr;
+			if (!sub) {
+				accept_subscribers(sockfd, epfd);
+				continue;
+			}
+			// edge-triggered: a new subscriber's first event comes once it
+			// is writable, and each later one once its send buffer drains
+			int rv = send_message(sub->fd, m, &sub->sent);
+			if (rv == 0) {
+				continue;
+			}
+			if (rv == -1 && errno != EPIPE && errno != ECONNRESET) {
+				perror("sendfile");
+			}
+			close(sub->fd);  // also leaves the epoll set
+			free(sub);
+		}
+	}
+}
 
-	//printf("%zu\n",len);	
+// the multicast push of one file, and its repairs
+struct mcast_sender {
+	int sockfd;                // sends to the group, gets the NACKs
+	struct sockaddr_in group;
+	int unicast_repair;        // answer a NACK to its receiver alone
+	uint32_t session;
+	const char *data;          // the file's bytes
+	uint64_t size;
+	uint32_t blocks;
+	unsigned char *pending;    // bitmap: blocks still to go to the group
+	uint32_t npending, cursor; // how many, and where the next scan starts
+	double ns_per_byte;        // pacing, 0 for none
+	long long next_send;       // when the pacer lets the next batch out
+	unsigned long long sent, nacks;
+};
+
+// hold the caller until the rate allows bytes more
+void pace(struct mcast_sender *s, size_t bytes)
+{
+	long long now = now_ns(CLOCK_MONOTONIC);
 
-	const int n_temp = snprintf(NULL, 0, "%lu", len);
-	assert(n_temp > 0);
-	char buf_temp[n_temp+1];
-	int c_temp = snprintf(buf_temp, n_temp+1, "%lu", len);
-	assert(buf_temp[n_temp] == '\0');
-	assert(c_temp == n_temp);
+	if (s->ns_per_byte == 0) {
+		return;
+	}
+	if (s->next_send > now) {
+		struct timespec ts = { s->next_send / 1000000000LL, s->next_send % 1000000000LL };
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+	} else if (now - s->next_send > 10000000LL) {
+		s->next_send = now;  // idle a while: no burst to make up for it
+	}
+	s->next_send += bytes * s->ns_per_byte;
+}
 
-	//printf("\n\n%s\n\n",buf_temp);
+// send the n blocks in list to dest, one datagram each, paced; the blocks
+// go straight from the mapped file
+void send_blocks(struct mcast_sender *s, const uint32_t *list, int n,
+		const struct sockaddr_in *dest)
+{
+	static struct mcast_header headers[MCAST_BATCH];
+	static struct iovec iovs[MCAST_BATCH][2];
+	static struct mmsghdr msgs[MCAST_BATCH];
+	size_t bytes = 0;
+	int i, done = 0;
+
+	for (i = 0; i < n; i++) {
+		uint64_t off = (uint64_t)list[i] * MCAST_BLOCK;
+		size_t len = s->size - off < MCAST_BLOCK ? s->size - off : MCAST_BLOCK;
+
+		headers[i].magic = htonl(MCAST_MAGIC);
+		headers[i].session = htonl(s->session);
+		headers[i].type = htons(MCAST_DATA);
+		headers[i].count = htons(len);
+		headers[i].block = htonl(list[i]);
+		headers[i].size = htobe64(s->size);
+		iovs[i][0].iov_base = &headers[i];
+		iovs[i][0].iov_len = sizeof headers[i];
+		iovs[i][1].iov_base = (char *)s->data + off;
+		iovs[i][1].iov_len = len;
+		memset(&msgs[i].msg_hdr, 0, sizeof msgs[i].msg_hdr);
+		msgs[i].msg_hdr.msg_name = (void *)dest;
+		msgs[i].msg_hdr.msg_namelen = sizeof *dest;
+		msgs[i].msg_hdr.msg_iov = iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 2;
+		bytes += sizeof headers[i] + len;
+	}
+
+	pace(s, bytes);
+	while (done < n) {
+		int rv = sendmmsg(s->sockfd, msgs + done, n - done, 0);
+		if (rv == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			// a full queue loses the datagram; the receivers NACK it
+			if (errno != ENOBUFS && errno != EAGAIN) {
+				perror("sendmmsg");
+			}
+			done++;
+			continue;
+		}
+		done += rv;
+	}
+	s->sent += n;
+}
+
+void send_end(struct mcast_sender *s)
+{
+	struct mcast_header h;
+
+	memset(&h, 0, sizeof h);
+	h.magic = htonl(MCAST_MAGIC);
+	h.session = htonl(s->session);
+	h.type = htons(MCAST_END);
+	h.size = htobe64(s->size);
+	if (sendto(s->sockfd, &h, sizeof h, 0, (struct sockaddr *)&s->group,
+			sizeof s->group) == -1 && errno != ENOBUFS) {
+		perror("sendto");
+	}
+}
+
+void mark_pending(struct mcast_sender *s, uint32_t block)
+{
+	if (!(s->pending[block / 8] & (1 << block % 8))) {
+		s->pending[block / 8] |= 1 << block % 8;
+		s->npending++;
+	}
+}
 
-	if (fptr == NULL)
-        {
-    	    printf("Cannot open file \n");
-    	    exit(0);
-    	}
+// take in every NACK waiting on the socket: the blocks they name are queued
+// for the group, or sent to the receiver right away with unicast repair
+void read_nacks(struct mcast_sender *s)
+{
+	char buf[sizeof(struct mcast_header) + MCAST_MAX_RANGES * sizeof(struct mcast_range)];
+	struct mcast_header *h = (struct mcast_header *)buf;
+	struct mcast_range *ranges = (struct mcast_range *)(h + 1);
+	struct sockaddr_in from;
+	socklen_t from_len;
+	uint32_t list[MCAST_BATCH];
+	ssize_t n;
+	int i, count;
+
+	while (1) {
+		from_len = sizeof from;
+		n = recvfrom(s->sockfd, buf, sizeof buf, MSG_DONTWAIT,
+				(struct sockaddr *)&from, &from_len);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		count = n >= (ssize_t)sizeof *h ? ntohs(h->count) : 0;
+		if (n < (ssize_t)sizeof *h || ntohl(h->magic) != MCAST_MAGIC ||
+				ntohl(h->session) != s->session || ntohs(h->type) != MCAST_NACK ||
+				count > MCAST_MAX_RANGES || n < (ssize_t)(sizeof *h + count * sizeof *ranges)) {
+			continue;
+		}
+		s->nacks++;
+
+		for (i = 0; i < count; i++) {
+			uint32_t first = ntohl(ranges[i].first), last = ntohl(ranges[i].last), b;
+			int listed = 0;
+
+			if (first > last || last >= s->blocks) {
+				continue;
+			}
+			for (b = first; ; b++) {
+				if (!s->unicast_repair) {
+					mark_pending(s, b);
+				} else {
+					list[listed++] = b;
+					if (listed == MCAST_BATCH || b == last) {
+						send_blocks(s, list, listed, &from);
+						listed = 0;
+					}
+				}
+				if (b == last) {
+					break;
+				}
+			}
+		}
+	}
+}
+
+// send the next batch of pending blocks to the group
+void send_pending(struct mcast_sender *s)
+{
+	uint32_t list[MCAST_BATCH];
+	int n = 0;
+
+	while (n < MCAST_BATCH && s->npending > 0) {
+		uint32_t b = s->cursor;
+		s->cursor = s->cursor + 1 == s->blocks ? 0 : s->cursor + 1;
+		if (s->pending[b / 8] & (1 << b % 8)) {
+			s->pending[b / 8] &= ~(1 << b % 8);
+			s->npending--;
+			list[n++] = b;
+		}
+	}
+	send_blocks(s, list, n, &s->group);
+}
 
-	
-	//while(*string != '\0'){
-	//	printf("%c",*string++);
-	//}		
+// multicast mode: the file goes to the group once, as numbered blocks; after
+// that only what receivers NACK is sent again, so egress grows with loss
+// rather than with the number of receivers. Runs until killed.
+int serve_multicast(const struct message *m, const struct sockaddr_in *group,
+		const char *interface, long mbps, int unicast_repair)
+{
+	struct mcast_sender s;
+	struct pollfd pfd;
+	long long next_end = 0;
+	unsigned long long reported = 0;
+	uint32_t b;
+
+	memset(&s, 0, sizeof s);
+	s.group = *group;
+	s.unicast_repair = unicast_repair;
+	s.data = m->mem + m->header_len;
+	s.size = m->len - m->header_len;
+	s.blocks = (s.size + MCAST_BLOCK - 1) / MCAST_BLOCK;
+	s.ns_per_byte = mbps > 0 ? 8000.0 / mbps : 0;
+
+	if ((s.sockfd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+		perror("socket");
+		return 1;
+	}
+	if (interface) {
+		struct in_addr ifaddr;
+		if (inet_pton(AF_INET, interface, &ifaddr) != 1 ||
+				setsockopt(s.sockfd, IPPROTO_IP, IP_MULTICAST_IF, &ifaddr, sizeof ifaddr) == -1) {
+			fprintf(stderr, "server: can't send from interface %s\n", interface);
+			return 1;
+		}
+	}
+	// TTL stays at 1: the datagrams don't leave the local network. Loopback
+	// stays on (the default), so receivers on this host get them too.
+	if ((s.pending = calloc(s.blocks / 8 + 1, 1)) == NULL) {
+		perror("calloc");
+		return 1;
+	}
+	for (b = 0; b < s.blocks; b++) {
+		mark_pending(&s, b);
+	}
 
-    	fclose(fptr);	
+	srand(now_ns(CLOCK_MONOTONIC) ^ getpid());
+	s.session = rand();
+	pfd.fd = s.sockfd;
+	pfd.events = POLLIN;
+
+	printf("server: multicasting %llu bytes in %u blocks to %s:%d, session %08x\n",
+			(unsigned long long)s.size, s.blocks, inet_ntoa(group->sin_addr),
+			ntohs(group->sin_port), s.session);
+	fflush(stdout);
+
+	while (1) {
+		long long now = now_ns(CLOCK_MONOTONIC);
+		int timeout = s.npending ? 0 : (next_end - now) / 1000000;
+		if (poll(&pfd, 1, timeout > 0 ? timeout : 0) > 0) {
+			read_nacks(&s);
+		}
 
-	//printf("\n\n %s \n\n", buf_temp);
-	//printf("\n\n %s", &string[0]);
+		now = now_ns(CLOCK_MONOTONIC);
+		if (s.npending > 0) {
+			send_pending(&s);
+			if (s.npending == 0) {
+				next_end = now;  // done for now: say so at once
+			}
+		}
+		if (s.npending == 0 && now >= next_end) {
+			send_end(&s);
+			next_end = now + MCAST_END_INTERVAL_NS;
+			if (s.sent != reported) {
+				printf("server: %llu datagrams sent, %llu of them repairs for %llu NACKs\n",
+						s.sent, s.sent - s.blocks, s.nacks);
+				fflush(stdout);
+				reported = s.sent;
+			}
+		}
+	}
+}
 
+int main(int argc, char *argv[])
+{
+	struct message msg;
+	struct sockaddr_in group;
+	const char *group_spec = NULL, *interface = NULL;
+	long mbps = 100;
+	int fanout = 0, unicast_repair = 0, opt, bad = 0;
+
+	while ((opt = getopt(argc, argv, "fm:i:r:u")) != -1) {
+		switch (opt) {
+		case 'f': fanout = 1; break;
+		case 'm': group_spec = optarg; break;
+		case 'i': interface = optarg; break;
+		case 'r': mbps = atol(optarg); break;
+		case 'u': unicast_repair = 1; break;
+		default: bad = 1; break;
+		}
+	}
+	if (bad || optind != argc - 1 || (fanout && group_spec) || mbps < 0 ||
+			(!group_spec && (interface || unicast_repair)) ||
+			(group_spec && parse_group(group_spec, &group) == -1)) {
+	    fprintf(stderr,"usage: server [-f] filename\n");
+	    fprintf(stderr,"       server -m group[:port] [-i address] [-r mbps] [-u] filename\n");
+	    fprintf(stderr,"  -f  fan-out: serve every client from one process and one read-only\n");
+	    fprintf(stderr,"      copy of the file, for pushing the same file to many subscribers\n");
+	    fprintf(stderr,"  -m  multicast the file once to an IPv4 group (port %s by default) and\n", MCAST_PORT);
+	    fprintf(stderr,"      resend only what receivers (listener -m) report missing\n");
+	    fprintf(stderr,"  -i  the local address of the interface to multicast from\n");
+	    fprintf(stderr,"  -r  send rate in Mbit/s, 0 for unpaced (default 100)\n");
+	    fprintf(stderr,"  -u  send repairs to the receiver that asked, not the whole group\n");
+	    exit(1);
+	}
 
-	char* result = concat(buf_temp,"\n\n\n", &string[0]);	
+	if (load_message(argv[optind], &msg) == -1) {
+	    exit(1);
+	}
 
-	//printf("\n\n\nStart here\n%s",result);
+	if (group_spec) {
+	    return serve_multicast(&msg, &group, interface, mbps, unicast_repair);
+	}
 
 	int sockfd, new_fd;  // listen on sock_fd, new connection on new_fd
 	struct addrinfo hints, *servinfo, *p;
@@ -151,11 +611,19 @@ int main(int argc, char *argv[])
 
 	freeaddrinfo(servinfo); // all done with this structure
 
-	if (listen(sockfd, BACKLOG) == -1) {
+	if (listen(sockfd, fanout ? FANOUT_BACKLOG : BACKLOG) == -1) {
 		perror("listen");
 		exit(1);
 	}
 
+	// a subscriber hanging up mid-message must not kill the server
+	signal(SIGPIPE, SIG_IGN);
+
+	if (fanout) {
+		raise_fd_limit();
+		return serve_fanout(sockfd, &msg);
+	}
+
 	sa.sa_handler = sigchld_handler; // reap all dead processes
 	sigemptyset(&sa.sa_mask);
 	sa.sa_flags = SA_RESTART;
@@ -180,8 +648,9 @@ int main(int argc, char *argv[])
 		printf("server: got connection from %s\n", s);
 
 		if (!fork()) { // this is the child process
+			off_t sent = 0;
 			close(sockfd); // child doesn't need the listener
-			if (send(new_fd,result, strlen(result), 0) == -1)
+			if (send_message(new_fd, &msg, &sent) == -1)
 				perror("send");
 			close(new_fd);
 			exit(0);
@@ -191,4 +660,3 @@ int main(int argc, char *argv[])
 
 	return 0;
 }
-
@@ -2,28 +2,193 @@
 ** talker.c -- a datagram "client" demo
 */
 
+#define _GNU_SOURCE  // sendmmsg()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
+#include <endian.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 
+#include "udp_load.h"
+#include "timing.h"
+
 #define SERVERPORT "4950"	// the port users will be connecting to
 
+#define MAX_BATCH 1024       // datagrams per sendmmsg() at most
+#define SNDBUF_SIZE (4 << 20) // asked for, so bursts don't hit ENOBUFS
+
+struct load_opts {
+	int size;           // datagram payload bytes
+	long rate;          // datagrams per second, 0 for as fast as possible
+	int seconds;        // how long to run, 0 for until killed
+	int batch;          // datagrams per sendmmsg()
+};
+
+void sleep_until(long long ns)
+{
+	struct timespec ts = { ns / 1000000000LL, ns % 1000000000LL };
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+// send sequence-numbered datagrams on the connected socket, in batches,
+// paced to the rate; prints what went out once a second
+int send_load(int sockfd, const struct load_opts *o)
+{
+	static struct mmsghdr msgs[MAX_BATCH];
+	static struct iovec iovs[MAX_BATCH];
+	char *bufs;
+	uint32_t run;
+	uint64_t seq = 0;
+	long long start, next_report, end, sent_in_interval = 0, errors = 0;
+	int batch = o->batch, i;
+	double ns_per_datagram = 0;  // how long sendmmsg() takes per datagram, averaged
+
+	// at low rates, a batch holds about a millisecond's worth, so the
+	// datagrams don't go out in large bursts
+	if (o->rate > 0 && batch > o->rate / 1000) {
+		batch = o->rate / 1000 > 0 ? o->rate / 1000 : 1;
+	}
+
+	if ((bufs = calloc(batch, o->size)) == NULL) {
+		perror("calloc");
+		return 1;
+	}
+	for (i = 0; i < batch; i++) {
+		iovs[i].iov_base = bufs + (size_t)i * o->size;
+		iovs[i].iov_len = o->size;
+		memset(&msgs[i].msg_hdr, 0, sizeof msgs[i].msg_hdr);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	int sndbuf = SNDBUF_SIZE;
+	setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof sndbuf);  // best effort
+
+	srand(now_ns(CLOCK_REALTIME) ^ getpid());
+	run = rand();
+	start = now_ns(CLOCK_MONOTONIC);
+	next_report = start + 1000000000LL;
+	end = o->seconds > 0 ? start + o->seconds * 1000000000LL : 0;
+
+	printf("talker: sending %d-byte datagrams, %s%ld/s, %d per batch\n",
+			o->size, o->rate ? "" : "unpaced, up to ", o->rate, batch);
+	fflush(stdout);
+
+	while (1) {
+		long long now = now_ns(CLOCK_MONOTONIC);
+		if (end && now >= end) {
+			break;
+		}
+		if (now >= next_report) {
+			printf("talker: %lld pps, %.3f Gbps, %lld send errors\n",
+					sent_in_interval,
+					sent_in_interval * o->size * 8 / 1e9, errors);
+			fflush(stdout);
+			sent_in_interval = errors = 0;
+			next_report += 1000000000LL;
+		}
+		if (o->rate > 0) {
+			// when this batch is due, from the count sent so far; falling
+			// behind is caught up with back-to-back batches
+			long long due = start + (long long)(seq * 1000000000.0 / o->rate);
+			if (due > now) {
+				sleep_until(due < next_report ? due : next_report);
+				continue;
+			}
+		}
+
+		for (i = 0; i < batch; i++) {
+			struct load_header *h = iovs[i].iov_base;
+			h->magic = htonl(LOAD_MAGIC);
+			h->run = htonl(run);
+			h->seq = htobe64(seq + i);
+		}
+
+		// sendmmsg() may stop part way; the rest go in the next calls
+		int done = 0;
+		while (done < batch) {
+			// the datagrams of one call leave one after another, so each is
+			// stamped with when it should go out: the call's start plus the
+			// per-datagram cost so far. One stamp for the batch would make
+			// later datagrams look slower, and show up as jitter.
+			long long call_start = now_ns(CLOCK_REALTIME);
+			for (i = done; i < batch; i++) {
+				struct load_header *h = iovs[i].iov_base;
+				h->sent_ns = htobe64(call_start + (long long)((i - done) * ns_per_datagram));
+			}
+			int n = sendmmsg(sockfd, msgs + done, batch - done, 0);
+			if (n > 0) {
+				double cost = (double)(now_ns(CLOCK_REALTIME) - call_start) / n;
+				ns_per_datagram += (cost - ns_per_datagram) / 8;
+			}
+			if (n == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				// ECONNREFUSED: nobody listening yet, ENOBUFS: queue full;
+				// either way the datagram is lost, which the listener counts
+				if (errno != ECONNREFUSED && errno != ENOBUFS && errno != EAGAIN) {
+					perror("talker: sendmmsg");
+					free(bufs);
+					return 1;
+				}
+				errors++;
+				done++;
+				continue;
+			}
+			done += n;
+			sent_in_interval += n;
+		}
+		seq += batch;
+	}
+
+	printf("talker: sent %llu datagrams in %d s\n", (unsigned long long)seq, o->seconds);
+	free(bufs);
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	int sockfd;
 	struct addrinfo hints, *servinfo, *p;
-	int rv;
+	int rv, opt;
 	int numbytes;
+	struct load_opts o = { 1024, 0, 10, 64 };
+	int load, options = 0, bad = 0;
 
-	if (argc != 3) {
+	while ((opt = getopt(argc, argv, "s:r:d:b:")) != -1) {
+		options = 1;
+		switch (opt) {
+		case 's': o.size = atoi(optarg); break;
+		case 'r': o.rate = atol(optarg); break;
+		case 'd': o.seconds = atoi(optarg); break;
+		case 'b': o.batch = atoi(optarg); break;
+		default: bad = 1; break;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	load = argc == 1;  // no message: load mode
+
+	if (bad || argc < 1 || argc > 2 || (options && !load) ||
+			o.size < LOAD_MIN_SIZE || o.size > LOAD_MAX_SIZE ||
+			o.rate < 0 || o.seconds < 0 || o.batch < 1 || o.batch > MAX_BATCH) {
 		fprintf(stderr,"usage: talker hostname message\n");
+		fprintf(stderr,"       talker [-s size] [-r rate] [-d seconds] [-b batch] hostname\n");
+		fprintf(stderr,"  the second form sends sequence-numbered datagrams for listener to measure:\n");
+		fprintf(stderr,"  -s  payload bytes, %d to %d (default 1024)\n", LOAD_MIN_SIZE, LOAD_MAX_SIZE);
+		fprintf(stderr,"  -r  datagrams per second, 0 for as fast as possible (default 0)\n");
+		fprintf(stderr,"  -d  seconds to run, 0 for until killed (default 10)\n");
+		fprintf(stderr,"  -b  datagrams per sendmmsg() call, up to %d (default 64)\n", MAX_BATCH);
 		exit(1);
 	}
 
@@ -31,7 +196,7 @@ int main(int argc, char *argv[])
 	hints.ai_family = AF_UNSPEC;
 	hints.ai_socktype = SOCK_DGRAM;
 
-	if ((rv = getaddrinfo(argv[1], SERVERPORT, &hints, &servinfo)) != 0) {
+	if ((rv = getaddrinfo(argv[0], SERVERPORT, &hints, &servinfo)) != 0) {
 		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
 		return 1;
 	}
@@ -52,7 +217,19 @@ int main(int argc, char *argv[])
 		return 2;
 	}
 
-	if ((numbytes = sendto(sockfd, argv[2], strlen(argv[2]), 0,
+	if (load) {
+		// connected, so the batches need no per-datagram address
+		if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
+			perror("talker: connect");
+			exit(1);
+		}
+		freeaddrinfo(servinfo);
+		rv = send_load(sockfd, &o);
+		close(sockfd);
+		return rv;
+	}
+
+	if ((numbytes = sendto(sockfd, argv[1], strlen(argv[1]), 0,
 			 p->ai_addr, p->ai_addrlen)) == -1) {
 		perror("talker: sendto");
 		exit(1);
@@ -60,7 +237,7 @@ int main(int argc, char *argv[])
 
 	freeaddrinfo(servinfo);
 
-	printf("talker: sent %d bytes to %s\n", numbytes, argv[1]);
+	printf("talker: sent %d bytes to %s\n", numbytes, argv[0]);
 	close(sockfd);
 
 	return 0;
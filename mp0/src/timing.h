@@ -0,0 +1,18 @@
+/*
+** timing.h -- clock reading shared by the mp0 programs
+*/
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <time.h>
+
+// the clock's time in nanoseconds: CLOCK_MONOTONIC to measure intervals,
+// CLOCK_REALTIME for stamps compared across hosts
+static long long now_ns(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#endif
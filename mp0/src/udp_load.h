@@ -0,0 +1,24 @@
+/*
+** udp_load.h -- what talker's load mode puts at the front of each datagram
+*/
+#ifndef UDP_LOAD_H
+#define UDP_LOAD_H
+
+#include <stdint.h>
+
+#define LOAD_MAGIC 0x4c4f4144u  // "LOAD": tells load datagrams from plain messages
+#define LOAD_MIN_SIZE ((int)sizeof(struct load_header))
+#define LOAD_MAX_SIZE 65507     // largest UDP payload over IPv4
+
+/*
+ * all fields in network byte order; the rest of the datagram is filler
+ */
+struct load_header {
+	uint32_t magic;
+	uint32_t run;      // random per talker run, so a restart isn't counted as loss
+	uint64_t seq;      // 0, 1, 2, ... within the run
+	uint64_t sent_ns;  // CLOCK_REALTIME at send; only differences are used,
+	                   // so the two hosts' clocks needn't agree
+};
+
+#endif
@@ -0,0 +1,67 @@
+#!/bin/bash
+# Start http_server on a scratch directory of test files and load it with
+# http_bench, one scenario after another. Every result line is
+# scenario.key=value, so two runs diff cleanly:
+#   make bench > before.txt; (change the server); make bench > after.txt
+#   diff before.txt after.txt
+# The BENCH_* variables below tune the runs, e.g.
+#   make bench BENCH_SERVER_ARGS="-m uring -w 2" BENCH_DURATION=10
+
+PORT=${BENCH_PORT:-8099}
+SERVER_ARGS=${BENCH_SERVER_ARGS:-}
+THREADS=${BENCH_THREADS:-2}
+CONNS=${BENCH_CONNS:-32}
+DURATION=${BENCH_DURATION:-5}
+WARMUP=${BENCH_WARMUP:-1}
+RATE=${BENCH_RATE:-5000}  # open loop scenario, requests per second
+# mostly small files with a tail of large ones, by request count
+MIX=${BENCH_MIX:-/1k.bin:60,/16k.bin:25,/256k.bin:12,/4m.bin:3}
+
+bin=$(cd "$(dirname "$0")" && pwd)
+root=$(mktemp -d)
+trap 'kill $server 2>/dev/null; rm -rf "$root"' EXIT
+
+for f in 1k:1024 16k:16384 256k:262144 4m:4194304; do
+	head -c "${f#*:}" /dev/urandom > "$root/${f%%:*}.bin"
+done
+
+# something else on the port would be benchmarked in the server's place
+if (echo > "/dev/tcp/127.0.0.1/$PORT") 2> /dev/null; then
+	echo "bench: port $PORT is already in use" >&2
+	exit 1
+fi
+
+# the server's own chatter (clients hanging up when a run ends) goes to a log
+(cd "$root" && exec "$bin/http_server" $SERVER_ARGS "$PORT" > "$root/server.log" 2>&1) &
+server=$!
+# ready once it says so, i.e. after it has bound the port
+for i in $(seq 50); do
+	grep -q '^server: waiting for connections' "$root/server.log" && break
+	kill -0 $server 2> /dev/null || break
+	sleep 0.1
+done
+if ! grep -q '^server: waiting for connections' "$root/server.log"; then
+	echo "bench: http_server did not start" >&2
+	cat "$root/server.log" >&2
+	exit 1
+fi
+
+# a run with failed requests measured something other than the server
+# working, so it must not end up as a baseline
+run() {
+	local label=$1 out
+	shift
+	out=$("$bin/http_bench" -L "$label" -t "$THREADS" -d "$DURATION" -w "$WARMUP" -f "$MIX" "$@" \
+		"127.0.0.1:$PORT") || exit 1
+	echo "$out"
+	if echo "$out" | grep -Eq '\.(errors|failures)=[1-9]'; then
+		echo "bench: $label had failed requests" >&2
+		exit 1
+	fi
+}
+
+echo "server.args=$SERVER_ARGS"
+echo "mix=$MIX"
+run closed_keepalive -c "$CONNS" -k
+run closed_close -c "$CONNS" -C
+run open_keepalive -c "$CONNS" -k -R "$RATE"
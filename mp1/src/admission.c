@@ -0,0 +1,141 @@
+/*
+** admission.c -- overload protection: connection and byte caps, load shedding
+** and per-client rate limits
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+
+#include "admission.h"
+#include "stats.h"
+
+#define STR_(x) #x
+#define STR(x) STR_(x)
+
+static const char refusal[] = "HTTP/1.1 503 Service Unavailable\r\n"
+	"Retry-After: " STR(ADMIT_RETRY_AFTER) "\r\n"
+	"Content-Length: 0\r\nConnection: close\r\n\r\n";
+
+struct rate_slot {
+	char lock;                 // taken with __atomic_test_and_set, works across processes
+	char used;
+	unsigned char addr[16];    // IPv6, or IPv4-mapped
+	double tokens;
+	unsigned long long stamp;  // CLOCK_MONOTONIC microseconds of the last refill
+};
+
+struct rate_limiter {
+	double rate;
+	double burst;
+	struct rate_slot slots[RATE_LIMIT_SLOTS];
+};
+
+struct rate_limiter *rate_limiter_create(double rate, double burst)
+{
+	struct rate_limiter *rl;
+
+	// shared, so fork children update the parent's buckets; anonymous
+	// mappings start zeroed, every slot unused
+	rl = mmap(NULL, sizeof(*rl), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (rl == MAP_FAILED) {
+		perror("rate limiter: mmap");
+		return NULL;
+	}
+	rl->rate = rate;
+	rl->burst = burst < 1 ? 1 : burst;
+	return rl;
+}
+
+// the client's address as 16 bytes, -1 for families we don't limit
+static int address_key(const struct sockaddr_storage *addr, unsigned char key[16])
+{
+	if (addr->ss_family == AF_INET) {
+		const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+		memset(key, 0, 10);
+		key[10] = key[11] = 0xff;
+		memcpy(key + 12, &in->sin_addr, 4);
+		return 0;
+	}
+	if (addr->ss_family == AF_INET6) {
+		memcpy(key, &((const struct sockaddr_in6 *)addr)->sin6_addr, 16);
+		return 0;
+	}
+	return -1;
+}
+
+// FNV-1a
+static unsigned int hash_key(const unsigned char key[16])
+{
+	unsigned int h = 2166136261u;
+	int i;
+	for (i = 0; i < 16; i++) {
+		h ^= key[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+unsigned int rate_limiter_take(struct rate_limiter *rl, const struct sockaddr_storage *addr)
+{
+	unsigned char key[16];
+	unsigned long long now = stats_now_usec();
+	unsigned int wait = 0;
+	struct rate_slot *s;
+
+	if (address_key(addr, key) == -1) {
+		return 0;
+	}
+	s = &rl->slots[hash_key(key) % RATE_LIMIT_SLOTS];
+	while (__atomic_test_and_set(&s->lock, __ATOMIC_ACQUIRE)) {
+		;  // held for a few instructions at most
+	}
+
+	double tokens = s->tokens + (now - s->stamp) / 1e6 * rl->rate;
+	if (tokens > rl->burst) {
+		tokens = rl->burst;
+	}
+	if (!s->used || memcmp(s->addr, key, 16) != 0) {
+		if (s->used && tokens < rl->burst) {
+			// the slot belongs to another client that is still active; the
+			// table is direct mapped, so rather than charge this client for
+			// the other's requests it goes unlimited until the slot frees up
+			__atomic_clear(&s->lock, __ATOMIC_RELEASE);
+			return 0;
+		}
+		s->used = 1;
+		memcpy(s->addr, key, 16);
+		tokens = rl->burst;
+	}
+
+	if (tokens >= 1) {
+		tokens -= 1;
+	} else {
+		wait = (unsigned int)((1 - tokens) / rl->rate) + 1;
+	}
+	s->tokens = tokens;
+	s->stamp = now;
+	__atomic_clear(&s->lock, __ATOMIC_RELEASE);
+	return wait;
+}
+
+void admission_refuse(int fd)
+{
+	char buf[4096];
+	int i;
+
+	send(fd, refusal, sizeof(refusal) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+	shutdown(fd, SHUT_WR);
+
+	// closing with unread request bytes answers them with a RST, which can
+	// destroy the 503 before the client reads it; swallow what is already here
+	for (i = 0; i < 4 && recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0; i++) {
+		;
+	}
+	close(fd);
+}
@@ -0,0 +1,64 @@
+/*
+** admission.h -- overload protection: connection and byte caps, load shedding
+** and per-client rate limits
+*/
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <sys/socket.h>
+
+#define ADMIT_MAX_CONNS 4096          // default connections open at once, whole server
+#define ADMIT_MAX_BYTES (1LL << 30)   // default response bytes owed to clients, whole server
+#define ADMIT_MAX_DEPTH 1024          // default responses in progress, whole server
+#define ADMIT_MAX_LATENCY_MS 200      // default smoothed event loop lag of any one worker
+
+#define ADMIT_RETRY_AFTER 1           // seconds an overloaded server asks clients to wait
+
+#define RATE_LIMIT_SLOTS 8192         // clients tracked at once by the rate limiter
+
+// why a connection or request was turned away, the label of mp1_shed_total
+enum shed_reason {
+	SHED_CONNS,    // too many connections open
+	SHED_BYTES,    // too many response bytes not yet sent
+	SHED_DEPTH,    // too many responses in progress
+	SHED_LATENCY,  // the event loop falls behind
+	SHED_RATE,     // the client exceeded its request rate
+	SHED_REASONS,
+};
+
+// 0 disables a limit; conns, bytes and depth are split evenly over the workers
+struct admission_limits {
+	unsigned int conns;
+	long long bytes;
+	unsigned int depth;
+	unsigned int latency_ms;
+};
+
+/*
+ * Token bucket per client address: each request takes a token, tokens come
+ * back at rate per second up to burst. The table lives in shared memory so
+ * that every worker thread and fork child draws from the same buckets.
+ */
+struct rate_limiter;
+
+/*
+ * create a limiter granting each address rate requests per second with
+ * bursts of up to burst requests
+ * output - the limiter, or NULL if it can't be mapped
+ */
+struct rate_limiter *rate_limiter_create(double rate, double burst);
+
+/*
+ * take a token for one request from addr
+ * output - 0 if the request may go ahead, otherwise the seconds until the
+ *          client's next token (rounded up, at least 1)
+ */
+unsigned int rate_limiter_take(struct rate_limiter *rl, const struct sockaddr_storage *addr);
+
+/*
+ * turn away a connection the server won't serve: a canned 503 with
+ * Retry-After goes out on a best effort basis, then the socket is closed
+ */
+void admission_refuse(int fd);
+
+#endif
@@ -0,0 +1,680 @@
+/*
+** bench.c -- HTTP load generator for the mp1 server
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <math.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MAX_PATHS 32
+#define MAX_REQUEST 512
+#define MAX_RESPONSE_HEADER 8192
+#define MAX_EVENTS 256
+#define BACKLOG_SIZE 65536  // open loop: arrivals waiting for a free connection
+
+// latency histogram: 64 linear buckets per power of two of nanoseconds,
+// so a bucket is within 1.6% of any value in it
+#define HIST_SUB_BITS 6
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+enum bench_state {
+	BENCH_IDLE,     // open loop: waiting for the next arrival
+	BENCH_SENDING,  // connecting, or writing the request
+	BENCH_HEADER,   // reading the response header
+	BENCH_BODY,     // counting off the body
+};
+
+// one entry of the request mix
+struct target {
+	char path[256];
+	unsigned int weight;
+	char request[2][MAX_REQUEST];  // [keep_alive]
+	size_t request_len[2];
+};
+
+struct bench_conn {
+	int fd;                 // -1 while not connected
+	enum bench_state state;
+	const char *request;
+	size_t request_len;
+	size_t request_sent;
+	char header[MAX_RESPONSE_HEADER];
+	size_t header_len;
+	long long body_left;    // -1: until the server closes
+	int closes;             // the server said Connection: close
+	int status;
+	uint64_t start;         // when the request was due, ns
+	struct thread_ctx *t;
+	struct bench_conn *next_idle;
+};
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+struct thread_ctx {
+	int id;
+	pthread_t thread;
+	int epfd;
+	int nconns;
+	struct bench_conn *conns;
+	struct bench_conn *idle;
+	uint64_t rng;
+	double rate;            // arrivals per second, 0 for a closed loop
+	uint64_t next_arrival;
+	uint64_t *backlog;      // due times of arrivals with no connection free
+	unsigned int backlog_head;
+	unsigned int backlog_len;
+
+	// from the end of the warm-up on
+	struct histogram hist;
+	unsigned long long requests;
+	unsigned long long errors;    // answered with a status of 400 or above
+	unsigned long long failures;  // connection refused, reset or cut short
+	unsigned long long bytes;     // response bytes, headers included
+	unsigned long long connects;
+	unsigned long long dropped;   // open loop: arrivals past the backlog
+};
+
+// settings, fixed once the threads start
+static struct addrinfo *server_addr;
+static struct target targets[MAX_PATHS];
+static int ntargets;
+static unsigned int total_weight;
+static int keep_alive = 1;
+static uint64_t measure_from;   // end of the warm-up
+static uint64_t measure_until;  // end of the run
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t next_random(struct thread_ctx *t)
+{
+	// xorshift64*
+	t->rng ^= t->rng >> 12;
+	t->rng ^= t->rng << 25;
+	t->rng ^= t->rng >> 27;
+	return t->rng * 2685821657736338717ULL;
+}
+
+static int hist_index(uint64_t v)
+{
+	if (v < HIST_SUB) {
+		return v;
+	}
+	int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + (int)((v >> shift) - HIST_SUB);
+}
+
+// the middle of bucket i
+static double hist_value(int i)
+{
+	if (i < HIST_SUB) {
+		return i;
+	}
+	int shift = i / HIST_SUB - 1;
+	double low = (double)((uint64_t)(HIST_SUB + i % HIST_SUB) << shift);
+	return low + ((1ULL << shift) - 1) / 2.0;
+}
+
+static void hist_record(struct histogram *h, uint64_t v)
+{
+	h->buckets[hist_index(v)]++;
+	h->count++;
+	h->sum += v;
+	if (v > h->max) {
+		h->max = v;
+	}
+}
+
+static void hist_merge(struct histogram *into, const struct histogram *h)
+{
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		into->buckets[i] += h->buckets[i];
+	}
+	into->count += h->count;
+	into->sum += h->sum;
+	if (h->max > into->max) {
+		into->max = h->max;
+	}
+}
+
+// value at quantile q (0..1), ns
+static double hist_quantile(const struct histogram *h, double q)
+{
+	uint64_t rank = (uint64_t)ceil(q * h->count), seen = 0;
+	int i;
+
+	if (h->count == 0) {
+		return 0;
+	}
+	if (rank == 0) {
+		rank = 1;
+	}
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank) {
+			double v = hist_value(i);
+			return v < h->max ? v : h->max;
+		}
+	}
+	return h->max;
+}
+
+// parse "path[:weight],..." into targets[]; returns -1 if malformed
+static int parse_mix(const char *mix, const char *host)
+{
+	char buf[4096], *item, *save, *colon;
+	int i;
+
+	if (snprintf(buf, sizeof(buf), "%s", mix) >= (int)sizeof(buf)) {
+		return -1;
+	}
+	for (item = strtok_r(buf, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+		struct target *tg = &targets[ntargets];
+		char *end;
+
+		if (ntargets == MAX_PATHS) {
+			return -1;
+		}
+		tg->weight = 1;
+		if ((colon = strchr(item, ':'))) {
+			*colon = '\0';
+			tg->weight = strtoul(colon + 1, &end, 10);
+			if (*end != '\0' || colon[1] == '\0') {
+				return -1;
+			}
+		}
+		if (item[0] != '/' || strlen(item) >= sizeof(tg->path)) {
+			return -1;
+		}
+		strcpy(tg->path, item);
+		for (i = 0; i < 2; i++) {
+			int n = snprintf(tg->request[i], MAX_REQUEST, "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n",
+					item, host, i ? "" : "Connection: close\r\n");
+			if (n >= MAX_REQUEST) {
+				return -1;
+			}
+			tg->request_len[i] = n;
+		}
+		total_weight += tg->weight;
+		ntargets++;
+	}
+	return ntargets > 0 && total_weight > 0 ? 0 : -1;
+}
+
+static const struct target *pick_target(struct thread_ctx *t)
+{
+	unsigned int r = next_random(t) % total_weight;
+	int i;
+
+	for (i = 0; r >= targets[i].weight; i++) {
+		r -= targets[i].weight;
+	}
+	return &targets[i];
+}
+
+static void drop_connection(struct bench_conn *c)
+{
+	close(c->fd);  // also leaves the epoll set
+	c->fd = -1;
+}
+
+// begin a request due at start, connecting first if need be
+static void start_request(struct bench_conn *c, uint64_t start)
+{
+	const struct target *tg = pick_target(c->t);
+
+	if (c->fd == -1) {
+		struct epoll_event ev;
+		int one = 1;
+
+		c->fd = socket(server_addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (c->fd == -1) {
+			perror("socket");
+			exit(1);
+		}
+		setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if (connect(c->fd, server_addr->ai_addr, server_addr->ai_addrlen) == -1 &&
+				errno != EINPROGRESS) {
+			perror("connect");
+			exit(1);
+		}
+		// edge-triggered both ways, like the server: the handler runs the
+		// state machine until the socket would block
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = c;
+		epoll_ctl(c->t->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+		if (start >= measure_from) {
+			c->t->connects++;
+		}
+	}
+	c->state = BENCH_SENDING;
+	c->request = tg->request[keep_alive];
+	c->request_len = tg->request_len[keep_alive];
+	c->request_sent = 0;
+	c->header_len = 0;
+	c->start = start;
+}
+
+static void drive(struct bench_conn *c);
+
+// an arrival is due at when: start it, or queue it behind the busy connections
+static void arrive(struct thread_ctx *t, uint64_t when)
+{
+	struct bench_conn *c = t->idle;
+
+	if (c) {
+		t->idle = c->next_idle;
+		start_request(c, when);
+		drive(c);  // a kept-alive socket is writable already, no edge will come
+		return;
+	}
+	if (t->backlog_len == BACKLOG_SIZE) {
+		if (when >= measure_from) {
+			t->dropped++;
+		}
+		return;
+	}
+	t->backlog[(t->backlog_head + t->backlog_len++) % BACKLOG_SIZE] = when;
+}
+
+// the connection is free again: in a closed loop it goes straight on, in
+// an open loop it takes the oldest queued arrival or waits for the next
+static void next_request(struct bench_conn *c)
+{
+	struct thread_ctx *t = c->t;
+
+	if (t->rate == 0) {
+		start_request(c, now_ns());
+	} else if (t->backlog_len > 0) {
+		uint64_t when = t->backlog[t->backlog_head];
+		t->backlog_head = (t->backlog_head + 1) % BACKLOG_SIZE;
+		t->backlog_len--;
+		start_request(c, when);
+	} else {
+		c->state = BENCH_IDLE;
+		c->next_idle = t->idle;
+		t->idle = c;
+	}
+}
+
+static void complete(struct bench_conn *c)
+{
+	struct thread_ctx *t = c->t;
+	uint64_t now = now_ns();
+
+	if (c->start >= measure_from && now < measure_until) {
+		hist_record(&t->hist, now - c->start);
+		t->requests++;
+		if (c->status >= 400) {
+			t->errors++;
+		}
+	}
+	if (!keep_alive || c->closes) {
+		drop_connection(c);
+	}
+	next_request(c);
+}
+
+static void fail(struct bench_conn *c)
+{
+	if (c->start >= measure_from && now_ns() < measure_until) {
+		c->t->failures++;
+	}
+	drop_connection(c);
+	next_request(c);
+}
+
+// find what the header says about the body; returns -1 if it is malformed
+static int parse_header(struct bench_conn *c, size_t len)
+{
+	char *line = memchr(c->header, '\n', len), *p, *end = c->header + len;
+
+	if (sscanf(c->header, "HTTP/1.%*d %d", &c->status) != 1 || !line) {
+		return -1;
+	}
+	c->body_left = -1;
+	c->closes = 0;
+	for (p = line + 1; p < end; p = line + 1) {
+		if (!(line = memchr(p, '\n', end - p))) {
+			break;
+		}
+		if (strncasecmp(p, "content-length:", 15) == 0) {
+			c->body_left = strtoll(p + 15, NULL, 10);
+		} else if (strncasecmp(p, "connection:", 11) == 0) {
+			char *close_token = strcasestr(p, "close");
+			c->closes = close_token && close_token < line;
+		}
+	}
+	if (c->status == 204 || c->status == 304 || (c->status >= 100 && c->status < 200)) {
+		c->body_left = 0;
+	}
+	if (c->body_left == -1) {
+		c->closes = 1;  // delimited by the close
+	}
+	return 0;
+}
+
+// run the connection until its socket would block
+static void drive(struct bench_conn *c)
+{
+	static __thread char sink[1 << 16];
+	struct thread_ctx *t = c->t;
+	ssize_t n;
+
+	while (1) {
+		switch (c->state) {
+		case BENCH_IDLE:
+			// nothing asked of it, but the server may have closed it
+			if (c->fd != -1 && (n = recv(c->fd, sink, sizeof(sink), 0)) != -1) {
+				drop_connection(c);
+			}
+			return;
+		case BENCH_SENDING:
+			n = send(c->fd, c->request + c->request_sent, c->request_len - c->request_sent,
+					MSG_NOSIGNAL);
+			if (n == -1) {
+				if (errno != EAGAIN) {
+					fail(c);  // including a refused connect
+				}
+				return;
+			}
+			if ((c->request_sent += n) == c->request_len) {
+				c->state = BENCH_HEADER;
+			}
+			break;
+		case BENCH_HEADER: {
+			n = recv(c->fd, c->header + c->header_len, sizeof(c->header) - c->header_len, 0);
+			if (n <= 0) {
+				if (n == 0 || errno != EAGAIN) {
+					fail(c);
+				}
+				return;
+			}
+			if (c->start >= measure_from) {
+				t->bytes += n;
+			}
+			size_t before = c->header_len > 3 ? c->header_len - 3 : 0;
+			c->header_len += n;
+			char *eoh = memmem(c->header + before, c->header_len - before, "\r\n\r\n", 4);
+			if (!eoh) {
+				if (c->header_len == sizeof(c->header)) {
+					fail(c);
+					return;
+				}
+				break;
+			}
+			size_t header_len = eoh + 4 - c->header;
+			if (parse_header(c, header_len) == -1) {
+				fail(c);
+				return;
+			}
+			c->state = BENCH_BODY;
+			if (c->body_left != -1) {
+				// the server doesn't pipeline, all of this is body
+				c->body_left -= c->header_len - header_len;
+			}
+			break;
+		}
+		case BENCH_BODY:
+			if (c->body_left == 0) {
+				complete(c);
+				break;
+			}
+			n = recv(c->fd, sink, c->body_left > 0 && c->body_left < (long long)sizeof(sink) ?
+					(size_t)c->body_left : sizeof(sink), 0);
+			if (n == 0 && c->body_left == -1) {
+				complete(c);
+				break;
+			}
+			if (n <= 0) {
+				if (n == 0 || errno != EAGAIN) {
+					fail(c);
+				}
+				return;
+			}
+			if (c->start >= measure_from) {
+				t->bytes += n;
+			}
+			if (c->body_left != -1) {
+				c->body_left -= n;
+			}
+			break;
+		}
+		if (c->fd == -1) {
+			return;  // closed, the next request waits for an arrival
+		}
+	}
+}
+
+// exponential gaps make the arrivals a Poisson process
+static uint64_t arrival_gap(struct thread_ctx *t)
+{
+	double u = (next_random(t) >> 11) * (1.0 / 9007199254740992.0);
+	return (uint64_t)(-log(1.0 - u) / t->rate * 1e9);
+}
+
+static void *bench_main(void *arg)
+{
+	struct thread_ctx *t = arg;
+	struct epoll_event events[MAX_EVENTS];
+	uint64_t now;
+	int i, n, timeout;
+
+	if ((t->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		perror("epoll_create1");
+		exit(1);
+	}
+	now = now_ns();
+	for (i = 0; i < t->nconns; i++) {
+		struct bench_conn *c = &t->conns[i];
+		c->fd = -1;
+		c->t = t;
+		if (t->rate == 0) {
+			start_request(c, now);
+			drive(c);
+		} else {
+			c->state = BENCH_IDLE;
+			c->next_idle = t->idle;
+			t->idle = c;
+		}
+	}
+	t->next_arrival = now + arrival_gap(t);
+
+	while ((now = now_ns()) < measure_until) {
+		// arrivals are started late by up to the epoll timeout's granularity,
+		// but their latency counts from when they were due
+		while (t->rate > 0 && t->next_arrival <= now) {
+			arrive(t, t->next_arrival);
+			t->next_arrival += arrival_gap(t);
+		}
+
+		uint64_t wake = measure_until;
+		if (t->rate > 0 && t->next_arrival < wake) {
+			wake = t->next_arrival;
+		}
+		timeout = (int)((wake - now + 999999) / 1000000);
+		n = epoll_wait(t->epfd, events, MAX_EVENTS, timeout);
+		if (n == -1 && errno != EINTR) {
+			perror("epoll_wait");
+			exit(1);
+		}
+		for (i = 0; i < n; i++) {
+			drive(events[i].data.ptr);
+		}
+	}
+	for (i = 0; i < t->nconns; i++) {
+		if (t->conns[i].fd != -1) {
+			close(t->conns[i].fd);
+		}
+	}
+	close(t->epfd);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	int nthreads = 1, nconns = 8, opt, i, bad_usage = 0;
+	double duration = 5, warmup = 0, rate = 0;
+	const char *mix = "/", *label = NULL;
+	char host[256], port[16], prefix[64], extra;
+	struct addrinfo hints;
+	struct thread_ctx *threads;
+	struct histogram *total;
+	unsigned long long requests = 0, errors = 0, failures = 0, bytes = 0, connects = 0, dropped = 0;
+	uint64_t start;
+	char *end;
+	int rv;
+
+	while ((opt = getopt(argc, argv, "t:c:d:w:R:f:kCL:")) != -1) {
+		switch (opt) {
+		case 't':
+			nthreads = strtol(optarg, &end, 10);
+			bad_usage |= *end != '\0' || nthreads < 1;
+			break;
+		case 'c':
+			nconns = strtol(optarg, &end, 10);
+			bad_usage |= *end != '\0' || nconns < 1;
+			break;
+		case 'd':
+			duration = strtod(optarg, &end);
+			bad_usage |= *end != '\0' || duration <= 0;
+			break;
+		case 'w':
+			warmup = strtod(optarg, &end);
+			bad_usage |= *end != '\0' || warmup < 0;
+			break;
+		case 'R':
+			rate = strtod(optarg, &end);
+			bad_usage |= *end != '\0' || rate < 0;
+			break;
+		case 'f':
+			mix = optarg;
+			break;
+		case 'k':
+			keep_alive = 1;
+			break;
+		case 'C':
+			keep_alive = 0;
+			break;
+		case 'L':
+			label = optarg;
+			break;
+		default:
+			bad_usage = 1;
+		}
+	}
+	if (!bad_usage && argc - optind == 1 &&
+			sscanf(argv[optind], "%255[^:]:%15[0-9]%c", host, port, &extra) == 2 &&
+			parse_mix(mix, argv[optind]) == 0 && nconns >= nthreads) {
+		;
+	} else {
+		fprintf(stderr, "usage: http_bench [-t threads] [-c connections] [-d seconds] [-w seconds]\n"
+				"                  [-R rate] [-k|-C] [-f path[:weight],...] [-L label] host:port\n");
+		fprintf(stderr, "  -t  client threads, each with its own epoll loop (default 1)\n");
+		fprintf(stderr, "  -c  connections in all, at least one per thread (default 8)\n");
+		fprintf(stderr, "  -d  seconds measured (default 5), after -w seconds of warm-up (default 0)\n");
+		fprintf(stderr, "  -R  open loop: requests per second in all, arriving as a Poisson process;\n");
+		fprintf(stderr, "      latency counts from when a request was due, queueing for a free\n");
+		fprintf(stderr, "      connection included. Without -R each connection sends its next\n");
+		fprintf(stderr, "      request as soon as the last response is in (closed loop)\n");
+		fprintf(stderr, "  -k  keep connections alive between requests (default)\n");
+		fprintf(stderr, "  -C  a new connection for every request\n");
+		fprintf(stderr, "  -f  paths to request, picked at random in proportion to their weight\n");
+		fprintf(stderr, "      (default 1), e.g. /1k.bin:70,/64k.bin:25,/4m.bin:5 for a size mix\n");
+		fprintf(stderr, "  -L  prefix every result key with label.\n");
+		fprintf(stderr, "Results are printed as key=value lines, in a fixed order, to diff runs\n");
+		return 1;
+	}
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((rv = getaddrinfo(host, port, &hints, &server_addr)) != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+		return 1;
+	}
+
+	if (!(threads = calloc(nthreads, sizeof(*threads))) || !(total = calloc(1, sizeof(*total)))) {
+		perror("calloc");
+		return 1;
+	}
+	start = now_ns();
+	measure_from = start + (uint64_t)(warmup * 1e9);
+	measure_until = measure_from + (uint64_t)(duration * 1e9);
+	for (i = 0; i < nthreads; i++) {
+		struct thread_ctx *t = &threads[i];
+		t->id = i;
+		t->nconns = nconns / nthreads + (i < nconns % nthreads);
+		t->rate = rate / nthreads;
+		t->rng = 0x9e3779b97f4a7c15ULL * (i + 1) ^ start;
+		if (!(t->conns = calloc(t->nconns, sizeof(*t->conns))) ||
+				(rate > 0 && !(t->backlog = malloc(BACKLOG_SIZE * sizeof(*t->backlog))))) {
+			perror("malloc");
+			return 1;
+		}
+		if ((rv = pthread_create(&t->thread, NULL, bench_main, t)) != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(rv));
+			return 1;
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		struct thread_ctx *t = &threads[i];
+		pthread_join(t->thread, NULL);
+		hist_merge(total, &t->hist);
+		requests += t->requests;
+		errors += t->errors;
+		failures += t->failures;
+		bytes += t->bytes;
+		connects += t->connects;
+		dropped += t->dropped;
+	}
+
+	snprintf(prefix, sizeof(prefix), "%s%s", label ? label : "", label ? "." : "");
+	printf("%smode=%s\n", prefix, rate > 0 ? "open" : "closed");
+	printf("%sthreads=%d\n", prefix, nthreads);
+	printf("%sconnections=%d\n", prefix, nconns);
+	printf("%skeep_alive=%d\n", prefix, keep_alive);
+	printf("%starget_rate=%.0f\n", prefix, rate);
+	printf("%sduration_s=%.2f\n", prefix, duration);
+	printf("%srequests=%llu\n", prefix, requests);
+	printf("%serrors=%llu\n", prefix, errors);
+	printf("%sfailures=%llu\n", prefix, failures);
+	printf("%sdropped=%llu\n", prefix, dropped);
+	printf("%sconnects=%llu\n", prefix, connects);
+	printf("%sthroughput_rps=%.1f\n", prefix, requests / duration);
+	printf("%sthroughput_mbps=%.2f\n", prefix, bytes * 8 / duration / 1e6);
+	printf("%slatency_mean_us=%.1f\n", prefix, total->count ? total->sum / 1e3 / total->count : 0);
+	printf("%slatency_p50_us=%.1f\n", prefix, hist_quantile(total, 0.50) / 1e3);
+	printf("%slatency_p99_us=%.1f\n", prefix, hist_quantile(total, 0.99) / 1e3);
+	printf("%slatency_p999_us=%.1f\n", prefix, hist_quantile(total, 0.999) / 1e3);
+	printf("%slatency_max_us=%.1f\n", prefix, total->max / 1e3);
+	return 0;
+}
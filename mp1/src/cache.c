@@ -0,0 +1,254 @@
+/*
+** cache.c -- bounded LRU cache of small, hot files and their response headers
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "counter.h"
+#include "http.h"
+
+#define CACHE_BUCKETS CACHE_MAX_ENTRIES  // keep chains about one entry long
+
+struct cache {
+	size_t capacity;
+	struct cache_entry *buckets[CACHE_BUCKETS];
+	struct cache_entry *lru_head, *lru_tail;  // head is the most recently used
+	struct cache_stats stats;
+};
+
+// FNV-1a
+static unsigned long hash_path(const char *path)
+{
+	unsigned long h = 2166136261u;
+	while (*path) {
+		h ^= (unsigned char)*path++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static void lru_unlink(struct cache *cache, struct cache_entry *e)
+{
+	if (e->lru_prev) {
+		e->lru_prev->lru_next = e->lru_next;
+	} else {
+		cache->lru_head = e->lru_next;
+	}
+	if (e->lru_next) {
+		e->lru_next->lru_prev = e->lru_prev;
+	} else {
+		cache->lru_tail = e->lru_prev;
+	}
+	e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push_front(struct cache *cache, struct cache_entry *e)
+{
+	e->lru_prev = NULL;
+	e->lru_next = cache->lru_head;
+	if (cache->lru_head) {
+		cache->lru_head->lru_prev = e;
+	} else {
+		cache->lru_tail = e;
+	}
+	cache->lru_head = e;
+}
+
+void cache_release(struct cache_entry *e)
+{
+	if (--e->refs == 0) {
+		free(e->path);
+		free(e->data);
+		free(e);
+	}
+}
+
+// take e out of the table; connections still sending it keep it alive
+static void remove_entry(struct cache *cache, struct cache_entry *e)
+{
+	struct cache_entry **pp = &cache->buckets[hash_path(e->path) % CACHE_BUCKETS];
+	while (*pp != e) {
+		pp = &(*pp)->hash_next;
+	}
+	*pp = e->hash_next;
+	lru_unlink(cache, e);
+	COUNTER_ADD(cache->stats.entries, -1);
+	COUNTER_ADD(cache->stats.bytes, -e->size);
+	cache_release(e);
+}
+
+static struct cache_entry *find_entry(struct cache *cache, const char *path)
+{
+	struct cache_entry *e = cache->buckets[hash_path(path) % CACHE_BUCKETS];
+	while (e && strcmp(e->path, path) != 0) {
+		e = e->hash_next;
+	}
+	return e;
+}
+
+static int same_file(const struct stat *a, const struct stat *b)
+{
+	return a->st_ino == b->st_ino && a->st_dev == b->st_dev && a->st_size == b->st_size &&
+		a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// read the whole file into a new entry, NULL if it can't be read consistently
+static struct cache_entry *load_entry(const char *path, int fd, const struct stat *st)
+{
+	struct cache_entry *e = calloc(1, sizeof(*e));
+	if (!e) {
+		return NULL;
+	}
+	e->path = strdup(path);
+	e->data = malloc(st->st_size > 0 ? st->st_size : 1);
+	if (!e->path || !e->data) {
+		goto fail;
+	}
+
+	off_t got = 0;
+	while (got < st->st_size) {
+		ssize_t n = pread(fd, e->data + got, st->st_size - got, got);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			goto fail;  // read error, or the file shrank while we read it
+		}
+		got += n;
+	}
+
+	e->size = st->st_size;
+	e->st = *st;
+	e->checked = time(NULL);
+	e->header_len = snprintf(e->header, sizeof(e->header),
+			"HTTP/1.1 200 OK\r\nContent-Length: %lld\r\nAccept-Ranges: bytes\r\n",
+			(long long)e->size);
+	e->header_len += http_validator_headers(st, e->header + e->header_len,
+			sizeof(e->header) - e->header_len);
+	e->refs = 1;  // the table's reference
+	return e;
+
+fail:
+	free(e->path);
+	free(e->data);
+	free(e);
+	return NULL;
+}
+
+static void insert_entry(struct cache *cache, struct cache_entry *e)
+{
+	// make room, oldest first
+	while (cache->lru_tail && (cache->stats.bytes + e->size > cache->capacity ||
+				cache->stats.entries >= CACHE_MAX_ENTRIES)) {
+		remove_entry(cache, cache->lru_tail);
+		COUNTER_INC(cache->stats.evictions);
+	}
+
+	struct cache_entry **bucket = &cache->buckets[hash_path(e->path) % CACHE_BUCKETS];
+	e->hash_next = *bucket;
+	*bucket = e;
+	lru_push_front(cache, e);
+	COUNTER_INC(cache->stats.entries);
+	COUNTER_ADD(cache->stats.bytes, e->size);
+}
+
+struct cache *cache_create(size_t capacity)
+{
+	struct cache *cache;
+
+	if (capacity == 0) {
+		return NULL;
+	}
+	if (!(cache = calloc(1, sizeof(*cache)))) {
+		perror("cache: calloc");
+		return NULL;
+	}
+	cache->capacity = capacity;
+	return cache;
+}
+
+struct cache_entry *cache_open(struct cache *cache, const char *path, int *fd, struct stat *st)
+{
+	struct cache_entry *e;
+
+	*fd = -1;
+	if (cache && (e = find_entry(cache, path))) {
+		time_t now = time(NULL);
+		if (now - e->checked < CACHE_REVALIDATE_SEC) {
+			goto hit;
+		}
+		if (stat(path, st) == 0 && same_file(st, &e->st)) {
+			e->checked = now;
+			goto hit;
+		}
+		remove_entry(cache, e);  // changed or gone, fall through to a fresh load
+		COUNTER_INC(cache->stats.invalidations);
+	}
+
+	if (cache) {
+		COUNTER_INC(cache->stats.misses);
+	}
+	*fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (*fd == -1) {
+		return NULL;
+	}
+	if (fstat(*fd, st) == -1) {
+		close(*fd);
+		*fd = -1;
+		return NULL;
+	}
+	if (!cache || !S_ISREG(st->st_mode) || st->st_size > CACHE_MAX_FILE_SIZE ||
+			st->st_size > cache->capacity) {
+		return NULL;
+	}
+	if (!(e = load_entry(path, *fd, st))) {
+		return NULL;  // serve from the still open fd instead
+	}
+	close(*fd);
+	*fd = -1;
+	insert_entry(cache, e);
+	e->refs++;
+	return e;
+
+hit:
+	COUNTER_INC(cache->stats.hits);
+	COUNTER_ADD(cache->stats.hit_bytes, e->size);
+	*st = e->st;
+	lru_unlink(cache, e);
+	lru_push_front(cache, e);
+	e->refs++;
+	return e;
+}
+
+void cache_get_stats(struct cache *cache, struct cache_stats *out)
+{
+	out->hits = COUNTER_GET(cache->stats.hits);
+	out->misses = COUNTER_GET(cache->stats.misses);
+	out->hit_bytes = COUNTER_GET(cache->stats.hit_bytes);
+	out->evictions = COUNTER_GET(cache->stats.evictions);
+	out->invalidations = COUNTER_GET(cache->stats.invalidations);
+	out->entries = COUNTER_GET(cache->stats.entries);
+	out->bytes = COUNTER_GET(cache->stats.bytes);
+}
+
+void cache_print_stats(struct cache *cache, FILE *fp)
+{
+	struct cache_stats stats;
+	cache_get_stats(cache, &stats);
+
+	unsigned long long lookups = stats.hits + stats.misses;
+	fprintf(fp, "cache: %llu hits, %llu misses (%.1f%% hit ratio), %llu bytes served from memory\n",
+			stats.hits, stats.misses, lookups ? 100.0 * stats.hits / lookups : 0.0,
+			stats.hit_bytes);
+	fprintf(fp, "cache: %llu entries, %llu bytes cached, %llu evictions, %llu invalidations\n",
+			stats.entries, stats.bytes, stats.evictions, stats.invalidations);
+}
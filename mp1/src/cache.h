@@ -0,0 +1,84 @@
+/*
+** cache.h -- bounded LRU cache of small, hot files and their response headers
+*/
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define CACHE_DEFAULT_CAPACITY (64 << 20)  // bytes of file content kept in memory
+#define CACHE_MAX_FILE_SIZE (1 << 20)      // larger files always go through sendfile()
+#define CACHE_MAX_ENTRIES 16384
+#define CACHE_REVALIDATE_SEC 1             // how often a hit re-checks the file's mtime
+
+#define CACHE_HEADER_SIZE 256
+
+struct cache_entry {
+	char *path;
+	char *data;        // the whole file content
+	off_t size;
+	struct stat st;    // identity of the file when it was loaded
+	time_t checked;    // last time st was compared against the file system
+
+	// "HTTP/1.1 200 OK" plus Content-Length, Accept-Ranges, Last-Modified and ETag, each
+	// CRLF terminated; the connection adds its own Connection header and
+	// the blank line
+	char header[CACHE_HEADER_SIZE];
+	size_t header_len;
+
+	int refs;          // the table's reference plus one per sending connection
+	struct cache_entry *hash_next;
+	struct cache_entry *lru_prev, *lru_next;  // lru_next is towards older entries
+};
+
+struct cache_stats {
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long hit_bytes;      // body bytes served straight from memory
+	unsigned long long evictions;      // entries dropped to make room
+	unsigned long long invalidations;  // entries dropped because the file changed
+	unsigned long long entries;
+	unsigned long long bytes;          // file content currently cached
+};
+
+/*
+ * Each worker owns a cache, so lookups never contend on a lock. The table
+ * itself is only touched by its owner; the counters may be read by anyone.
+ */
+struct cache;
+
+/*
+ * create an empty cache
+ * input capacity - total bytes of file content to keep
+ * output - the cache, or NULL if capacity is 0 or memory is short
+ */
+struct cache *cache_create(size_t capacity);
+
+/*
+ * look up path, loading the file into the cache if it is small enough
+ * input cache - the worker's cache; NULL simply opens the file
+ * output - a referenced entry the caller must release with cache_release();
+ *          NULL if the file isn't cached, in which case *fd is the opened file
+ *          (or -1 if it can't be opened) and *st describes it
+ */
+struct cache_entry *cache_open(struct cache *cache, const char *path, int *fd, struct stat *st);
+
+/*
+ * drop a reference returned by cache_open()
+ */
+void cache_release(struct cache_entry *e);
+
+/*
+ * copy out the cache counters; safe to call from any thread
+ */
+void cache_get_stats(struct cache *cache, struct cache_stats *out);
+
+/*
+ * write the cache counters to fp in a human readable form
+ */
+void cache_print_stats(struct cache *cache, FILE *fp);
+
+#endif
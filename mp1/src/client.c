@@ -2,140 +2,668 @@
 ** client.c -- a stream socket client demo
 */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 
 #include <arpa/inet.h>
 
-#define MAX_DATA_SIZE 4096 // max number of bytes we can get at once
+#include "disk_cache.h"
+#include "fetch.h"
 
-#define MAX_DOMAIN_SIZE 100
-#define MAX_PATH_SIZE 100
-#define MAX_SENDLINE 256
+#define PIPELINE_DEPTH 16  // requests written before we start reading responses
+#define CONNECT_RETRIES 5  // connections in a row without an answer before giving up
+#define BATCH_POOL_SIZE 4  // default persistent connections per host in batch mode
 
 #define OUTPUT_FILE_NAME "output"
 
-#define DELIMITER "\r\n\r\n"
+#define MAX_SEGMENTS 64
+#define SEGMENT_RETRIES 5        // attempts per segment before the download fails
+#define MIN_SEGMENT_SIZE (64 << 10)   // smaller files aren't worth splitting
+
+// one URL to fetch and the file its body goes to
+struct job {
+	struct url url;
+	char output[MAX_PATH_SIZE];
+	int cached;  // the request offered our cached copy's validators
+};
+
+// the jobs for one host:port, handed out to its connections as they need them
+struct host_queue {
+	struct job **jobs;
+	int njobs;
+	int next;     // first job no connection has claimed yet
+	int failed;   // jobs given up on
+	pthread_mutex_t lock;
+};
 
-// get sockaddr, IPv4 or IPv6:
-void *get_in_addr(struct sockaddr *sa)
+// one byte range of a segmented download, fetched by its own thread
+struct segment {
+	const struct url *u;
+	const char *validator;  // If-Range value, empty if the server gave none
+	int fd;                 // the preallocated output file
+	off_t next;             // next offset to fetch; a retry resumes here
+	off_t end;              // one past the last offset of the range
+	int attempts;
+};
+
+static const char *cache_dir;  // -C, NULL when responses aren't cached
+
+// "-" is standard output, anything else a file created or truncated
+static int open_output(const char *name)
 {
-	if (sa->sa_family == AF_INET) {
-		return &(((struct sockaddr_in*)sa)->sin_addr);
+	if (strcmp(name, "-") == 0) {
+		return STDOUT_FILENO;
 	}
+	return open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+}
 
-	return &(((struct sockaddr_in6*)sa)->sin6_addr);
+static void close_output(int fd)
+{
+	if (fd != STDOUT_FILENO) {
+		close(fd);
+	}
 }
 
-int main(int argc, char *argv[])
+// format the request for job into buf, conditional if we hold a copy
+static int format_request(struct job *job, char *buf, size_t len)
 {
-	int sockfd, numbytes;
-	char buf[MAX_DATA_SIZE];
-	struct addrinfo hints, *servinfo, *p;
-	int rv;
-	char s[INET6_ADDRSTRLEN];
+	struct disk_cache_meta meta;
+	struct url *u = &job->url;
+	int n = snprintf(buf, len, "GET %s HTTP/1.1\r\nHost: %s:%s\r\n", u->path, u->domain, u->port);
 
-	int match_cnt;
-	char domain[MAX_DOMAIN_SIZE], path[MAX_PATH_SIZE], port[10];
-	char sendline[MAX_SENDLINE];
-	FILE* fp;
+	job->cached = cache_dir && disk_cache_lookup(cache_dir, u, &meta) == 0;
+	if (job->cached && meta.etag[0]) {
+		n += snprintf(buf + n, len - n, "If-None-Match: %s\r\n", meta.etag);
+	}
+	if (job->cached && meta.last_modified[0]) {
+		n += snprintf(buf + n, len - n, "If-Modified-Since: %s\r\n", meta.last_modified);
+	}
+	n += snprintf(buf + n, len - n, "\r\n");
+	return n < len ? n : -1;
+}
 
-	if (argc != 2) {
-		fprintf(stderr,"usage: client http://hostname[:port]/path/to/file\n");
-		fprintf(stderr, "Example:\n");
-		fprintf(stderr, "./client http://illinois.edu/index.html\n");
-		fprintf(stderr, "./client http://12.34.56.78:8888/somefile.txt\n");
-		exit(1);
+/*
+ * read the response to job off the connection and put its body in place:
+ * a 304 is answered from the cache, a cacheable 200 goes through it
+ * input ok - set to 0 if the output couldn't be written
+ * output - 1 if the connection can carry another response, 0 if the server
+ *          closes it after this one, -1 if the response was cut short
+ */
+static int receive_job(struct reader *r, struct job *job, int *ok)
+{
+	struct response resp;
+	struct disk_cache_meta meta;
+	char tmp[MAX_PATH_SIZE + 64];
+	int fd, rv;
+
+	if (read_header(r, &resp, 0) == -1) {
+		return -1;
 	}
+	fprintf(fetch_log, "client: %s\n", resp.status_line);
 
-	// try to match domain, port, and path
-	match_cnt = sscanf(argv[1], "%*[^:]%*[:/]%[^:]:%[0-9]%s", domain, port, path);
-	if (match_cnt != 3) {
-		// try to match domain and path. Assume the port is 80
-		match_cnt = sscanf(argv[1], "%*[^:]%*[:/]%[^/]%s", domain, path);
-		if (match_cnt != 2) {
-			fprintf(stderr, "invalid URL, please check URL: %s\n", argv[1]);
-			exit(1);
+	if (resp.status == 304 && job->cached) {
+		rv = read_body(r, &resp, -1, NULL);
+		*ok = rv != -1 && disk_cache_materialize(cache_dir, &job->url, job->output) == 0;
+		if (*ok) {
+			fprintf(fetch_log, "client: %s is unchanged, using the cached copy\n", job->url.path);
 		}
-		strcpy(port, "80"); // use default port 80
+		return rv;
 	}
 
-	memset(&hints, 0, sizeof hints);
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
+	if (cache_dir && resp.status == 200 && (resp.etag[0] || resp.last_modified[0]) &&
+			(fd = disk_cache_begin(cache_dir, &job->url, tmp, sizeof tmp)) != -1) {
+		rv = read_body(r, &resp, fd, NULL);
+		close(fd);
+		if (rv == -1) {
+			unlink(tmp);
+			return -1;
+		}
+		snprintf(meta.etag, sizeof meta.etag, "%s", resp.etag);
+		snprintf(meta.last_modified, sizeof meta.last_modified, "%s", resp.last_modified);
+		*ok = disk_cache_commit(cache_dir, &job->url, tmp, &meta) == 0 &&
+			disk_cache_materialize(cache_dir, &job->url, job->output) == 0;
+		return rv;
+	}
+
+	fd = open_output(job->output);
+	if (fd == -1) {
+		perror(job->output);  // the body is still read, into nowhere
+	}
+	rv = read_body(r, &resp, fd, NULL);
+	if (fd != -1) {
+		close_output(fd);
+	}
+	*ok = fd != -1;
+	return rv;
+}
+
+static void output_name(char *name, size_t len, int index, int total)
+{
+	if (total == 1) {
+		snprintf(name, len, "%s", OUTPUT_FILE_NAME);
+	} else {
+		snprintf(name, len, "%s.%d", OUTPUT_FILE_NAME, index + 1);
+	}
+}
+
+static struct job *claim_job(struct host_queue *q)
+{
+	struct job *job = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->next < q->njobs) {
+		job = q->jobs[q->next++];
+	}
+	pthread_mutex_unlock(&q->lock);
+	return job;
+}
+
+static void fail_job(struct host_queue *q, struct job *job)
+{
+	fprintf(stderr, "client: giving up on %s\n", job->url.path);
+	pthread_mutex_lock(&q->lock);
+	q->failed++;
+	pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * fetch jobs off q over one persistent connection, keeping up to
+ * PIPELINE_DEPTH requests in flight; when the server closes early the
+ * unanswered requests are sent again on a new connection, and after
+ * CONNECT_RETRIES attempts in a row without an answer they are given up
+ */
+static void run_connection(struct host_queue *q)
+{
+	struct job *window[PIPELINE_DEPTH];  // claimed jobs, oldest first
+	int nwin = 0, failures = 0, i;
+	char sendline[MAX_SENDLINE];
+	struct reader *r;
+	int fd;
 
-	if ((rv = getaddrinfo(domain, port, &hints, &servinfo)) != 0) {
-		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-		return 1;
+	if (!(r = malloc(sizeof(*r)))) {
+		return;
 	}
 
-	// loop through all the results and connect to the first we can
-	for(p = servinfo; p != NULL; p = p->ai_next) {
-		if ((sockfd = socket(p->ai_family, p->ai_socktype,
-				p->ai_protocol)) == -1) {
-			perror("client: socket");
+	while (1) {
+		while (nwin < PIPELINE_DEPTH && (window[nwin] = claim_job(q))) {
+			nwin++;
+		}
+		if (nwin == 0) {
+			break;
+		}
+		if (failures == CONNECT_RETRIES) {
+			for (i = 0; i < nwin; i++) {
+				fail_job(q, window[i]);
+			}
+			nwin = 0;
+			failures = 0;
 			continue;
 		}
+		if (failures > 0) {
+			usleep(100000 << (failures - 1));
+		}
 
-		if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
-			close(sockfd);
-			perror("client: connect");
+		int progress = 0, nsent = 0;
+		if ((fd = connect_to(window[0]->url.domain, window[0]->url.port)) == -1) {
+			failures++;
 			continue;
 		}
+		reader_init(r, fd);
+
+		while (nwin > 0) {
+			// top up the pipeline
+			while (nwin < PIPELINE_DEPTH && (window[nwin] = claim_job(q))) {
+				nwin++;
+			}
+			while (nsent < nwin) {
+				int len = format_request(window[nsent], sendline, sizeof sendline);
+				if (len == -1 || write(fd, sendline, len) != len) {
+					break;
+				}
+				nsent++;
+			}
+			if (nsent == 0) {
+				fprintf(fetch_log, "failed to send request\n");
+				break;
+			}
+
+			struct job *job = window[0];
+			int ok;
+			int rv = receive_job(r, job, &ok);
+			if (rv == -1) {
+				break;
+			}
+			if (ok) {
+				fprintf(fetch_log, "wrote content to file: %s\n", job->output);
+			} else {
+				fail_job(q, job);
+			}
+			memmove(window, window + 1, (nwin - 1) * sizeof(window[0]));
+			nwin--;
+			nsent--;
+			progress = 1;
+			if (rv == 0) {
+				break;  // server won't answer the rest on this connection
+			}
+		}
+
+		reader_release(r);
+		close(fd);
+		failures = progress ? 0 : failures + 1;
+	}
+
+	free(r);
+}
+
+static void *connection_main(void *arg)
+{
+	run_connection(arg);
+	return NULL;
+}
+
+/*
+ * fetch every job, grouped by host:port, with up to pool persistent
+ * connections per host; hosts are fetched concurrently
+ * output - the number of jobs that failed
+ */
+static int run_jobs(struct job *jobs, int njobs, int pool)
+{
+	struct host_queue *hosts;
+	pthread_t *threads;
+	int nhosts = 0, nthreads = 0, failed = 0, i, h, k;
+
+	hosts = calloc(njobs, sizeof(*hosts));
+	threads = calloc((size_t)njobs * pool, sizeof(*threads));
+	if (!hosts || !threads) {
+		perror("calloc");
+		free(hosts);
+		free(threads);
+		return njobs;
+	}
+
+	for (i = 0; i < njobs; i++) {
+		struct url *u = &jobs[i].url;
+		for (h = 0; h < nhosts; h++) {
+			struct url *first = &hosts[h].jobs[0]->url;
+			if (strcmp(first->domain, u->domain) == 0 && strcmp(first->port, u->port) == 0) {
+				break;
+			}
+		}
+		if (h == nhosts) {
+			if (!(hosts[h].jobs = calloc(njobs - i, sizeof(struct job *)))) {
+				perror("calloc");
+				failed++;
+				continue;
+			}
+			pthread_mutex_init(&hosts[h].lock, NULL);
+			nhosts++;
+		}
+		hosts[h].jobs[hosts[h].njobs++] = &jobs[i];
+	}
+
+	for (h = 0; h < nhosts; h++) {
+		int nconn = hosts[h].njobs < pool ? hosts[h].njobs : pool;
+		for (k = 0; k < nconn; k++) {
+			if (pthread_create(&threads[nthreads], NULL, connection_main, &hosts[h]) == 0) {
+				nthreads++;
+			} else if (k == 0) {
+				run_connection(&hosts[h]);  // no thread to spare, do it here
+			}
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	for (h = 0; h < nhosts; h++) {
+		failed += hosts[h].failed;
+		pthread_mutex_destroy(&hosts[h].lock);
+		free(hosts[h].jobs);
+	}
+	free(hosts);
+	free(threads);
+	return failed;
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * fetch what is left of seg's range over a fresh connection, writing the
+ * bytes in place as they arrive
+ * output - 0 when the range is complete, -1 if this attempt failed and may
+ *          be retried, -2 if retrying can't help (the file changed)
+ */
+static int fetch_segment_once(struct segment *seg, struct reader *r)
+{
+	struct response resp;
+	char sendline[MAX_SENDLINE];
+	int v = seg->validator[0] != '\0';
+	int fd, rv = -1;
+
+	if ((fd = connect_to(seg->u->domain, seg->u->port)) == -1) {
+		return -1;
+	}
+	reader_init(r, fd);
+
+	int len = snprintf(sendline, sizeof sendline,
+			"GET %s HTTP/1.1\r\nHost: %s:%s\r\nRange: bytes=%lld-%lld\r\n%s%s%s"
+			"Connection: close\r\n\r\n",
+			seg->u->path, seg->u->domain, seg->u->port,
+			(long long)seg->next, (long long)seg->end - 1,
+			v ? "If-Range: " : "", seg->validator, v ? "\r\n" : "");
+	if (write(fd, sendline, len) != len || read_header(r, &resp, 0) == -1) {
+		goto out;
+	}
+	if (resp.status != 206 || resp.range_first != seg->next ||
+			resp.body_length != seg->end - seg->next) {
+		// with If-Range, a 200 means the file is no longer the one we sized
+		fprintf(stderr, "client: bytes %lld-%lld: unexpected \"%s\"\n",
+				(long long)seg->next, (long long)seg->end - 1, resp.status_line);
+		rv = resp.status == 200 || resp.status / 100 == 4 ? -2 : -1;
+		goto out;
+	}
+
+	// seg->next moves with every byte that lands, so a retry picks up there
+	if (read_body(r, &resp, seg->fd, &seg->next) != -1) {
+		rv = 0;
+	}
+
+out:
+	reader_release(r);
+	close(fd);
+	return rv;
+}
+
+static void *segment_main(void *arg)
+{
+	struct segment *seg = arg;
+	struct reader *r = malloc(sizeof(*r));
+
+	while (r && seg->next < seg->end && seg->attempts < SEGMENT_RETRIES) {
+		if (seg->attempts++ > 0) {
+			// back off a little more each time, the server may be shedding load
+			fprintf(stderr, "client: retrying bytes %lld-%lld\n",
+					(long long)seg->next, (long long)seg->end - 1);
+			usleep(100000 << (seg->attempts - 2));
+		}
+		if (fetch_segment_once(seg, r) == -2) {
+			break;
+		}
+	}
+	free(r);
+	return NULL;
+}
+
+/*
+ * fetch a job as nseg byte ranges over nseg concurrent connections into a
+ * preallocated output file; a server that can't do ranges gets a plain GET
+ * output - 0 on success, -1 on failure
+ */
+static int fetch_segmented(struct job *job, int nseg)
+{
+	struct url *u = &job->url;
+	struct reader *r;
+	struct response resp;
+	struct segment segs[MAX_SEGMENTS];
+	pthread_t threads[MAX_SEGMENTS];
+	int started[MAX_SEGMENTS];
+	char sendline[MAX_SENDLINE];
+	const char *name = job->output;
+	int k, fd, rv = 0;
+
+	// HEAD first: the length decides the split, the validator pins the file
+	if (!(r = malloc(sizeof(*r)))) {
+		return -1;
+	}
+	if ((fd = connect_to(u->domain, u->port)) == -1) {
+		free(r);
+		return -1;
+	}
+	reader_init(r, fd);
+	int len = snprintf(sendline, sizeof sendline,
+			"HEAD %s HTTP/1.1\r\nHost: %s:%s\r\nConnection: close\r\n\r\n",
+			u->path, u->domain, u->port);
+	rv = write(fd, sendline, len) == len ? read_header(r, &resp, 1) : -1;
+	close(fd);
+	free(r);
+	if (rv == -1) {
+		return -1;
+	}
+	fprintf(fetch_log, "client: %s\n", resp.status_line);
+
+	long long size = resp.content_length;
+	// standard output can't be preallocated or written out of order
+	if (resp.status != 200 || !resp.accept_ranges || size < 2 * MIN_SEGMENT_SIZE ||
+			strcmp(name, "-") == 0) {
+		return run_jobs(job, 1, 1) == 0 ? 0 : -1;
+	}
+	if (nseg > size / MIN_SEGMENT_SIZE) {
+		nseg = size / MIN_SEGMENT_SIZE;
+	}
+
+	if ((fd = open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) == -1) {
+		perror(name);
+		return -1;
+	}
+	// reserve the whole file up front so the segments' writes can't
+	// fragment it or hit a full disk half way; not every file system can
+	if ((errno = posix_fallocate(fd, 0, size)) != 0 && ftruncate(fd, size) == -1) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+
+	double start = now_sec();
+	for (k = 0; k < nseg; k++) {
+		segs[k].u = u;
+		segs[k].validator = resp.validator;
+		segs[k].fd = fd;
+		segs[k].next = size / nseg * k;
+		segs[k].end = k == nseg - 1 ? size : size / nseg * (k + 1);
+		segs[k].attempts = 0;
+		started[k] = pthread_create(&threads[k], NULL, segment_main, &segs[k]) == 0;
+		if (!started[k]) {
+			segment_main(&segs[k]);  // no thread to spare, do it here
+		}
+	}
+	for (k = 0; k < nseg; k++) {
+		if (started[k]) {
+			pthread_join(threads[k], NULL);
+		}
+		if (segs[k].next < segs[k].end) {
+			fprintf(stderr, "client: bytes %lld-%lld failed after %d attempts\n",
+					(long long)segs[k].next, (long long)segs[k].end - 1, segs[k].attempts);
+			rv = -1;
+		}
+	}
+	close(fd);
+
+	if (rv == 0) {
+		double secs = now_sec() - start;
+		fprintf(fetch_log, "wrote content to file: %s (%lld bytes over %d connections, %.1f MB/s)\n",
+				name, size, nseg, secs > 0 ? size / secs / 1e6 : 0.0);
+	}
+	return rv;
+}
 
-		break;
+// append a job for url, -1 if the url is malformed or memory is short
+static int add_job(struct job **jobs, int *njobs, int *cap, const char *url, const char *output)
+{
+	if (*njobs == *cap) {
+		int ncap = *cap ? *cap * 2 : 64;
+		struct job *grown = realloc(*jobs, ncap * sizeof(**jobs));
+		if (!grown) {
+			perror("realloc");
+			return -1;
+		}
+		*jobs = grown;
+		*cap = ncap;
 	}
+	struct job *job = &(*jobs)[*njobs];
+	if (parse_url(url, &job->url) == -1) {
+		fprintf(stderr, "invalid URL, please check URL: %s\n", url);
+		return -1;
+	}
+	snprintf(job->output, sizeof job->output, "%s", output ? output : "");
+	(*njobs)++;
+	return 0;
+}
 
-	if (p == NULL) {
-		fprintf(stderr, "client: failed to connect\n");
-		return 2;
+// read "url [output]" lines; blank lines and # comments are skipped
+static int read_batch(FILE *fp, struct job **jobs, int *njobs, int *cap)
+{
+	char line[MAX_PATH_SIZE * 3];
+	char url[MAX_PATH_SIZE * 2], output[MAX_PATH_SIZE];
+	int lineno = 0;
+
+	while (fgets(line, sizeof line, fp)) {
+		lineno++;
+		int fields = sscanf(line, "%1999s %999s", url, output);
+		if (fields < 1 || url[0] == '#') {
+			continue;
+		}
+		if (add_job(jobs, njobs, cap, url, fields == 2 ? output : NULL) == -1) {
+			fprintf(stderr, "client: batch line %d\n", lineno);
+			return -1;
+		}
 	}
+	return 0;
+}
 
-	inet_ntop(p->ai_family, get_in_addr((struct sockaddr *)p->ai_addr),
-			s, sizeof s);
-	printf("client: connecting to %s\n", s);
+int main(int argc, char *argv[])
+{
+	struct job *jobs = NULL;
+	int njobs = 0, cap = 0;
+	int i, opt;
+	int nseg = 0, pool = 0;
+	const char *batch = NULL, *output = NULL;
+	char *end;
 
-	freeaddrinfo(servinfo); // all done with this structure
+	while ((opt = getopt(argc, argv, "s:i:c:o:C:")) != -1) {
+		switch (opt) {
+		case 's':
+			nseg = strtol(optarg, &end, 10);
+			if (*end != '\0' || nseg < 1 || nseg > MAX_SEGMENTS) {
+				argc = 0;  // print the usage below
+			}
+			break;
+		case 'i':
+			batch = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'C':
+			cache_dir = optarg;
+			break;
+		case 'c':
+			pool = strtol(optarg, &end, 10);
+			if (*end != '\0' || pool < 1) {
+				argc = 0;
+			}
+			break;
+		default:
+			argc = 0;
+		}
+	}
 
-	sprintf(sendline, "GET %s HTTP/1.0\r\n\r\n", path);
+	if (argc < 1 || (argc - optind < 1 && !batch) || (batch && nseg > 0) ||
+			(output && argc - optind != 1)) {
+		fprintf(stderr,"usage: client [-s segments] [-c connections] [-i batch_file] [-o output] [-C cache_dir] "
+				"[http://hostname[:port]/path/to/file ...]\n");
+		fprintf(stderr, "  -s  download each file as this many byte ranges over as many\n");
+		fprintf(stderr, "      connections at once (up to %d)\n", MAX_SEGMENTS);
+		fprintf(stderr, "  -i  also fetch the urls listed in this file, - for stdin; one\n");
+		fprintf(stderr, "      \"url [output_path]\" per line\n");
+		fprintf(stderr, "  -c  persistent connections per host, 1 by default, %d with -i\n",
+				BATCH_POOL_SIZE);
+		fprintf(stderr, "  -o  where the body of the one url on the command line goes, - for\n");
+		fprintf(stderr, "      standard output; \"%s\" by default\n", OUTPUT_FILE_NAME);
+		fprintf(stderr, "  -C  keep bodies in this directory and revalidate them with conditional\n");
+		fprintf(stderr, "      requests; a 304 links the output to the cached copy\n");
+		fprintf(stderr, "Example:\n");
+		fprintf(stderr, "./client http://illinois.edu/index.html\n");
+		fprintf(stderr, "./client http://12.34.56.78:8888/somefile.txt\n");
+		fprintf(stderr, "./client http://12.34.56.78:8888/a.txt http://12.34.56.78:8888/b.txt\n");
+		fprintf(stderr, "./client -s 8 http://12.34.56.78:8888/big.iso\n");
+		fprintf(stderr, "./client -i urls.txt -c 8\n");
+		fprintf(stderr, "./client -o - http://12.34.56.78:8888/log.txt | less\n");
+		fprintf(stderr, "./client -C ~/.cache/mp1 http://12.34.56.78:8888/artifact.tar\n");
+		exit(1);
+	}
 
-	if (write(sockfd, sendline, strlen(sendline)) == strlen(sendline)) {
-		fp = fopen(OUTPUT_FILE_NAME, "w");
+	for (i = optind; i < argc; i++) {
+		if (add_job(&jobs, &njobs, &cap, argv[i], output) == -1) {
+			exit(1);
+		}
+	}
+	if (batch) {
+		FILE *fp = strcmp(batch, "-") == 0 ? stdin : fopen(batch, "r");
 		if (!fp) {
-			fprintf(stderr, "file unable to be open");
-			close(sockfd);
+			perror(batch);
 			exit(1);
 		}
+		if (read_batch(fp, &jobs, &njobs, &cap) == -1) {
+			exit(1);
+		}
+		if (fp != stdin) {
+			fclose(fp);
+		}
+	}
+	for (i = 0; i < njobs; i++) {
+		if (jobs[i].output[0] == '\0') {
+			output_name(jobs[i].output, sizeof jobs[i].output, i, njobs);
+		}
+	}
+	if (pool == 0) {
+		pool = batch ? BATCH_POOL_SIZE : 1;
+	}
 
-		if ((numbytes = recv(sockfd, buf, sizeof buf, 0)) > 0) {
-			// this points to the "\r\n\r\n..."
-			char* header_tail = strstr(buf, DELIMITER);
-			if (header_tail) {  // found the DELIMITER
-				// skip the "\r\n\r\n"
-				char* content_start = header_tail + strlen(DELIMITER);
-				int header_len = content_start - buf;  // including the delimiter
-				fwrite(content_start, 1, numbytes - header_len, fp);
+	if (cache_dir && mkdir(cache_dir, 0777) == -1 && errno != EEXIST) {
+		perror(cache_dir);
+		exit(1);
+	}
 
-				while ((numbytes = recv(sockfd, buf, sizeof buf, 0)) > 0) {
-					fwrite(buf, 1, numbytes, fp);
-				}
+	// progress messages must stay out of a body written to standard output
+	fetch_log = stdout;
+	for (i = 0; i < njobs; i++) {
+		if (strcmp(jobs[i].output, "-") == 0) {
+			fetch_log = stderr;
+		}
+	}
+
+	int failed = 0;
+	if (nseg > 0) {
+		for (i = 0; i < njobs; i++) {
+			if (fetch_segmented(&jobs[i], nseg) == -1) {
+				failed++;
 			}
 		}
-		fclose(fp);
-		printf("wrote content to file: %s\n", OUTPUT_FILE_NAME);
 	} else {
-		printf("failed to send request\n");
+		// urls on the same host:port share its persistent connections; if the
+		// server closes early, the unanswered requests go out again
+		failed = run_jobs(jobs, njobs, pool);
 	}
 
-	close(sockfd);
-
-	return 0;
+	free(jobs);
+	return failed ? 2 : 0;
 }
-
@@ -0,0 +1,1218 @@
+/*
+** conn.c -- per-connection HTTP state machine shared by the fork and epoll servers
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "admission.h"
+#include "cache.h"
+#include "conn.h"
+#include "counter.h"
+#include "event_loop.h"
+#include "h2.h"
+#include "http.h"
+#include "precompress.h"
+#include "proxy.h"
+#include "stats.h"
+
+#define STATS_PATH "__stats"  // served from the counters instead of the file system
+
+// start the deadline for the given timeout, or clear it if that one is disabled
+static void set_deadline(struct conn *c, enum conn_timeout kind)
+{
+	unsigned int sec;
+
+	switch (kind) {
+	case CONN_TIMEOUT_HEADER: sec = c->worker->timeouts.header; break;
+	case CONN_TIMEOUT_IDLE: sec = c->worker->timeouts.idle; break;
+	default: sec = c->worker->timeouts.send; break;
+	}
+	c->timeout = kind;
+	c->deadline = sec ? stats_now_usec() + sec * 1000000ULL : 0;
+	c->progressed = 0;
+}
+
+// take n bytes that went out off what the response owes the worker
+static void pay(struct conn *c, size_t n)
+{
+	if (c->owed) {
+		n = n < c->owed ? n : c->owed;
+		c->owed -= n;
+		COUNTER_ADD(c->worker->outstanding, -n);
+	}
+}
+
+void conn_count_sent(struct conn *c, size_t n)
+{
+	STAT_ADD(&c->worker->stats, bytes_sent, n);
+	c->progressed = 1;
+	pay(c, n);
+}
+
+// take the response's share of load off the worker
+static void settle(struct conn *c)
+{
+	if (c->owed) {
+		COUNTER_ADD(c->worker->outstanding, -c->owed);
+		c->owed = 0;
+	}
+	if (c->busy) {
+		c->worker->busy--;
+		c->busy = 0;
+	}
+}
+
+void conn_init(struct conn *c, int fd, const struct sockaddr_storage *peer, struct worker *w)
+{
+	int yes = 1;
+
+	// keep-alive responses are flushed explicitly (TCP_CORK) and must not
+	// wait behind Nagle for the ACK of the previous response
+	if (fd != -1) {
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	}
+
+	c->fd = fd;
+	c->peer = *peer;
+	c->worker = w;
+	c->state = CONN_READING;
+	c->h2 = NULL;
+	c->request_len = 0;
+	http_parser_init(&c->req);
+	c->keep_alive = 0;
+	c->accepted_at = stats_now_usec();
+	c->req_start = 0;
+	c->first_byte_sent = 0;
+	c->status = 0;
+	c->timer.pprev = NULL;
+	c->timer.next = NULL;
+	set_deadline(c, CONN_TIMEOUT_HEADER);  // counts from accept, not from the first byte
+	c->header_len = 0;
+	c->header_sent = 0;
+	c->content_length = 0;
+	c->busy = 0;
+	c->owed = 0;
+	c->corked = 0;
+	c->vary = 0;
+	c->encoded = 0;
+	c->file_fd = -1;
+	c->fetch = NULL;
+	c->proxy_head = 0;
+	c->upstream_wait = 0;
+	c->park_next = NULL;
+	c->park_pprev = NULL;
+	c->entry = NULL;
+	c->mem = NULL;
+	c->mem_owned = 0;
+	c->nranges = 0;
+	c->body_offset = 0;
+	c->body_end = 0;
+	c->use_copy = 0;
+	c->body = NULL;
+	c->body_len = 0;
+	c->body_sent = 0;
+}
+
+static void release_body(struct conn *c);
+
+void conn_close(struct conn *c)
+{
+	if (c->h2) {
+		h2_free(c->h2);
+		c->h2 = NULL;
+	}
+	settle(c);
+	release_body(c);
+	free(c->body);
+	c->body = NULL;
+	if (c->fd != -1) {
+		close(c->fd);
+	}
+}
+
+void conn_expire(struct conn *c)
+{
+	struct linger lg;
+
+	if (c->timeout != CONN_TIMEOUT_IDLE) {
+		lg.l_onoff = 1;
+		lg.l_linger = 0;
+		setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+	}
+	conn_close(c);
+}
+
+// account n request bytes that arrived in c->request
+static void received(struct conn *c, size_t n)
+{
+	if (c->req_start == 0) {
+		c->req_start = stats_now_usec();
+	}
+	if (c->timeout == CONN_TIMEOUT_IDLE) {
+		// a new request has begun, it gets a fixed time to finish its header
+		set_deadline(c, CONN_TIMEOUT_HEADER);
+	}
+	c->request_len += n;
+}
+
+// whether the request header is parsed (or can't be: too large)
+static int request_complete(struct conn *c)
+{
+	return http_parse_request(&c->req, c->request, c->request_len) != HTTP_PARSE_AGAIN ||
+		c->request_len == sizeof(c->request);  // prepare_response() answers 431
+}
+
+// returns 1 once the request header is parsed (or can't be), 0 if the socket
+// would block, -1 if the client went away
+static int read_request(struct conn *c)
+{
+	while (1) {
+		// only the bytes that arrived since the last call get looked at
+		if (request_complete(c)) {
+			return 1;
+		}
+
+		ssize_t n = read(c->fd, c->request + c->request_len,
+				sizeof(c->request) - c->request_len);
+		if (n > 0) {
+			received(c, n);
+		} else if (n == 0) {
+			return -1;  // client closed (possibly between keep-alive requests)
+		} else if (errno == EINTR) {
+			continue;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		} else {
+			return -1;
+		}
+	}
+}
+
+// start a response header with the status line and Content-Length, which
+// is left out if content_length is -1
+static void start_header(struct conn *c, const char *status, off_t content_length)
+{
+	if (content_length == -1) {
+		c->header_len = snprintf(c->header, sizeof(c->header), "HTTP/1.1 %s\r\n", status);
+	} else {
+		c->header_len = snprintf(c->header, sizeof(c->header),
+				"HTTP/1.1 %s\r\nContent-Length: %lld\r\n", status, (long long)content_length);
+	}
+	c->header_sent = 0;
+	c->content_length = content_length == -1 ? 0 : content_length;
+	c->status = atoi(status);
+}
+
+// append raw, CRLF terminated header lines
+static void add_header(struct conn *c, const char *lines, size_t len)
+{
+	if (len > sizeof(c->header) - c->header_len) {
+		len = sizeof(c->header) - c->header_len;
+	}
+	memcpy(c->header + c->header_len, lines, len);
+	c->header_len += len;
+}
+
+// add the negotiation and Connection headers if needed and the blank line
+// ending the header
+static void end_header(struct conn *c)
+{
+	if (c->encoded) {
+		add_header(c, "Content-Encoding: gzip\r\n", strlen("Content-Encoding: gzip\r\n"));
+	}
+	if (c->vary) {
+		add_header(c, "Vary: Accept-Encoding\r\n", strlen("Vary: Accept-Encoding\r\n"));
+	}
+	if (!c->keep_alive) {
+		add_header(c, "Connection: close\r\n", strlen("Connection: close\r\n"));
+	} else if (http_str_eq(c->req.version, "HTTP/1.0")) {
+		// a 1.0 client reads to the close unless told the connection stays
+		add_header(c, "Connection: keep-alive\r\n", strlen("Connection: keep-alive\r\n"));
+	}
+	add_header(c, "\r\n", 2);
+}
+
+// append one formatted header line; fmt supplies the CRLF
+static void add_headerf(struct conn *c, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(c->header + c->header_len, sizeof(c->header) - c->header_len, fmt, ap);
+	va_end(ap);
+	if (n > 0) {
+		c->header_len += (size_t)n < sizeof(c->header) - c->header_len ?
+			(size_t)n : sizeof(c->header) - c->header_len - 1;
+	}
+}
+
+static void set_header(struct conn *c, const char *status, off_t content_length)
+{
+	start_header(c, status, content_length);
+	end_header(c);
+}
+
+// answer with an empty error response and hang up afterwards
+static void reject(struct conn *c, const char *status)
+{
+	c->keep_alive = 0;
+	set_header(c, status, 0);
+}
+
+// turn the request away before any work is done for it; the connection is
+// closed afterwards to give back its share of the server too
+static void shed(struct conn *c, enum shed_reason why, const char *status, unsigned int retry_after)
+{
+	release_body(c);
+	c->nranges = 0;
+	c->vary = 0;
+	c->encoded = 0;
+	c->keep_alive = 0;
+	start_header(c, status, 0);
+	add_headerf(c, "Retry-After: %u\r\n", retry_after);
+	end_header(c);
+	STAT_INC(&c->worker->stats, shed[why]);
+}
+
+// admission checks that can be made before the request is looked at:
+// the client's rate, then the worker's queue depth and lag; fork children
+// only have the rate limit, the parent caps how many of them run
+// returns 1 if the request was shed
+static int shed_request(struct conn *c)
+{
+	struct worker *w = c->worker;
+	unsigned int wait;
+
+	if (w->limiter && (wait = rate_limiter_take(w->limiter, &c->peer)) > 0) {
+		shed(c, SHED_RATE, "429 Too Many Requests", wait);
+		return 1;
+	}
+	if (w->stats.shared) {
+		return 0;
+	}
+	if (w->limits.depth && w->busy >= w->limits.depth) {
+		shed(c, SHED_DEPTH, "503 Service Unavailable", ADMIT_RETRY_AFTER);
+		return 1;
+	}
+	if (w->limits.latency_ms && w->lag >= w->limits.latency_ms * 1000ULL) {
+		shed(c, SHED_LATENCY, "503 Service Unavailable", ADMIT_RETRY_AFTER);
+		return 1;
+	}
+	return 0;
+}
+
+// charge the prepared response to the worker's load, shedding it instead
+// if its bytes would overrun the budget; a response larger than the whole
+// budget still goes out once nothing else is owed
+static void commit_response(struct conn *c)
+{
+	struct worker *w = c->worker;
+	unsigned long long owed;
+
+	if (w->stats.shared) {
+		return;
+	}
+	owed = c->header_len + (c->file_fd != -1 || c->mem ? c->content_length : 0);
+	// the stats page (the only owned mem) must stay reachable under load
+	if (w->limits.bytes && !c->mem_owned && COUNTER_GET(w->outstanding) > 0 &&
+			COUNTER_GET(w->outstanding) + owed > (unsigned long long)w->limits.bytes) {
+		shed(c, SHED_BYTES, "503 Service Unavailable", ADMIT_RETRY_AFTER);
+		owed = c->header_len;
+	}
+	c->owed = owed;
+	COUNTER_ADD(w->outstanding, owed);
+	c->busy = 1;
+	w->busy++;
+}
+
+// give back the file, cache entry or page of a response that won't send a body
+static void release_body(struct conn *c)
+{
+	if (c->file_fd != -1) {
+		close(c->file_fd);
+		c->file_fd = -1;
+	}
+	if (c->entry) {
+		cache_release(c->entry);
+		c->entry = NULL;
+	}
+	if (c->fetch) {
+		proxy_release(c->fetch);
+		c->fetch = NULL;
+	}
+	if (c->mem_owned) {
+		free(c->mem);
+		c->mem_owned = 0;
+	}
+	c->mem = NULL;
+}
+
+// format the delimiter and headers that precede range i of a multipart
+// body, or the closing delimiter when i == c->nranges
+static size_t format_part(struct conn *c, int i, char *buf, size_t len)
+{
+	int n;
+	if (i < c->nranges) {
+		n = snprintf(buf, len, "\r\n--%s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+				c->boundary, (long long)c->ranges[i].first, (long long)c->ranges[i].last,
+				(long long)c->file_size);
+	} else {
+		n = snprintf(buf, len, "\r\n--%s--\r\n", c->boundary);
+	}
+	return n < 0 ? 0 : (size_t)n < len ? (size_t)n : len - 1;
+}
+
+// queue part i's delimiter and point the body at its byte range
+static void start_part(struct conn *c, int i)
+{
+	c->cur_range = i;
+	c->part_len = format_part(c, i, c->part, sizeof(c->part));
+	c->part_sent = 0;
+	if (i < c->nranges) {
+		c->body_offset = c->ranges[i].first;
+		c->body_end = c->ranges[i].last + 1;
+	} else {
+		c->body_offset = c->body_end = 0;
+	}
+}
+
+// 206 with a multipart/byteranges body, one part per requested range
+static void prepare_multipart(struct conn *c, const struct stat *st)
+{
+	char part[sizeof(c->part)];
+	off_t length = 0;
+	int i;
+
+	// the boundary only has to be absent from the parts, a mix of the
+	// file's identity and this connection makes that overwhelmingly likely
+	snprintf(c->boundary, sizeof(c->boundary), "%08lx%08lx",
+			(unsigned long)(st->st_ino ^ st->st_mtim.tv_nsec) & 0xffffffffUL,
+			(unsigned long)((uintptr_t)c ^ (unsigned long)st->st_size) & 0xffffffffUL);
+	c->file_size = st->st_size;
+
+	for (i = 0; i <= c->nranges; i++) {
+		length += format_part(c, i, part, sizeof(part));
+		if (i < c->nranges) {
+			length += c->ranges[i].last - c->ranges[i].first + 1;
+		}
+	}
+
+	start_header(c, "206 Partial Content", length);
+	add_headerf(c, "Content-Type: multipart/byteranges; boundary=%s\r\n", c->boundary);
+	start_part(c, 0);
+}
+
+// 200 with the Prometheus rendering of every worker's counters
+static void prepare_stats(struct conn *c)
+{
+	struct worker *workers;
+	size_t len;
+	int n;
+
+	workers = registered_workers(&n);
+	if (!(c->mem = stats_render(workers, n, &len))) {
+		reject(c, "503 Service Unavailable");
+		return;
+	}
+	c->mem_owned = 1;
+	start_header(c, "200 OK", len);
+	add_header(c, "Content-Type: text/plain; version=0.0.4\r\nCache-Control: no-store\r\n",
+			strlen("Content-Type: text/plain; version=0.0.4\r\nCache-Control: no-store\r\n"));
+	end_header(c);
+	c->body_offset = 0;
+	c->body_end = len;
+}
+
+// switch the response over to the file's gzip variant if there is a fresh
+// one; it goes through the cache and sendfile() like any other file, so
+// nothing is compressed while the client waits
+static void select_variant(struct conn *c, const char *filepath, struct stat *st)
+{
+	char path[PATH_MAX];
+	struct cache_entry *entry;
+	struct stat vst;
+	int fd;
+
+	if (snprintf(path, sizeof(path), "%s%s", filepath, PRECOMPRESS_SUFFIX) >= (int)sizeof(path)) {
+		return;
+	}
+	entry = cache_open(c->worker->cache, path, &fd, &vst);
+	if (!entry && fd == -1) {
+		return;
+	}
+	if (!precompress_fresh(st, &vst)) {
+		if (entry) {
+			cache_release(entry);
+		} else {
+			close(fd);
+		}
+		return;
+	}
+	release_body(c);
+	c->entry = entry;
+	c->file_fd = fd;
+	*st = vst;
+	c->encoded = 1;
+	STAT_INC(&c->worker->stats, gzip_responses);
+}
+
+// open path through the worker's cache; a directory counts as missing
+// returns 0 if the file was found
+static int open_file(struct conn *c, const char *path, struct stat *st)
+{
+	c->entry = cache_open(c->worker->cache, path, &c->file_fd, st);
+	if (!c->entry && c->file_fd != -1 && S_ISDIR(st->st_mode)) {
+		close(c->file_fd);
+		c->file_fd = -1;
+	}
+	return c->entry || c->file_fd != -1 ? 0 : -1;
+}
+
+// answer from an upstream fetch of filepath, joining one already running;
+// the header is only formed once the upstream's arrives
+static void start_proxied(struct conn *c, const char *filepath, int head)
+{
+	if (!(c->fetch = proxy_open(filepath))) {
+		set_header(c, "502 Bad Gateway", 0);
+		return;
+	}
+	c->proxy_head = head;
+	c->header_len = 0;
+	c->header_sent = 0;
+	c->status = 0;
+}
+
+// look up the requested file and queue the matching response
+static void prepare_response(struct conn *c)
+{
+	struct http_request *req = &c->req;
+	const struct http_str *connection;
+	char validators[HEADER_BUF_SIZE / 2];
+	char cached[PATH_MAX];
+	char *filepath;
+	const char *source;  // the file actually served, filepath or its place in the proxy cache
+	struct stat st;
+
+	STAT_INC(&c->worker->stats, requests);
+
+	switch (http_parse_request(req, c->request, c->request_len)) {
+	case HTTP_PARSE_ERROR:
+		reject(c, "400 Bad Request");
+		return;
+	case HTTP_PARSE_AGAIN:
+		reject(c, "431 Request Header Fields Too Large");
+		return;
+	}
+
+	if (req->version.len != strlen("HTTP/1.x") || memcmp(req->version.p, "HTTP/1.", 7) != 0) {
+		reject(c, "505 HTTP Version Not Supported");
+		return;
+	}
+
+	// HTTP/1.1 connections persist unless the client opts out, 1.0 ones the
+	// other way round
+	connection = http_find_header(req, "Connection");
+	if (http_str_eq(req->version, "HTTP/1.0")) {
+		c->keep_alive = connection && http_str_caseeq(*connection, "keep-alive");
+	} else {
+		c->keep_alive = !connection || !http_str_caseeq(*connection, "close");
+	}
+
+	int head = http_str_eq(req->method, "HEAD");
+	if (!head && !http_str_eq(req->method, "GET")) {
+		// we don't know how to skip a request body, so the next request
+		// can't be found; say so and close
+		reject(c, "501 Not Implemented");
+		return;
+	}
+	if (req->target.p[0] != '/') {
+		reject(c, "400 Bad Request");
+		return;
+	}
+
+	// the target is followed by a space we own, so the path can be
+	// terminated in place instead of being copied out; a query string is
+	// not part of the file name
+	filepath = (char *)req->target.p;
+	filepath[req->target.len] = '\0';
+	filepath[strcspn(filepath, "?")] = '\0';
+	filepath++;  // paths are relative to the server's working directory
+
+	if (strcmp(filepath, STATS_PATH) == 0) {
+		prepare_stats(c);
+		if (head) {
+			release_body(c);
+		}
+		return;
+	}
+
+	if (shed_request(c)) {
+		return;
+	}
+
+	source = filepath;
+	if (open_file(c, filepath, &st) == -1) {
+		// in proxy mode a miss may have been fetched before, or is fetched now
+		if (!proxy_enabled() || proxy_cache_path(filepath, cached, sizeof(cached)) == -1) {
+			set_header(c, "404 Not Found", 0);
+			return;
+		}
+		if (open_file(c, cached, &st) == -1) {
+			start_proxied(c, filepath, head);
+			return;
+		}
+		source = cached;
+	}
+	if (precompress_candidate(source, &st)) {
+		// validators, lengths and ranges below all describe whichever
+		// representation was picked
+		const struct http_str *accept_encoding = http_find_header(req, "Accept-Encoding");
+		c->vary = 1;
+		if (accept_encoding && http_accepts_encoding(*accept_encoding, "gzip")) {
+			select_variant(c, source, &st);
+		}
+	}
+	if (c->entry) {
+		c->mem = c->entry->data;
+	}
+
+	// RFC 7232 order: If-None-Match wins over If-Modified-Since, and both
+	// are settled before a Range is looked at
+	const struct http_str *if_none_match = http_find_header(req, "If-None-Match");
+	const struct http_str *if_modified_since = http_find_header(req, "If-Modified-Since");
+	if (if_none_match ? http_etag_list_matches(*if_none_match, &st) :
+			if_modified_since && http_not_modified_since(*if_modified_since, &st)) {
+		release_body(c);
+		start_header(c, "304 Not Modified", -1);
+		add_header(c, validators, http_validator_headers(&st, validators, sizeof(validators)));
+		end_header(c);
+		return;
+	}
+
+	// a Range is only honoured while If-Range (if any) still describes the file
+	const struct http_str *range = http_find_header(req, "Range");
+	const struct http_str *if_range = http_find_header(req, "If-Range");
+	c->nranges = 0;
+	if (range && (!if_range || http_if_range_matches(*if_range, &st))) {
+		c->nranges = http_parse_range(*range, st.st_size, c->ranges, HTTP_MAX_RANGES);
+		if (c->nranges == 0) {
+			release_body(c);
+			start_header(c, "416 Range Not Satisfiable", 0);
+			add_headerf(c, "Content-Range: bytes */%lld\r\n", (long long)st.st_size);
+			end_header(c);
+			return;
+		}
+		if (c->nranges < 0) {
+			c->nranges = 0;  // malformed or too many ranges, send everything
+		}
+	}
+
+	if (c->nranges == 0 && c->entry) {
+		// hot path: the header was serialized when the file was cached
+		c->header_len = 0;
+		c->header_sent = 0;
+		c->content_length = c->entry->size;
+		c->status = 200;
+		add_header(c, c->entry->header, c->entry->header_len);
+		end_header(c);
+		c->body_offset = 0;
+		c->body_end = c->entry->size;
+	} else if (c->nranges == 0) {
+		start_header(c, "200 OK", st.st_size);
+		add_header(c, "Accept-Ranges: bytes\r\n", strlen("Accept-Ranges: bytes\r\n"));
+		add_header(c, validators, http_validator_headers(&st, validators, sizeof(validators)));
+		end_header(c);
+		c->body_offset = 0;
+		c->body_end = st.st_size;
+	} else if (c->nranges == 1) {
+		start_header(c, "206 Partial Content", c->ranges[0].last - c->ranges[0].first + 1);
+		add_headerf(c, "Content-Range: bytes %lld-%lld/%lld\r\n",
+				(long long)c->ranges[0].first, (long long)c->ranges[0].last,
+				(long long)st.st_size);
+		add_header(c, validators, http_validator_headers(&st, validators, sizeof(validators)));
+		end_header(c);
+		c->body_offset = c->ranges[0].first;
+		c->body_end = c->ranges[0].last + 1;
+	} else {
+		prepare_multipart(c, &st);
+		add_header(c, validators, http_validator_headers(&st, validators, sizeof(validators)));
+		end_header(c);
+	}
+
+	if (head) {
+		// same header as the GET would get, but nothing after it
+		release_body(c);
+		c->nranges = 0;
+	}
+}
+
+// drop the request that was just answered and get ready for the next one,
+// keeping any pipelined bytes that arrived behind it
+static void finish_request(struct conn *c)
+{
+	memmove(c->request, c->request + c->req.header_len, c->request_len - c->req.header_len);
+	c->request_len -= c->req.header_len;
+	http_parser_init(&c->req);
+	c->req_start = c->request_len > 0 ? stats_now_usec() : 0;  // pipelined: already here
+	set_deadline(c, c->request_len > 0 ? CONN_TIMEOUT_HEADER : CONN_TIMEOUT_IDLE);
+
+	settle(c);
+	release_body(c);
+	c->vary = 0;
+	c->encoded = 0;
+	c->nranges = 0;
+	c->header_len = 0;
+	c->header_sent = 0;
+	c->body_offset = 0;
+	c->body_end = 0;
+	c->use_copy = 0;
+	c->body_len = 0;
+	c->body_sent = 0;
+	c->state = CONN_READING;
+}
+
+static void set_cork(struct conn *c, int on)
+{
+	// best effort: a failed cork only costs an extra small packet
+	setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+	c->corked = on;
+}
+
+// fallback body path: pread() into a user-space buffer, then send() it
+// returns 1 when the body is done, 0 if the socket would block, -1 on error
+static int copy_body(struct conn *c)
+{
+	if (!c->body && !(c->body = malloc(BODY_BUF_SIZE))) {
+		return -1;
+	}
+
+	while (1) {
+		if (c->body_sent == c->body_len) {
+			if (c->body_offset >= c->body_end) {
+				return 1;
+			}
+			size_t want = c->body_end - c->body_offset;
+			if (want > BODY_BUF_SIZE) {
+				want = BODY_BUF_SIZE;
+			}
+			ssize_t n = pread(c->file_fd, c->body, want, c->body_offset);
+			if (n == -1 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				return -1;  // read error, or the file shrank under us
+			}
+			c->body_offset += n;
+			c->body_len = n;
+			c->body_sent = 0;
+		}
+
+		ssize_t n = send(c->fd, c->body + c->body_sent, c->body_len - c->body_sent,
+				MSG_NOSIGNAL);
+		if (n >= 0) {
+			c->body_sent += n;
+			conn_count_sent(c, n);
+		} else if (errno == EINTR) {
+			continue;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		} else {
+			perror("send");
+			return -1;
+		}
+	}
+}
+
+// zero-copy body path: the kernel moves file pages straight to the socket
+// returns 1 when the body is done, 0 if the socket would block, -1 on error
+static int sendfile_body(struct conn *c)
+{
+	while (c->body_offset < c->body_end) {
+		size_t want = c->body_end - c->body_offset;
+		if (want > SENDFILE_CHUNK) {
+			want = SENDFILE_CHUNK;
+		}
+
+		ssize_t n = sendfile(c->fd, c->file_fd, &c->body_offset, want);
+		if (n > 0) {
+			conn_count_sent(c, n);
+			continue;
+		} else if (n == 0) {
+			return -1;  // the file shrank under us
+		} else if (errno == EINTR) {
+			continue;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		} else if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+			// this file (or socket) can't be spliced; copy the rest instead
+			c->use_copy = 1;
+			return copy_body(c);
+		} else {
+			perror("sendfile");
+			return -1;
+		}
+	}
+	return 1;
+}
+
+// in-memory body path: header and body leave together in one writev()
+// returns 1 when the response is done, 0 if the socket would block, -1 on error
+static int write_cached(struct conn *c)
+{
+	struct iovec iov[2];
+
+	while (1) {
+		int cnt = 0;
+		if (c->header_sent < c->header_len) {
+			iov[cnt].iov_base = c->header + c->header_sent;
+			iov[cnt].iov_len = c->header_len - c->header_sent;
+			cnt++;
+		}
+		if (c->body_offset < c->body_end) {
+			iov[cnt].iov_base = c->mem + c->body_offset;
+			iov[cnt].iov_len = c->body_end - c->body_offset;
+			cnt++;
+		}
+		if (cnt == 0) {
+			return 1;
+		}
+
+		ssize_t n = writev(c->fd, iov, cnt);
+		if (n >= 0) {
+			conn_count_sent(c, n);
+			size_t header_left = c->header_len - c->header_sent;
+			if ((size_t)n <= header_left) {
+				c->header_sent += n;
+			} else {
+				c->header_sent = c->header_len;
+				c->body_offset += n - header_left;
+			}
+		} else if (errno == EINTR) {
+			continue;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		} else {
+			perror("writev");
+			return -1;
+		}
+	}
+}
+
+// send the rest of an in-memory buffer
+// returns 1 when it is all sent, 0 if the socket would block, -1 on error
+static int send_pending(struct conn *c, const char *buf, size_t len, size_t *sent)
+{
+	while (*sent < len) {
+		ssize_t n = send(c->fd, buf + *sent, len - *sent, MSG_NOSIGNAL);
+		if (n >= 0) {
+			*sent += n;
+			conn_count_sent(c, n);
+		} else if (errno == EINTR) {
+			continue;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		} else {
+			perror("send");
+			return -1;
+		}
+	}
+	return 1;
+}
+
+// send body_offset..body_end from whichever source holds the file
+// returns 1 when the range is sent, 0 if the socket would block, -1 on error
+static int send_range(struct conn *c)
+{
+	if (c->mem) {
+		size_t sent = c->body_offset;
+		int rv = send_pending(c, c->mem, c->body_end, &sent);
+		c->body_offset = sent;
+		return rv;
+	}
+	return c->use_copy ? copy_body(c) : sendfile_body(c);
+}
+
+// bring a proxied response up to date with its fetch: form the header once
+// the upstream's status is known, then extend the body to what has arrived
+// returns 1 if the response is complete once body_end is sent, 0 if more is
+// to come, -1 if the fetch broke off after the header was promised
+static int follow_fetch(struct conn *c)
+{
+	struct proxy_fetch *f = c->fetch;
+	int state = __atomic_load_n(&f->state, __ATOMIC_SEQ_CST);
+	unsigned long long written = __atomic_load_n(&f->written, __ATOMIC_SEQ_CST);
+
+	if (c->header_len == 0) {
+		if (state == PROXY_PENDING) {
+			return 0;
+		}
+		if (f->status != 200) {
+			// unreachable or not found upstream: relay a 404, anything else
+			// is the gateway's failure
+			int status = f->status;
+			release_body(c);
+			set_header(c, status == 404 ? "404 Not Found" : "502 Bad Gateway", 0);
+			return 1;
+		}
+		start_header(c, "200 OK", f->length);
+		if (f->length == -1) {
+			c->keep_alive = 0;  // the body ends with the connection
+		}
+		end_header(c);
+		if (c->proxy_head) {
+			release_body(c);
+			return 1;
+		}
+		if ((c->file_fd = dup(f->fd)) == -1) {
+			return -1;
+		}
+		c->body_offset = 0;
+	}
+	c->body_end = written;
+	if (state == PROXY_FAILED) {
+		return -1;
+	}
+	return state == PROXY_DONE;
+}
+
+// ask to be woken by the fetch's next step, unless it took one already
+// since follow_fetch() looked
+// returns 1 if the connection must wait for the wake-up, 0 to go on
+static int await_fetch(struct conn *c)
+{
+	struct proxy_fetch *f = c->fetch;
+
+	proxy_watch(f, c->worker->id);
+	int state = __atomic_load_n(&f->state, __ATOMIC_SEQ_CST);
+	unsigned long long written = __atomic_load_n(&f->written, __ATOMIC_SEQ_CST);
+	if (c->header_len == 0 ? state != PROXY_PENDING :
+			state != PROXY_STREAMING || written > (unsigned long long)c->body_end) {
+		return 0;
+	}
+	c->upstream_wait = 1;
+	if (c->corked) {
+		set_cork(c, 0);  // what is queued shouldn't wait for the upstream too
+	}
+	return 1;
+}
+
+// a proxied response can't start before the upstream's header is in
+// returns 1 once the header is formed, 0 if the connection waits for the
+// upstream, -1 if the fetch failed
+static int await_header(struct conn *c)
+{
+	while (c->fetch && c->header_len == 0) {
+		if (follow_fetch(c) == -1) {
+			return -1;
+		}
+		if (c->header_len == 0 && await_fetch(c)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// returns 1 once the whole response is sent, 0 if the socket would block
+// (or the upstream is behind), -1 on a send or read error
+static int write_response(struct conn *c)
+{
+	int rv, complete;
+
+	if ((rv = await_header(c)) <= 0) {
+		return rv;
+	}
+
+	if (c->mem && c->nranges <= 1) {
+		return write_cached(c);
+	}
+
+	// hold the header back until the first body segment so both leave in
+	// full-sized packets instead of a tiny header packet on its own
+	if ((c->file_fd != -1 || c->mem) && c->header_sent == 0 && !c->corked) {
+		set_cork(c, 1);
+	}
+
+	if ((rv = send_pending(c, c->header, c->header_len, &c->header_sent)) <= 0) {
+		return rv;
+	}
+
+	if (c->nranges > 1) {
+		// multipart: delimiter, range, delimiter, range, ..., closing delimiter
+		while (1) {
+			if ((rv = send_pending(c, c->part, c->part_len, &c->part_sent)) <= 0) {
+				return rv;
+			}
+			if (c->cur_range == c->nranges) {
+				break;
+			}
+			if ((rv = send_range(c)) <= 0) {
+				return rv;
+			}
+			start_part(c, c->cur_range + 1);
+		}
+	} else if (c->file_fd != -1) {
+		// a proxied body is sent as far as it has arrived, then waits
+		while (1) {
+			complete = 1;
+			if (c->fetch && (complete = follow_fetch(c)) == -1) {
+				return -1;
+			}
+			if ((rv = send_range(c)) <= 0) {
+				return rv;
+			}
+			if (complete) {
+				break;
+			}
+			if (await_fetch(c)) {
+				return 0;
+			}
+		}
+	}
+
+	if (c->corked) {
+		set_cork(c, 0);  // flush the final partial segment now
+	}
+	return 1;
+}
+
+// switch to HTTP/2 if the request asks for it: the preface of a client
+// with prior knowledge, or an HTTP/1.1 request with Upgrade: h2c
+// returns 1 if the connection switched
+static int start_h2(struct conn *c)
+{
+	struct http_request *req = &c->req;
+	const struct http_str *upgrade, *connection, *settings;
+
+	if (http_parse_request(req, c->request, c->request_len) != HTTP_PARSE_DONE) {
+		return 0;
+	}
+	if (http_str_eq(req->method, "PRI") && http_str_eq(req->target, "*") &&
+			http_str_eq(req->version, "HTTP/2.0")) {
+		c->h2 = h2_create(c, NULL);
+	} else {
+		upgrade = http_find_header(req, "Upgrade");
+		connection = http_find_header(req, "Connection");
+		settings = http_find_header(req, "HTTP2-Settings");
+		// a request body would have to be read before the switch, so only
+		// GET and HEAD are upgraded; the rest are answered over HTTP/1.1
+		if (!upgrade || !connection || !settings || !http_has_token(*upgrade, "h2c") ||
+				!http_has_token(*connection, "Upgrade") ||
+				!http_str_eq(req->version, "HTTP/1.1") ||
+				(!http_str_eq(req->method, "GET") && !http_str_eq(req->method, "HEAD"))) {
+			return 0;
+		}
+		c->h2 = h2_create(c, settings);
+	}
+	if (!c->h2) {
+		return 0;  // out of memory or bad settings: stay with HTTP/1.1
+	}
+	c->state = CONN_H2;
+	return 1;
+}
+
+// answer the request that was just read, or switch to HTTP/2 for it
+static void begin_response(struct conn *c)
+{
+	if (start_h2(c)) {
+		return;
+	}
+	prepare_response(c);
+	commit_response(c);
+	set_deadline(c, CONN_TIMEOUT_SEND);
+	c->state = CONN_WRITING;
+}
+
+static void record_first_byte(struct conn *c)
+{
+	c->first_byte_sent = 1;
+	stats_record(&c->worker->stats, &c->worker->stats.first_byte,
+			stats_now_usec() - c->accepted_at);
+}
+
+int conn_process(struct conn *c)
+{
+	int rv;
+
+	c->upstream_wait = 0;
+	while (1) {
+		switch (c->state) {
+		case CONN_READING:
+			if ((rv = read_request(c)) <= 0) {
+				return rv;
+			}
+			begin_response(c);
+			break;
+		case CONN_WRITING:
+			rv = write_response(c);
+			if (!c->first_byte_sent && c->header_sent > 0) {
+				record_first_byte(c);
+			}
+			if (rv == 0 && c->progressed) {
+				set_deadline(c, CONN_TIMEOUT_SEND);  // still slow, but moving
+			}
+			if (rv <= 0) {
+				return rv;
+			}
+			conn_response_done(c);
+			break;
+		case CONN_H2:
+			rv = h2_process(c->h2);
+			if (!c->first_byte_sent && c->progressed) {
+				record_first_byte(c);
+			}
+			// with nothing queued the connection idles, even with streams
+			// waiting on upstream fetches; otherwise output must keep moving
+			if (rv == 0 && !h2_pending(c->h2)) {
+				set_deadline(c, CONN_TIMEOUT_IDLE);
+			} else if (rv == 0 && (c->progressed || c->timeout != CONN_TIMEOUT_SEND)) {
+				set_deadline(c, CONN_TIMEOUT_SEND);
+			}
+			return rv;
+		case CONN_DONE:
+			return -1;
+		}
+	}
+}
+
+int conn_received(struct conn *c, size_t n)
+{
+	if (n > 0) {
+		received(c, n);
+	}
+	if (!request_complete(c)) {
+		return 0;
+	}
+	begin_response(c);
+	return 1;
+}
+
+void conn_response_sent(struct conn *c, size_t n)
+{
+	conn_count_sent(c, n);
+	if (!c->first_byte_sent && n > 0) {
+		record_first_byte(c);
+	}
+	set_deadline(c, CONN_TIMEOUT_SEND);
+}
+
+int conn_response_done(struct conn *c)
+{
+	stats_count_response(&c->worker->stats, c->status);
+	stats_record(&c->worker->stats, &c->worker->stats.request_time,
+			stats_now_usec() - c->req_start);
+	if (c->keep_alive) {
+		finish_request(c);
+		return 1;
+	}
+	c->state = CONN_DONE;
+	return 0;
+}
+
+void conn_stream_start(struct conn *s)
+{
+	s->req_start = stats_now_usec();
+	prepare_response(s);
+	commit_response(s);
+}
+
+int conn_stream_header(struct conn *s)
+{
+	return await_header(s);
+}
+
+int conn_stream_has_body(const struct conn *s)
+{
+	if (s->file_fd == -1 && !s->mem && !s->fetch) {
+		return 0;
+	}
+	return s->content_length > 0 || (s->fetch && s->fetch->length == -1);
+}
+
+ssize_t conn_stream_body(struct conn *s, char *buf, size_t len)
+{
+	size_t n;
+	int complete;
+
+	if (s->file_fd == -1 && !s->mem && !s->fetch) {
+		return 0;
+	}
+	while (1) {
+		if (s->nranges > 1) {
+			// the same sequence write_response() sends: delimiter, range,
+			// ..., closing delimiter
+			if (s->part_sent < s->part_len) {
+				n = s->part_len - s->part_sent < len ? s->part_len - s->part_sent : len;
+				memcpy(buf, s->part + s->part_sent, n);
+				s->part_sent += n;
+				pay(s, n);
+				return n;
+			}
+			if (s->cur_range == s->nranges) {
+				return 0;
+			}
+			if (s->body_offset == s->body_end) {
+				start_part(s, s->cur_range + 1);
+				continue;
+			}
+		} else if (s->fetch) {
+			if ((complete = follow_fetch(s)) == -1) {
+				return -1;
+			}
+			if (s->body_offset == s->body_end) {
+				if (complete) {
+					return 0;
+				}
+				if (await_fetch(s)) {
+					return CONN_STREAM_WAIT;
+				}
+				continue;
+			}
+		} else if (s->body_offset == s->body_end) {
+			return 0;
+		}
+
+		n = s->body_end - s->body_offset < (off_t)len ? (size_t)(s->body_end - s->body_offset) : len;
+		if (s->mem) {
+			memcpy(buf, s->mem + s->body_offset, n);
+		} else {
+			ssize_t got;
+			while ((got = pread(s->file_fd, buf, n, s->body_offset)) == -1 && errno == EINTR) {
+				;
+			}
+			if (got <= 0) {
+				return -1;  // read error, or the file shrank under us
+			}
+			n = got;
+		}
+		s->body_offset += n;
+		pay(s, n);
+		return n;
+	}
+}
+
+void conn_stream_end(struct conn *s, int completed)
+{
+	if (completed) {
+		stats_count_response(&s->worker->stats, s->status);
+		stats_record(&s->worker->stats, &s->worker->stats.request_time,
+				stats_now_usec() - s->req_start);
+	}
+	settle(s);
+	release_body(s);
+}
@@ -0,0 +1,228 @@
+/*
+** conn.h -- per-connection HTTP state machine shared by the fork and epoll servers
+*/
+#ifndef CONN_H
+#define CONN_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "http.h"
+#include "timer_wheel.h"
+
+#define REQUEST_BUF_SIZE 8192  // max size of a request header
+#define HEADER_BUF_SIZE 1024   // max size of a response header
+#define BODY_BUF_SIZE 65536    // bytes staged per send when sendfile() is unavailable
+#define SENDFILE_CHUNK (4 << 20)  // max bytes handed to one sendfile() call
+
+#define CONN_HEADER_TIMEOUT 10  // default seconds to receive a whole request header
+#define CONN_IDLE_TIMEOUT 30    // default seconds a keep-alive connection may sit idle
+#define CONN_SEND_TIMEOUT 30    // default seconds a response may go without progress
+
+#define CONN_STREAM_WAIT (-2)  // conn_stream_body(): the upstream is behind
+
+struct cache_entry;
+struct h2;
+struct proxy_fetch;
+struct worker;
+
+// what a connection's deadline is guarding against
+enum conn_timeout {
+	CONN_TIMEOUT_HEADER,  // request header trickling in too slowly
+	CONN_TIMEOUT_IDLE,    // no new request on a kept-alive connection
+	CONN_TIMEOUT_SEND,    // client not reading the response
+	CONN_TIMEOUT_KINDS,
+};
+
+// seconds, 0 disables that timeout
+struct conn_timeouts {
+	unsigned int header;
+	unsigned int idle;
+	unsigned int send;
+};
+
+enum conn_state {
+	CONN_READING,  // collecting the request header
+	CONN_WRITING,  // streaming the response header and body
+	CONN_DONE,     // last response fully sent, connection can be closed
+	CONN_H2,       // switched to HTTP/2, h2 drives the socket
+};
+
+/*
+ * Everything the server needs to know about one client. The same struct is
+ * driven by the blocking fork child and by the non-blocking event loop; the
+ * handlers simply stop and report back whenever a socket would block.
+ */
+struct conn {
+	int fd;
+	struct sockaddr_storage peer;  // client address, for the rate limiter
+	struct worker *worker;  // owner of the socket, its cache and its counters
+	enum conn_state state;
+	struct h2 *h2;          // HTTP/2 state once the connection switched, else NULL
+
+	char request[REQUEST_BUF_SIZE];
+	size_t request_len;  // bytes buffered, may include pipelined requests
+	struct http_request req;  // parse state and views into request[]
+	int keep_alive;      // serve another request after this response
+
+	// latency bookkeeping, CLOCK_MONOTONIC microseconds
+	unsigned long long accepted_at;
+	unsigned long long req_start;  // first byte of the current request, 0 until it arrives
+	int first_byte_sent;           // accept-to-first-byte is recorded once per connection
+	int status;                    // status code of the response being sent
+
+	// the connection is closed if it is still waiting at the deadline; the
+	// header deadline is fixed once set, the send one moves with every write
+	unsigned long long deadline;   // CLOCK_MONOTONIC microseconds, 0 for none
+	enum conn_timeout timeout;     // which of the worker's timeouts deadline is
+	int progressed;                // bytes went out since the deadline was set
+	struct timer_node timer;       // the event loop's handle on deadline
+
+	char header[HEADER_BUF_SIZE];
+	size_t header_len;
+	size_t header_sent;
+	off_t content_length;  // as advertised in the header
+
+	// admission control: what this connection adds to the worker's load
+	int busy;            // counted in the worker's responses in progress
+	unsigned long long owed;  // counted in the worker's outstanding bytes
+
+	int corked;         // TCP_CORK is held while the header waits for the body
+	int vary;           // the response depends on Accept-Encoding
+	int encoded;        // the body is the file's gzip variant
+
+	struct cache_entry *entry;  // cached file being served, its data is mem
+	char *mem;          // in-memory body, NULL if it comes from file_fd
+	int mem_owned;      // mem is malloc'd for this response (the /__stats page)
+	int file_fd;        // file being served, -1 if the response has no body
+	off_t body_offset;  // next file offset to send
+	off_t body_end;     // file offset one past the last byte to send
+
+	// Range requests; with more than one range the body is multipart and
+	// each range is preceded by part[], a delimiter plus Content-Range
+	struct http_range ranges[HTTP_MAX_RANGES];
+	int nranges;        // 0 for a full response
+	int cur_range;      // range being sent, nranges once only the closing delimiter is left
+	off_t file_size;
+	char boundary[24];
+	char part[128];
+	size_t part_len;
+	size_t part_sent;
+
+	// proxy mode: a miss is answered from an upstream fetch, following the
+	// file it fills; until the upstream's header is in, header_len is 0
+	struct proxy_fetch *fetch;  // NULL unless the response is proxied
+	int proxy_head;     // the proxied request is a HEAD
+	int upstream_wait;  // conn_process() stopped for the fetch, not the socket
+	struct conn *park_next;     // the event loop's list of connections
+	struct conn **park_pprev;   // waiting on fetches, NULL when not on it
+
+	// copy path, only used when the kernel refuses sendfile() for the file
+	int use_copy;
+	char *body;         // allocated on first use
+	size_t body_len;    // bytes currently staged in body[]
+	size_t body_sent;   // bytes of body[] already handed to the socket
+};
+
+/*
+ * set up a connection for a freshly accepted socket, or with fd -1 for an
+ * HTTP/2 stream answered through the conn_stream_*() calls
+ * input peer - the client's address
+ *       w - the worker serving it
+ */
+void conn_init(struct conn *c, int fd, const struct sockaddr_storage *peer, struct worker *w);
+
+/*
+ * advance the connection as far as the socket allows
+ * output - 0 if the connection is waiting for the socket to become ready again,
+ *          -1 if the connection is finished (or broken) and should be closed
+ */
+int conn_process(struct conn *c);
+
+/*
+ * release the socket and any open file held by the connection; the caller
+ * disarms c->timer first if it armed it, and may close the socket itself
+ * by setting c->fd to -1 beforehand
+ */
+void conn_close(struct conn *c);
+
+/*
+ * close a connection whose deadline passed: an idle keep-alive connection is
+ * closed normally, a stalled one is reset so the kernel drops whatever is
+ * still queued for a client that stopped reading
+ */
+void conn_expire(struct conn *c);
+
+/*
+ * account n bytes written to c's socket by someone other than c itself
+ */
+void conn_count_sent(struct conn *c, size_t n);
+
+/*
+ * An engine that does the socket I/O itself (the io_uring loop) drives a
+ * connection with the calls below instead of conn_process(): it reads into
+ * c->request, sends c->header followed by the body the response names
+ * (c->mem or c->file_fd, body_offset..body_end), and reports back.
+ */
+
+/*
+ * n more bytes were read into c->request (0 to look at pipelined bytes
+ * already there)
+ * output - 1 once the request header is complete and its response prepared:
+ *          c->state is CONN_WRITING, or CONN_H2 if the request switched
+ *          protocols; 0 if more of the header must be read
+ */
+int conn_received(struct conn *c, size_t n);
+
+/*
+ * n bytes of the response went out: counts them and restarts the send deadline
+ */
+void conn_response_sent(struct conn *c, size_t n);
+
+/*
+ * the whole response went out
+ * output - 1 if the connection stays open for another request (which may
+ *          already be buffered, see conn_received()), 0 if it is done
+ */
+int conn_response_done(struct conn *c);
+
+/*
+ * An HTTP/2 stream is answered by a socketless struct conn: the stream's
+ * request is rendered as HTTP/1.1 into s->request, conn_stream_start()
+ * prepares the response exactly as for an HTTP/1 request, and the stream
+ * reads the header from s->header and the body through conn_stream_body().
+ */
+
+/*
+ * prepare the response to the request in s->request[0..request_len)
+ */
+void conn_stream_start(struct conn *s);
+
+/*
+ * make sure the response header is formed; only a proxied response can be
+ * waiting for it
+ * output - 1 once s->header and s->status are set, 0 if the upstream's header
+ *          hasn't arrived (s->upstream_wait is set and the worker is woken when
+ *          it does), -1 if the upstream fetch failed
+ */
+int conn_stream_header(struct conn *s);
+
+/*
+ * whether the response has a body to follow the header
+ */
+int conn_stream_has_body(const struct conn *s);
+
+/*
+ * copy the next body bytes, up to len, into buf
+ * output - the number of bytes, 0 once the body is complete, -1 on a read
+ *          error, CONN_STREAM_WAIT if the upstream is behind (as for
+ *          conn_stream_header())
+ */
+ssize_t conn_stream_body(struct conn *s, char *buf, size_t len);
+
+/*
+ * count the response if completed and release what it holds
+ */
+void conn_stream_end(struct conn *s, int completed);
+
+#endif
@@ -0,0 +1,16 @@
+/*
+** counter.h -- statistics counters written by one thread and read by others
+*/
+#ifndef COUNTER_H
+#define COUNTER_H
+
+// Every counter has a single writer (the worker that owns it), so a relaxed
+// load + store is enough: readers never see a torn value and the writer
+// never pays for a locked instruction.
+#define COUNTER_ADD(counter, n) \
+	__atomic_store_n(&(counter), __atomic_load_n(&(counter), __ATOMIC_RELAXED) + (n), \
+			__ATOMIC_RELAXED)
+#define COUNTER_INC(counter) COUNTER_ADD(counter, 1)
+#define COUNTER_GET(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+#endif
@@ -0,0 +1,255 @@
+/*
+** disk_cache.c -- on-disk cache of response bodies keyed by URL, for conditional GETs
+*/
+
+#define _GNU_SOURCE  // copy_file_range()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+
+#include "disk_cache.h"
+
+#define CACHE_PATH_SIZE (MAX_PATH_SIZE + 64)
+
+static void url_key(const struct url *u, char *key, size_t len)
+{
+	snprintf(key, len, "http://%s:%s%s", u->domain, u->port, u->path);
+}
+
+// <dir>/<FNV-1a of the url><suffix>
+static void cache_path(const char *dir, const struct url *u, const char *suffix,
+		char *path, size_t len)
+{
+	char key[MAX_DOMAIN_SIZE + MAX_PATH_SIZE + 32];
+	unsigned long long h = 14695981039346656037ULL;
+	const char *p;
+
+	url_key(u, key, sizeof key);
+	for (p = key; *p; p++) {
+		h ^= (unsigned char)*p;
+		h *= 1099511628211ULL;
+	}
+	snprintf(path, len, "%s/%016llx%s", dir, h, suffix);
+}
+
+int disk_cache_lookup(const char *dir, const struct url *u, struct disk_cache_meta *meta)
+{
+	char path[CACHE_PATH_SIZE];
+	char key[MAX_DOMAIN_SIZE + MAX_PATH_SIZE + 32];
+	char line[MAX_DOMAIN_SIZE + MAX_PATH_SIZE + 64];
+	FILE *fp;
+	int found = 0;
+
+	cache_path(dir, u, ".meta", path, sizeof path);
+	if (!(fp = fopen(path, "r"))) {
+		return -1;
+	}
+	url_key(u, key, sizeof key);
+	meta->etag[0] = '\0';
+	meta->last_modified[0] = '\0';
+	while (fgets(line, sizeof line, fp)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (strncmp(line, "url: ", 5) == 0) {
+			found = strcmp(line + 5, key) == 0;  // a hash collision is just a miss
+		} else if (strncmp(line, "etag: ", 6) == 0) {
+			snprintf(meta->etag, sizeof meta->etag, "%s", line + 6);
+		} else if (strncmp(line, "last-modified: ", 15) == 0) {
+			snprintf(meta->last_modified, sizeof meta->last_modified, "%s", line + 15);
+		}
+	}
+	fclose(fp);
+
+	cache_path(dir, u, ".body", path, sizeof path);
+	if (!found || (!meta->etag[0] && !meta->last_modified[0]) || access(path, R_OK) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+int disk_cache_begin(const char *dir, const struct url *u, char *tmp, size_t tmp_len)
+{
+	int fd;
+
+	cache_path(dir, u, ".XXXXXX", tmp, tmp_len);
+	if ((fd = mkostemp(tmp, O_CLOEXEC)) == -1) {
+		perror(tmp);
+		return -1;
+	}
+
+	// the body may become the output itself, so give it the mode a plain
+	// open() would have rather than mkostemp()'s 0600
+	mode_t mask = umask(0);
+	umask(mask);
+	fchmod(fd, 0666 & ~mask);
+	return fd;
+}
+
+int disk_cache_commit(const char *dir, const struct url *u, const char *tmp,
+		const struct disk_cache_meta *meta)
+{
+	char path[CACHE_PATH_SIZE], meta_tmp[CACHE_PATH_SIZE];
+	char key[MAX_DOMAIN_SIZE + MAX_PATH_SIZE + 32];
+	FILE *fp;
+	int fd;
+
+	cache_path(dir, u, ".XXXXXX", meta_tmp, sizeof meta_tmp);
+	if ((fd = mkostemp(meta_tmp, O_CLOEXEC)) == -1 || !(fp = fdopen(fd, "w"))) {
+		perror(meta_tmp);
+		if (fd != -1) {
+			close(fd);
+			unlink(meta_tmp);
+		}
+		unlink(tmp);
+		return -1;
+	}
+	url_key(u, key, sizeof key);
+	fprintf(fp, "url: %s\netag: %s\nlast-modified: %s\n", key, meta->etag, meta->last_modified);
+	if (fclose(fp) != 0) {
+		unlink(meta_tmp);
+		unlink(tmp);
+		return -1;
+	}
+
+	// body before metadata: a lookup racing with us either sees the old
+	// validators, which simply won't match, or the new ones with the new body
+	cache_path(dir, u, ".body", path, sizeof path);
+	if (rename(tmp, path) == -1) {
+		perror(path);
+		unlink(tmp);
+		unlink(meta_tmp);
+		return -1;
+	}
+	cache_path(dir, u, ".meta", path, sizeof path);
+	if (rename(meta_tmp, path) == -1) {
+		perror(path);
+		unlink(meta_tmp);
+		return -1;
+	}
+	return 0;
+}
+
+// plain read()/write() for destinations neither kernel copy accepts, such
+// as a file opened for appending
+static int copy_slow(int src, int dst)
+{
+	char buf[65536];
+	ssize_t n;
+
+	while ((n = read(src, buf, sizeof buf)) != 0) {
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		for (ssize_t done = 0; done < n; ) {
+			ssize_t w = write(dst, buf + done, n - done);
+			if (w == -1 && errno != EINTR) {
+				return -1;
+			}
+			done += w > 0 ? w : 0;
+		}
+	}
+	return 0;
+}
+
+// copy all of src to dst in the kernel; copy_file_range() between files
+// (which may itself share blocks), sendfile() to anything else
+static int copy_fd(int src, int dst)
+{
+	int use_sendfile = 0;
+
+	while (1) {
+		ssize_t n = use_sendfile ? sendfile(dst, src, NULL, 1 << 30) :
+			copy_file_range(src, NULL, dst, NULL, 1 << 30, 0);
+		if (n > 0) {
+			continue;
+		}
+		if (n == 0) {
+			return 0;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if (!use_sendfile && (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+					errno == EOPNOTSUPP || errno == EBADF)) {
+			use_sendfile = 1;  // not file to file on one kernel path
+			continue;
+		}
+		if (errno == EINVAL || errno == ENOSYS) {
+			break;
+		}
+		perror("client: copy");
+		return -1;
+	}
+	if (copy_slow(src, dst) == -1) {
+		perror("client: copy");
+		return -1;
+	}
+	return 0;
+}
+
+int disk_cache_materialize(const char *dir, const struct url *u, const char *output)
+{
+	char body[CACHE_PATH_SIZE];
+	int src, dst, rv = -1;
+
+	cache_path(dir, u, ".body", body, sizeof body);
+	if ((src = open(body, O_RDONLY | O_CLOEXEC)) == -1) {
+		perror(body);
+		return -1;
+	}
+	if (strcmp(output, "-") == 0) {
+		rv = copy_fd(src, STDOUT_FILENO);
+		close(src);
+		return rv;
+	}
+
+	// never write through an existing output: it may be a hardlink to a
+	// cached body from an earlier run
+	if (unlink(output) == -1 && errno != ENOENT) {
+		perror(output);
+		close(src);
+		return -1;
+	}
+
+	// a reflink shares the blocks until either side is written
+	if ((dst = open(output, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666)) != -1 &&
+			ioctl(dst, FICLONE, src) == 0) {
+		rv = 0;
+		goto out;
+	}
+	if (dst != -1) {
+		close(dst);
+		unlink(output);
+	}
+
+	// a hardlink shares the file itself; the cache never writes a body in
+	// place, so a later fetch can't change the output (though writing to
+	// the output changes the cached copy, hence the reflink first)
+	if (link(body, output) == 0) {
+		close(src);
+		return 0;
+	}
+
+	if ((dst = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) == -1) {
+		perror(output);
+		close(src);
+		return -1;
+	}
+	rv = copy_fd(src, dst);
+
+out:
+	close(dst);
+	close(src);
+	return rv;
+}
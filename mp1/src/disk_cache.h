@@ -0,0 +1,51 @@
+/*
+** disk_cache.h -- on-disk cache of response bodies keyed by URL, for conditional GETs
+*/
+#ifndef DISK_CACHE_H
+#define DISK_CACHE_H
+
+#include <stddef.h>
+
+#include "fetch.h"
+
+/*
+ * Each URL maps to two files in the cache directory, named after a hash of
+ * the URL: <hash>.body holds the body, <hash>.meta the URL and the
+ * validators it was served with. Both are replaced by rename(), so a reader
+ * never sees half a body, and an output hardlinked to an older body keeps
+ * its content.
+ */
+struct disk_cache_meta {
+	char etag[128];          // empty if the server sent none
+	char last_modified[64];  // empty if the server sent none
+};
+
+/*
+ * look up the cached copy of u
+ * output - 0 and the validators in *meta if there is one, -1 otherwise
+ */
+int disk_cache_lookup(const char *dir, const struct url *u, struct disk_cache_meta *meta);
+
+/*
+ * open a temporary file in dir for a new body of u
+ * input tmp - receives the file's path, for disk_cache_commit()
+ * output - the file, or -1 on failure
+ */
+int disk_cache_begin(const char *dir, const struct url *u, char *tmp, size_t tmp_len);
+
+/*
+ * make the completely written body at tmp the cached copy of u
+ * output - 0 on success, -1 on failure (tmp is removed either way)
+ */
+int disk_cache_commit(const char *dir, const struct url *u, const char *tmp,
+		const struct disk_cache_meta *meta);
+
+/*
+ * put the cached body of u at output ("-" for standard output) without
+ * copying where the file system allows: a reflink first, then a hardlink,
+ * then an in-kernel copy
+ * output - 0 on success, -1 on failure
+ */
+int disk_cache_materialize(const char *dir, const struct url *u, const char *output);
+
+#endif
@@ -0,0 +1,389 @@
+/*
+** event_loop.c -- edge-triggered epoll workers, one per SO_REUSEPORT listener
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "admission.h"
+#include "cache.h"
+#include "conn.h"
+#include "counter.h"
+#include "event_loop.h"
+#include "stats.h"
+#include "timer_wheel.h"
+#include "uring_loop.h"
+
+#define MAX_EVENTS 256  // how many ready sockets we handle per epoll_wait()
+
+#define TICK_USEC (TIMER_TICK_MS * 1000ULL)
+#define LAG_SHIFT 3  // the lag average moves 1/8 of the way to each new batch
+
+// epoll_event.data.ptr of the listening socket, the wheel's timerfd and the
+// wake-up eventfd; every other entry is a conn
+static char listener_tag;
+static char timer_tag;
+static char wake_tag;
+
+// every worker of the process, for the /__stats page
+static struct worker *all_workers;
+static int num_workers;
+
+void worker_schedule(struct timer_wheel *wheel, struct conn *c)
+{
+	if (c->deadline) {
+		// round up: a timer must never fire before its deadline
+		timer_schedule(wheel, &c->timer, (c->deadline + TICK_USEC - 1) / TICK_USEC);
+	} else {
+		timer_cancel(&c->timer);
+	}
+}
+
+void worker_park(struct worker *w, struct conn *c)
+{
+	if (c->park_pprev) {
+		return;
+	}
+	c->park_next = w->parked;
+	if (w->parked) {
+		w->parked->park_pprev = &c->park_next;
+	}
+	w->parked = c;
+	c->park_pprev = &w->parked;
+}
+
+void worker_unpark(struct conn *c)
+{
+	if (!c->park_pprev) {
+		return;
+	}
+	*c->park_pprev = c->park_next;
+	if (c->park_next) {
+		c->park_next->park_pprev = c->park_pprev;
+	}
+	c->park_next = NULL;
+	c->park_pprev = NULL;
+}
+
+static void close_connection(struct worker *w, struct conn *c, int expired)
+{
+	timer_cancel(&c->timer);
+	worker_unpark(c);
+	if (expired) {
+		conn_expire(c);
+	} else {
+		conn_close(c);  // closing the fd also drops it from the epoll set
+	}
+	free(c);
+	STAT_INC(&w->stats, closed);
+}
+
+static void expire_connection(struct timer_node *t, void *arg)
+{
+	struct worker *w = arg;
+	struct conn *c = (struct conn *)((char *)t - offsetof(struct conn, timer));
+
+	STAT_INC(&w->stats, timed_out[c->timeout]);
+	close_connection(w, c, 1);
+}
+
+// a periodic timerfd drives the wheel, so idle connections cost nothing
+// until the tick their deadline falls in
+static int open_ticker(int epfd)
+{
+	struct itimerspec its;
+	struct epoll_event ev;
+	int tfd;
+
+	if ((tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+		perror("timerfd_create");
+		return -1;
+	}
+	its.it_interval.tv_sec = TIMER_TICK_MS / 1000;
+	its.it_interval.tv_nsec = (TIMER_TICK_MS % 1000) * 1000000L;
+	its.it_value = its.it_interval;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &timer_tag;
+	if (timerfd_settime(tfd, 0, &its, NULL) == -1 ||
+			epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev) == -1) {
+		perror("timerfd");
+		close(tfd);
+		return -1;
+	}
+	return tfd;
+}
+
+// run a connection's state machine after an event and file it according
+// to what it waits for next
+static void process(struct worker *w, struct timer_wheel *wheel, struct conn *c)
+{
+	if (conn_process(c) == -1) {
+		close_connection(w, c, 0);
+		return;
+	}
+	worker_schedule(wheel, c);
+	if (c->upstream_wait) {
+		worker_park(w, c);
+	}
+}
+
+// give every parked connection another go; those whose fetch is still
+// behind park themselves again
+static void wake_parked(struct worker *w, struct timer_wheel *wheel)
+{
+	struct conn *list = w->parked, *c;
+	uint64_t count;
+
+	while (read(w->wake_fd, &count, sizeof(count)) > 0) {
+		;
+	}
+	w->parked = NULL;
+	if (list) {
+		list->park_pprev = &list;
+	}
+	while ((c = list)) {
+		worker_unpark(c);
+		process(w, wheel, c);
+	}
+}
+
+// drain the accept queue; edge-triggered epoll only reports it once, and
+// past the connection cap the rest of the queue is answered 503 right away
+// instead of left to pile up
+static void accept_connections(struct worker *w, int epfd, struct timer_wheel *wheel)
+{
+	struct sockaddr_storage peer;
+	socklen_t peer_len;
+
+	while (1) {
+		peer_len = sizeof(peer);
+		int new_fd = accept4(w->listen_fd, (struct sockaddr *)&peer, &peer_len,
+				SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (new_fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror("accept");
+			}
+			return;
+		}
+
+		if (w->limits.conns &&
+				COUNTER_GET(w->stats.accepted) - COUNTER_GET(w->stats.closed) >= w->limits.conns) {
+			admission_refuse(new_fd);
+			STAT_INC(&w->stats, shed[SHED_CONNS]);
+			stats_count_response(&w->stats, 503);
+			continue;
+		}
+
+		struct conn *c = malloc(sizeof(*c));
+		if (!c) {
+			close(new_fd);
+			continue;
+		}
+		conn_init(c, new_fd, &peer, w);
+		STAT_INC(&w->stats, accepted);
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = c;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, new_fd, &ev) == -1) {
+			perror("epoll_ctl");
+			close_connection(w, c, 0);
+			continue;
+		}
+		worker_schedule(wheel, c);
+	}
+}
+
+int run_event_loop(struct worker *w)
+{
+	int listen_fd = w->listen_fd;
+	struct epoll_event ev, events[MAX_EVENTS];
+	struct timer_wheel *wheel;
+	uint64_t expirations;
+	unsigned long long start, took;
+	int epfd, tfd, n, i, tick, woken;
+
+	int flags = fcntl(listen_fd, F_GETFL, 0);
+	if (flags == -1 || fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		perror("fcntl");
+		return -1;
+	}
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		perror("epoll_create1");
+		return -1;
+	}
+
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = &listener_tag;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) {
+		perror("epoll_ctl");
+		close(epfd);
+		return -1;
+	}
+
+	if (!(wheel = malloc(sizeof(*wheel)))) {
+		perror("malloc");
+		close(epfd);
+		return -1;
+	}
+	timer_wheel_init(wheel, stats_now_usec() / TICK_USEC);
+	if ((tfd = open_ticker(epfd)) == -1) {
+		free(wheel);
+		close(epfd);
+		return -1;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = &wake_tag;
+	if ((w->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+			epoll_ctl(epfd, EPOLL_CTL_ADD, w->wake_fd, &ev) == -1) {
+		perror("eventfd");
+		close(tfd);
+		free(wheel);
+		close(epfd);
+		return -1;
+	}
+
+	while (1) {
+		n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait");
+			close(w->wake_fd);
+			close(tfd);
+			free(wheel);
+			close(epfd);
+			return -1;
+		}
+
+		start = stats_now_usec();
+		tick = 0;
+		woken = 0;
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == &listener_tag) {
+				accept_connections(w, epfd, wheel);
+				continue;
+			}
+			if (events[i].data.ptr == &timer_tag) {
+				tick = 1;
+				continue;
+			}
+
+			if (events[i].data.ptr == &wake_tag) {
+				woken = 1;
+				continue;
+			}
+
+			// both directions are registered, so a single event may unblock
+			// either reading or writing; the state machine knows which it needs
+			struct conn *c = events[i].data.ptr;
+			if (c->park_pprev) {
+				worker_unpark(c);  // it checks its fetch on the way anyway
+			}
+			process(w, wheel, c);
+		}
+
+		// like expiry below, this may close connections
+		if (woken) {
+			wake_parked(w, wheel);
+		}
+
+		// expiring frees connections, so it waits until no event of this
+		// batch can still point at one; how many ticks were missed doesn't
+		// matter, the wheel catches up to the clock
+		if (tick) {
+			while (read(tfd, &expirations, sizeof(expirations)) > 0) {
+				;
+			}
+			timer_wheel_advance(wheel, stats_now_usec() / TICK_USEC, expire_connection, w);
+		}
+
+		// a socket that became ready during the batch waited up to this long
+		// for the loop to come back; the ticker keeps the average decaying
+		// once the load is gone
+		took = stats_now_usec() - start;
+		w->lag = w->lag - (w->lag >> LAG_SHIFT) + (took >> LAG_SHIFT);
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	if ((w->uring ? run_uring_loop(w) : run_event_loop(w)) == -1) {
+		fprintf(stderr, "server: worker %d stopped\n", w->id);
+	}
+	return NULL;
+}
+
+int start_worker(struct worker *w)
+{
+	int rv;
+
+	if ((rv = pthread_create(&w->thread, NULL, worker_main, w)) != 0) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(rv));
+		return -1;
+	}
+	if (w->cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu, &set);
+		if ((rv = pthread_setaffinity_np(w->thread, sizeof(set), &set)) != 0) {
+			fprintf(stderr, "worker %d: can't pin to cpu %d: %s\n", w->id, w->cpu, strerror(rv));
+		}
+	}
+	return 0;
+}
+
+void print_worker_stats(struct worker *w, FILE *fp)
+{
+	unsigned long long accepted = COUNTER_GET(w->stats.accepted);
+	unsigned long long closed = COUNTER_GET(w->stats.closed);
+
+	fprintf(fp, "worker %d: %llu accepted, %llu open, %llu requests, %llu bytes sent\n",
+			w->id, accepted, accepted - closed, COUNTER_GET(w->stats.requests),
+			COUNTER_GET(w->stats.bytes_sent));
+	fprintf(fp, "worker %d: shed %llu at the connection cap, %llu over the byte budget, "
+			"%llu over depth, %llu lagging, %llu rate limited\n", w->id,
+			COUNTER_GET(w->stats.shed[SHED_CONNS]), COUNTER_GET(w->stats.shed[SHED_BYTES]),
+			COUNTER_GET(w->stats.shed[SHED_DEPTH]), COUNTER_GET(w->stats.shed[SHED_LATENCY]),
+			COUNTER_GET(w->stats.shed[SHED_RATE]));
+	fprintf(fp, "worker %d: timed out %llu reading headers, %llu idle, %llu sending\n", w->id,
+			COUNTER_GET(w->stats.timed_out[CONN_TIMEOUT_HEADER]),
+			COUNTER_GET(w->stats.timed_out[CONN_TIMEOUT_IDLE]),
+			COUNTER_GET(w->stats.timed_out[CONN_TIMEOUT_SEND]));
+	if (w->cache) {
+		cache_print_stats(w->cache, fp);
+	}
+}
+
+void register_workers(struct worker *workers, int n)
+{
+	all_workers = workers;
+	num_workers = n;
+}
+
+struct worker *registered_workers(int *n)
+{
+	*n = num_workers;
+	return all_workers;
+}
@@ -0,0 +1,88 @@
+/*
+** event_loop.h -- edge-triggered epoll workers, one per SO_REUSEPORT listener
+*/
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "admission.h"
+#include "conn.h"
+#include "stats.h"
+#include "timer_wheel.h"
+
+/*
+ * A worker owns one listening socket, one epoll set and one file cache, and
+ * shares nothing with the other workers: the kernel spreads incoming
+ * connections across the SO_REUSEPORT listeners.
+ */
+struct worker {
+	int id;
+	int cpu;                // CPU to pin the thread to, -1 to leave it floating
+	int listen_fd;
+	int uring;              // driven by run_uring_loop() rather than epoll
+	int wake_fd;            // eventfd other threads write to when a waited-on fetch moves
+	pthread_t thread;
+	struct cache *cache;    // NULL when caching is disabled
+	struct conn_timeouts timeouts;
+	struct admission_limits limits;  // this worker's share of the server's
+	struct rate_limiter *limiter;    // shared by all workers, NULL if unlimited
+	struct worker_stats stats;
+
+	// load, only tracked by event loop workers (fork children share one
+	// worker and leave these at 0)
+	unsigned int busy;               // responses in progress
+	unsigned long long outstanding;  // response bytes not yet sent
+	unsigned long long lag;          // smoothed time one epoll batch takes, microseconds
+
+	struct conn *parked;             // connections waiting on upstream fetches
+};
+
+/*
+ * serve connections accepted on w->listen_fd in the calling thread
+ * output - only returns on failure, with -1
+ */
+int run_event_loop(struct worker *w);
+
+/*
+ * keep the connection's wheel timer in step with its deadline
+ */
+void worker_schedule(struct timer_wheel *wheel, struct conn *c);
+
+/*
+ * a connection whose socket is ready but whose upstream fetch is behind
+ * gets no readiness event when the fetch moves on; it waits on w->parked
+ * for wake_fd instead (a no-op if it already does)
+ */
+void worker_park(struct worker *w, struct conn *c);
+
+/*
+ * take the connection off its worker's parked list, if it is on it
+ */
+void worker_unpark(struct conn *c);
+
+/*
+ * run w's loop (run_event_loop(), or run_uring_loop() if w->uring is set) on
+ * a new thread, pinned to w->cpu if it is set
+ * output - 0 on success, -1 if the thread couldn't be created
+ */
+int start_worker(struct worker *w);
+
+/*
+ * write the worker's connection and cache counters to fp; safe to call
+ * while the worker is running
+ */
+void print_worker_stats(struct worker *w, FILE *fp);
+
+/*
+ * make workers[0..n) the set reported by the /__stats page
+ */
+void register_workers(struct worker *workers, int n);
+
+/*
+ * output - the workers passed to register_workers(), their number in *n
+ */
+struct worker *registered_workers(int *n);
+
+#endif
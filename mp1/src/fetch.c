@@ -0,0 +1,498 @@
+/*
+** fetch.c -- HTTP/1.1 client side: URLs, connections and streaming responses
+*/
+
+#define _GNU_SOURCE  // memmem(), splice()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+
+#include "fetch.h"
+
+#define DELIMITER "\r\n\r\n"
+
+FILE *fetch_log;
+
+// get sockaddr, IPv4 or IPv6:
+static void *get_in_addr(struct sockaddr *sa)
+{
+	if (sa->sa_family == AF_INET) {
+		return &(((struct sockaddr_in*)sa)->sin_addr);
+	}
+
+	return &(((struct sockaddr_in6*)sa)->sin6_addr);
+}
+
+// split http://hostname[:port]/path into its parts, returns -1 if malformed
+int parse_url(const char *str, struct url *u)
+{
+	// try to match domain, port, and path
+	int match_cnt = sscanf(str, "%*[^:]%*[:/]%99[^:/]:%9[0-9]%999s", u->domain, u->port, u->path);
+	if (match_cnt != 3) {
+		// try to match domain and path. Assume the port is 80
+		match_cnt = sscanf(str, "%*[^:]%*[:/]%99[^/]%999s", u->domain, u->path);
+		if (match_cnt != 2) {
+			return -1;
+		}
+		strcpy(u->port, "80"); // use default port 80
+	}
+	return 0;
+}
+
+// getaddrinfo() results by host:port; a batch naming one host a thousand
+// times resolves it once. Entries live until the program exits.
+struct resolved {
+	char domain[MAX_DOMAIN_SIZE];
+	char port[10];
+	struct addrinfo *info;
+	struct resolved *next;
+};
+
+static struct resolved *resolved;
+static pthread_mutex_t resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// look up domain:port, NULL on failure
+static struct addrinfo *resolve(const char *domain, const char *port)
+{
+	struct addrinfo hints, *info = NULL;
+	struct resolved *e;
+	int rv;
+
+	// held across getaddrinfo() so concurrent connections to a new host
+	// wait for the one lookup instead of all doing it
+	pthread_mutex_lock(&resolve_lock);
+	for (e = resolved; e; e = e->next) {
+		if (strcmp(e->domain, domain) == 0 && strcmp(e->port, port) == 0) {
+			info = e->info;
+			goto out;
+		}
+	}
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if ((rv = getaddrinfo(domain, port, &hints, &info)) != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+		goto out;
+	}
+	if (!(e = malloc(sizeof(*e)))) {
+		freeaddrinfo(info);
+		info = NULL;
+		goto out;
+	}
+	snprintf(e->domain, sizeof e->domain, "%s", domain);
+	snprintf(e->port, sizeof e->port, "%s", port);
+	e->info = info;
+	e->next = resolved;
+	resolved = e;
+
+out:
+	pthread_mutex_unlock(&resolve_lock);
+	return info;
+}
+
+// connect to the first address of domain:port that accepts us, -1 on failure
+int connect_to(const char *domain, const char *port)
+{
+	int sockfd = -1;
+	struct addrinfo *servinfo, *p;
+	char s[INET6_ADDRSTRLEN];
+
+	if (!(servinfo = resolve(domain, port))) {
+		return -1;
+	}
+
+	// loop through all the results and connect to the first we can
+	for(p = servinfo; p != NULL; p = p->ai_next) {
+		if ((sockfd = socket(p->ai_family, p->ai_socktype,
+				p->ai_protocol)) == -1) {
+			perror("client: socket");
+			continue;
+		}
+
+		if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
+			close(sockfd);
+			perror("client: connect");
+			continue;
+		}
+
+		break;
+	}
+
+	if (p == NULL) {
+		fprintf(stderr, "client: failed to connect\n");
+		return -1;
+	}
+
+	inet_ntop(p->ai_family, get_in_addr((struct sockaddr *)p->ai_addr),
+			s, sizeof s);
+	if (fetch_log) {
+		fprintf(fetch_log, "client: connecting to %s\n", s);
+	}
+
+	return sockfd;
+}
+
+void reader_init(struct reader *r, int fd)
+{
+	r->fd = fd;
+	r->start = 0;
+	r->len = 0;
+	r->pipe[0] = r->pipe[1] = -1;
+	r->no_splice = 0;
+	r->progress = NULL;
+	r->progress_arg = NULL;
+}
+
+void reader_release(struct reader *r)
+{
+	if (r->pipe[0] != -1) {
+		close(r->pipe[0]);
+		close(r->pipe[1]);
+		r->pipe[0] = r->pipe[1] = -1;
+	}
+}
+
+// pull more bytes into the reader, returns what recv() returned
+static ssize_t fill(struct reader *r)
+{
+	if (r->start > 0) {
+		memmove(r->buf, r->buf + r->start, r->len);
+		r->start = 0;
+	}
+	ssize_t n;
+	do {
+		n = recv(r->fd, r->buf + r->len, sizeof(r->buf) - r->len, 0);
+	} while (n == -1 && errno == EINTR);
+	if (n > 0) {
+		r->len += n;
+	}
+	return n;
+}
+
+// find header `name` in the header block [hdr, hdr+len) and copy its value
+static int header_value(const char *hdr, size_t len, const char *name, char *out, size_t outlen)
+{
+	size_t name_len = strlen(name);
+	const char *end = hdr + len;
+	const char *line = memchr(hdr, '\n', len);  // skip the status line
+
+	while (line && ++line < end) {
+		const char *eol = memchr(line, '\n', end - line);
+		if (!eol) {
+			break;
+		}
+		if (eol - line > name_len && line[name_len] == ':' &&
+				strncasecmp(line, name, name_len) == 0) {
+			const char *v = line + name_len + 1;
+			while (v < eol && (*v == ' ' || *v == '\t')) {
+				v++;
+			}
+			size_t vlen = eol - v;
+			if (vlen > 0 && v[vlen - 1] == '\r') {
+				vlen--;
+			}
+			if (vlen >= outlen) {
+				vlen = outlen - 1;
+			}
+			memcpy(out, v, vlen);
+			out[vlen] = '\0';
+			return 1;
+		}
+		line = eol;
+	}
+	return 0;
+}
+
+
+int read_header(struct reader *r, struct response *resp, int head)
+{
+	char *header_tail;
+	char value[128];
+	size_t scanned = 0;  // bytes after r->start already known not to end the header
+
+	// this points to the "\r\n\r\n..."; each pass only looks at what is new,
+	// plus enough of the old to catch a delimiter split across reads
+	while (!(header_tail = memmem(r->buf + r->start + scanned, r->len - scanned,
+					DELIMITER, strlen(DELIMITER)))) {
+		scanned = r->len >= strlen(DELIMITER) ? r->len - (strlen(DELIMITER) - 1) : 0;
+		if (r->len == sizeof(r->buf) || fill(r) <= 0) {
+			// a server closing an idle connection isn't worth a word, the
+			// request is simply sent again
+			if (r->len > 0) {
+				fprintf(stderr, "client: malformed or truncated response header\n");
+			}
+			return -1;
+		}
+	}
+
+	char *hdr = r->buf + r->start;
+	size_t header_len = header_tail + strlen(DELIMITER) - hdr;  // including the delimiter
+
+	if (sscanf(hdr, "HTTP/%*d.%*d %d", &resp->status) != 1) {
+		fprintf(stderr, "client: malformed status line\n");
+		return -1;
+	}
+
+	resp->content_length = -1;
+	if (header_value(hdr, header_len, "Content-Length", value, sizeof value)) {
+		resp->content_length = atoll(value);
+	}
+	// chunked wins over Content-Length (RFC 7230 3.3.3); the last coding
+	// listed is the one that frames the message
+	resp->chunked = 0;
+	if (header_value(hdr, header_len, "Transfer-Encoding", value, sizeof value)) {
+		size_t vlen = strlen(value);
+		resp->chunked = vlen >= 7 && strcasecmp(value + vlen - 7, "chunked") == 0;
+	}
+	resp->body_length = resp->chunked ? -1 : resp->content_length;
+	// these never carry a body, whatever the header says
+	if (head || resp->status == 204 || resp->status == 304 || resp->status / 100 == 1) {
+		resp->body_length = 0;
+		resp->chunked = 0;
+	}
+
+	resp->reusable = 1;
+	if (header_value(hdr, header_len, "Connection", value, sizeof value) &&
+			strcasecmp(value, "close") == 0) {
+		resp->reusable = 0;
+	}
+	if ((resp->body_length == -1 && !resp->chunked) || strncmp(hdr, "HTTP/1.0", 8) == 0) {
+		resp->reusable = 0;
+	}
+
+	resp->accept_ranges = header_value(hdr, header_len, "Accept-Ranges", value, sizeof value) &&
+		strcasecmp(value, "bytes") == 0;
+	resp->range_first = resp->range_total = -1;
+	if (header_value(hdr, header_len, "Content-Range", value, sizeof value) &&
+			sscanf(value, "bytes %lld-%*d/%lld", &resp->range_first, &resp->range_total) < 1) {
+		resp->range_first = -1;
+	}
+
+	if (!header_value(hdr, header_len, "ETag", resp->etag, sizeof resp->etag)) {
+		resp->etag[0] = '\0';
+	}
+	if (!header_value(hdr, header_len, "Last-Modified", resp->last_modified,
+				sizeof resp->last_modified)) {
+		resp->last_modified[0] = '\0';
+	}
+	// a weak ETag can't be used in If-Range, Last-Modified then stands in
+	snprintf(resp->validator, sizeof resp->validator, "%s",
+			resp->etag[0] && strncmp(resp->etag, "W/", 2) != 0 ? resp->etag : resp->last_modified);
+
+	char *eol = memchr(hdr, '\r', header_len);
+	snprintf(resp->status_line, sizeof resp->status_line, "%.*s", (int)(eol - hdr), hdr);
+	r->start += header_len;
+	r->len -= header_len;
+	return 0;
+}
+
+// write all of buf to out_fd, at *offset if it isn't NULL; -1 on error
+static int write_out(int out_fd, const char *buf, size_t len, off_t *offset)
+{
+	while (len > 0) {
+		ssize_t n = offset ? pwrite(out_fd, buf, len, *offset) : write(out_fd, buf, len);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			perror("client: write");
+			return -1;
+		}
+		buf += n;
+		len -= n;
+		if (offset) {
+			*offset += n;
+		}
+	}
+	return 0;
+}
+
+// move the n bytes sitting in the pipe on to out_fd; if out_fd can't be
+// spliced to (a terminal, an O_APPEND file) they are read back and written
+static int drain_pipe(struct reader *r, size_t n, int out_fd, off_t *offset)
+{
+	while (n > 0) {
+		ssize_t m = r->no_splice ? -1 :
+			splice(r->pipe[0], NULL, out_fd, (loff_t *)offset, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (m > 0) {
+			n -= m;
+			continue;
+		}
+		if (m == -1 && errno == EINTR) {
+			continue;
+		}
+		if (m == -1 && (r->no_splice || errno == EINVAL)) {
+			r->no_splice = 1;
+			size_t want = n < sizeof(r->buf) ? n : sizeof(r->buf);
+			ssize_t got = read(r->pipe[0], r->buf, want);
+			if (got <= 0 || write_out(out_fd, r->buf, got, offset) == -1) {
+				return -1;
+			}
+			n -= got;
+			continue;
+		}
+		perror("client: splice");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * move len body bytes, or everything up to EOF if len is -1, from the
+ * connection to out_fd
+ * output - 0 when done, -1 if the connection broke first or out_fd failed
+ */
+static int transfer(struct reader *r, long long len, int out_fd, off_t *offset)
+{
+	// whatever came in with the header goes out of the buffer first
+	size_t take = r->len;
+	if (len >= 0 && take > len) {
+		take = len;
+	}
+	if (take > 0 && out_fd != -1) {
+		if (write_out(out_fd, r->buf + r->start, take, offset) == -1) {
+			return -1;
+		}
+		if (r->progress) {
+			r->progress(r->progress_arg, take);
+		}
+	}
+	r->start += take;
+	r->len -= take;
+	if (len >= 0) {
+		len -= take;
+	}
+
+	if (out_fd != -1 && !r->no_splice && r->pipe[0] == -1) {
+		if (pipe2(r->pipe, O_CLOEXEC) == -1) {
+			r->no_splice = 1;
+		} else {
+			// best effort: a bigger pipe means fewer trips per megabyte
+			fcntl(r->pipe[1], F_SETPIPE_SZ, SPLICE_CHUNK);
+		}
+	}
+
+	// the rest never enters user space: socket -> pipe -> file
+	while (len != 0) {
+		size_t want = len > 0 && len < SPLICE_CHUNK ? len : SPLICE_CHUNK;
+		ssize_t n;
+
+		if (out_fd != -1 && !r->no_splice) {
+			n = splice(r->fd, NULL, r->pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (n == -1 && errno == EINVAL) {
+				r->no_splice = 1;  // not a socket the kernel splices from
+				continue;
+			}
+			if (n > 0 && drain_pipe(r, n, out_fd, offset) == -1) {
+				return -1;
+			}
+		} else {
+			n = recv(r->fd, r->buf, want < sizeof(r->buf) ? want : sizeof(r->buf), 0);
+			if (n > 0 && out_fd != -1 && write_out(out_fd, r->buf, n, offset) == -1) {
+				return -1;
+			}
+		}
+
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			// only a close-delimited body may legitimately end here
+			return n == 0 && len == -1 ? 0 : -1;
+		}
+		if (out_fd != -1 && r->progress) {
+			r->progress(r->progress_arg, n);
+		}
+		if (len > 0) {
+			len -= n;
+		}
+	}
+	return 0;
+}
+
+// copy the next CRLF terminated line into line and consume it; -1 if the
+// connection ends first or the line doesn't fit
+static int read_line(struct reader *r, char *line, size_t size)
+{
+	char *eol;
+	size_t scanned = 0;
+
+	while (!(eol = memchr(r->buf + r->start + scanned, '\n', r->len - scanned))) {
+		scanned = r->len;
+		if (r->len == sizeof(r->buf) || fill(r) <= 0) {
+			return -1;
+		}
+	}
+	size_t n = eol - (r->buf + r->start);
+	if (n > 0 && eol[-1] == '\r') {
+		n--;
+	}
+	if (n >= size) {
+		return -1;
+	}
+	memcpy(line, r->buf + r->start, n);
+	line[n] = '\0';
+	r->len -= eol + 1 - (r->buf + r->start);
+	r->start = eol + 1 - r->buf;
+	return 0;
+}
+
+// chunk-size [; extensions] CRLF data CRLF ... 0 CRLF [trailers] CRLF
+static int read_chunked(struct reader *r, int out_fd, off_t *offset)
+{
+	char line[1024];
+
+	while (1) {
+		char *end;
+		if (read_line(r, line, sizeof line) == -1) {
+			return -1;
+		}
+		long long size = strtoll(line, &end, 16);
+		if (end == line || size < 0 || (*end != '\0' && *end != ';' && *end != ' ')) {
+			fprintf(stderr, "client: bad chunk size \"%s\"\n", line);
+			return -1;
+		}
+		if (size == 0) {
+			break;
+		}
+		if (transfer(r, size, out_fd, offset) == -1 ||
+				read_line(r, line, sizeof line) == -1 || line[0] != '\0') {
+			return -1;
+		}
+	}
+
+	// trailer fields are of no use to us, skip to the blank line
+	do {
+		if (read_line(r, line, sizeof line) == -1) {
+			return -1;
+		}
+	} while (line[0] != '\0');
+	return 0;
+}
+
+int read_body(struct reader *r, const struct response *resp, int out_fd, off_t *offset)
+{
+	int rv = resp->chunked ? read_chunked(r, out_fd, offset) :
+		transfer(r, resp->body_length, out_fd, offset);
+	if (rv == -1) {
+		// bytes of a broken body may still sit in the pipe, don't let them
+		// leak into the next one
+		reader_release(r);
+		return -1;
+	}
+	return resp->body_length == -1 && !resp->chunked ? 0 : resp->reusable;
+}
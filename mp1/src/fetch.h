@@ -0,0 +1,108 @@
+/*
+** fetch.h -- HTTP/1.1 client side: URLs, connections and streaming responses
+*/
+#ifndef FETCH_H
+#define FETCH_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#define MAX_DOMAIN_SIZE 100
+#define MAX_PATH_SIZE 1000
+#define MAX_SENDLINE 1280
+
+#define READER_BUF_SIZE 16384  // also the largest response header we accept
+#define SPLICE_CHUNK (1 << 20) // bytes asked of one splice() call
+
+struct url {
+	char domain[MAX_DOMAIN_SIZE];
+	char port[10];
+	char path[MAX_PATH_SIZE];
+};
+
+/*
+ * Buffered reader over a connection. Headers and chunk sizes are parsed out
+ * of buf; body bytes only pass through it if they arrived together with a
+ * header, the rest go from the socket to their destination through pipe.
+ * Bytes past the current response are kept for the next pipelined one.
+ */
+struct reader {
+	int fd;
+	char buf[READER_BUF_SIZE];
+	size_t start;  // first unconsumed byte in buf
+	size_t len;    // number of unconsumed bytes
+	int pipe[2];   // made on first use, {-1, -1} until then
+	int no_splice; // the kernel refused splice() once, copy from then on
+
+	// called with the byte count each time body bytes reach out_fd, so
+	// someone else can follow the file as it fills; NULL by default
+	void (*progress)(void *arg, size_t n);
+	void *progress_arg;
+};
+
+// what we need to know from a response header
+struct response {
+	char status_line[128];
+	int status;
+	long long content_length;  // as advertised, -1 if the header has none
+	long long body_length;     // bytes of body that follow, -1 if it runs until close
+	int chunked;               // Transfer-Encoding: chunked, body_length is then -1
+	int reusable;              // the connection can carry another response
+	int accept_ranges;         // the server advertised byte ranges
+	long long range_first;     // Content-Range of a 206, -1 if absent
+	long long range_total;
+	char validator[128];       // ETag, or else Last-Modified, for If-Range
+	char etag[128];            // empty if absent
+	char last_modified[64];    // empty if absent
+};
+
+/*
+ * where connection and status messages go; NULL keeps quiet
+ */
+extern FILE *fetch_log;
+
+/*
+ * split http://hostname[:port]/path into its parts
+ * output - 0 on success, -1 if malformed
+ */
+int parse_url(const char *str, struct url *u);
+
+/*
+ * connect to the first address of domain:port that accepts us; name lookups
+ * are cached for the life of the process
+ * output - the socket, or -1 on failure
+ */
+int connect_to(const char *domain, const char *port);
+
+/*
+ * start reading responses off the socket fd
+ */
+void reader_init(struct reader *r, int fd);
+
+/*
+ * free the reader's pipe; the socket is left to the caller
+ */
+void reader_release(struct reader *r);
+
+/*
+ * read a response header off the connection and consume it; the header may
+ * arrive in any number of pieces
+ * input head - the request was a HEAD, so the response has no body whatever
+ *              its Content-Length says
+ * output - 0 on success, -1 if the header is malformed or cut short
+ */
+int read_header(struct reader *r, struct response *resp, int head);
+
+/*
+ * move the body of the response whose header was just read to out_fd,
+ * decoding chunked transfer encoding
+ * input out_fd - destination, -1 to drop the body
+ *       offset - write at *offset and advance it (a file being filled in
+ *                place), or NULL to write at out_fd's own position
+ * output - 1 if the connection can carry another response, 0 if the server
+ *          closes it after this one, -1 if the body was cut short or can't be
+ *          written
+ */
+int read_body(struct reader *r, const struct response *resp, int out_fd, off_t *offset);
+
+#endif
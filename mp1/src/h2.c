@@ -0,0 +1,1086 @@
+/*
+** h2.c -- HTTP/2 over cleartext TCP (h2c): framing, streams and flow control
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "conn.h"
+#include "event_loop.h"
+#include "h2.h"
+#include "hpack.h"
+#include "stats.h"
+
+#define FRAME_HEADER 9
+#define PREFACE_LEN (sizeof(H2_PREFACE) - 1)
+#define MAX_WINDOW 0x7fffffffLL
+#define MAX_FRAME_SIZE_LIMIT 16777215  // largest SETTINGS_MAX_FRAME_SIZE allowed
+
+enum frame_type {
+	FRAME_DATA,
+	FRAME_HEADERS,
+	FRAME_PRIORITY,
+	FRAME_RST_STREAM,
+	FRAME_SETTINGS,
+	FRAME_PUSH_PROMISE,
+	FRAME_PING,
+	FRAME_GOAWAY,
+	FRAME_WINDOW_UPDATE,
+	FRAME_CONTINUATION,
+};
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+enum h2_error {
+	H2_NO_ERROR = 0x0,
+	H2_PROTOCOL_ERROR = 0x1,
+	H2_INTERNAL_ERROR = 0x2,
+	H2_FLOW_CONTROL_ERROR = 0x3,
+	H2_STREAM_CLOSED = 0x5,
+	H2_FRAME_SIZE_ERROR = 0x6,
+	H2_REFUSED_STREAM = 0x7,
+	H2_COMPRESSION_ERROR = 0x9,
+	H2_ENHANCE_YOUR_CALM = 0xb,
+};
+
+enum settings_id {
+	SETTINGS_HEADER_TABLE_SIZE = 0x1,
+	SETTINGS_ENABLE_PUSH = 0x2,
+	SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+	SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+	SETTINGS_MAX_FRAME_SIZE = 0x5,
+};
+
+// headers that only mean something to one HTTP/1 hop; a request carrying
+// one is malformed, a response of ours drops them
+static const char *hop_headers[] = {
+	"connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade",
+};
+
+// response headers whose values change from one response to the next and
+// would only churn the dynamic table
+static const char *unindexed_headers[] = {
+	"content-length", "content-range", "etag", "last-modified",
+};
+
+/*
+ * A stream is one request and its response. The request is rendered as
+ * HTTP/1.1 into the stream's own struct conn and answered by the same code
+ * as any HTTP/1 request; the response header that code forms is translated
+ * into a HEADERS frame and its body read out in DATA frames.
+ */
+struct stream {
+	unsigned int id;
+	int header_sent;
+	int client_open;      // the client hasn't sent END_STREAM yet
+	long long window;     // bytes the client lets us send on this stream
+	off_t body_sent;
+	struct stream *next;
+	struct conn conn;
+};
+
+// the request of the header block being decoded
+struct request_builder {
+	char pseudo[REQUEST_BUF_SIZE];  // :method, :path and :authority values
+	size_t pseudo_len;
+	struct http_str method;
+	struct http_str path;
+	struct http_str authority;
+	int scheme;
+	char fields[REQUEST_BUF_SIZE];  // the regular fields as HTTP/1 header lines
+	size_t fields_len;
+	int regular;     // a regular field was seen, pseudo-fields must come first
+	int has_host;
+	int malformed;
+	int too_large;
+};
+
+struct h2 {
+	struct conn *c;
+
+	unsigned char in[FRAME_HEADER + H2_FRAME_SIZE];  // at most one frame
+	size_t in_start;     // first byte not yet consumed
+	size_t in_len;
+	size_t preface_seen; // bytes of the client preface matched so far
+
+	unsigned char *out;  // H2_OUT_SIZE plus room for one more frame
+	size_t out_len;
+	size_t out_sent;
+
+	struct hpack_decoder dec;
+	struct hpack_encoder enc;
+
+	long long window;          // bytes the client lets us send on the connection
+	long long initial_window;  // starting window of new streams, from its SETTINGS
+
+	struct stream *streams;    // open streams, served round robin
+	int nstreams;
+	unsigned int last_stream;  // highest stream id the client used
+
+	// streams dropped while the client's side was still open, which it may
+	// yet send trailers on; 0 is a free slot, and the oldest are forgotten
+	// once it fills up
+	unsigned int half_open[H2_MAX_STREAMS];
+	int half_open_next;
+
+	// a header block spread over HEADERS and CONTINUATION frames
+	unsigned char *block;
+	size_t block_len;
+	unsigned int block_stream;  // 0 when no block is open
+	int block_end_stream;       // its HEADERS frame had END_STREAM
+
+	struct request_builder req;
+
+	int closing;     // we sent GOAWAY: flush it and close
+	int peer_away;   // the client sent GOAWAY: close once the streams are done
+};
+
+static uint32_t get32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static size_t room(const struct h2 *h)
+{
+	return h->out_len < H2_OUT_SIZE ? H2_OUT_SIZE - h->out_len : 0;
+}
+
+// queue a frame header; the payload goes (or already is) right after it.
+// The output always has room for one frame past H2_OUT_SIZE, so control
+// frames can be queued whenever the input is read.
+static unsigned char *put_frame(struct h2 *h, int type, int flags, unsigned int id, size_t len)
+{
+	unsigned char *p = h->out + h->out_len;
+
+	p[0] = len >> 16;
+	p[1] = len >> 8;
+	p[2] = len;
+	p[3] = type;
+	p[4] = flags;
+	put32(p + 5, id);
+	h->out_len += FRAME_HEADER + len;
+	return p + FRAME_HEADER;
+}
+
+static void reset_stream(struct h2 *h, unsigned int id, enum h2_error error)
+{
+	put32(put_frame(h, FRAME_RST_STREAM, 0, id, 4), error);
+}
+
+// a connection error: tell the client what went wrong and stop reading
+static void go_away(struct h2 *h, enum h2_error error)
+{
+	unsigned char *p = put_frame(h, FRAME_GOAWAY, 0, 0, 8);
+
+	put32(p, h->last_stream);
+	put32(p + 4, error);
+	h->closing = 1;
+}
+
+static void window_update(struct h2 *h, unsigned int id, uint32_t increment)
+{
+	put32(put_frame(h, FRAME_WINDOW_UPDATE, 0, id, 4), increment);
+}
+
+static struct stream *find_stream(struct h2 *h, unsigned int id)
+{
+	struct stream *s;
+	for (s = h->streams; s && s->id != id; s = s->next) {
+		;
+	}
+	return s;
+}
+
+// the half_open slot of a dropped stream, or NULL if it isn't there
+static unsigned int *find_half_open(struct h2 *h, unsigned int id)
+{
+	int i;
+	for (i = 0; i < H2_MAX_STREAMS; i++) {
+		if (h->half_open[i] == id) {
+			return &h->half_open[i];
+		}
+	}
+	return NULL;
+}
+
+static void add_half_open(struct h2 *h, unsigned int id)
+{
+	h->half_open[h->half_open_next] = id;
+	h->half_open_next = (h->half_open_next + 1) % H2_MAX_STREAMS;
+}
+
+// drop a stream; completed says whether its response went out in full
+static void end_stream(struct h2 *h, struct stream *s, int completed)
+{
+	struct stream **pp;
+
+	for (pp = &h->streams; *pp != s; pp = &(*pp)->next) {
+		;
+	}
+	*pp = s->next;
+	h->nstreams--;
+	if (s->client_open) {
+		add_half_open(h, s->id);
+	}
+	conn_stream_end(&s->conn, completed);
+	free(s);
+}
+
+static int is_hop_header(const char *name, size_t len)
+{
+	size_t i;
+	for (i = 0; i < sizeof(hop_headers) / sizeof(hop_headers[0]); i++) {
+		if (strlen(hop_headers[i]) == len && memcmp(hop_headers[i], name, len) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int is_unindexed_header(const char *name, size_t len)
+{
+	size_t i;
+	for (i = 0; i < sizeof(unindexed_headers) / sizeof(unindexed_headers[0]); i++) {
+		if (strlen(unindexed_headers[i]) == len && memcmp(unindexed_headers[i], name, len) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int field_is(const char *name, size_t len, const char *lit)
+{
+	return strlen(lit) == len && memcmp(name, lit, len) == 0;
+}
+
+// keep a pseudo-field's value in the builder; -1 if it was already set or doesn't fit
+static int keep_pseudo(struct request_builder *b, struct http_str *out, const char *value, size_t len)
+{
+	if (out->p || len > sizeof(b->pseudo) - b->pseudo_len) {
+		return -1;
+	}
+	memcpy(b->pseudo + b->pseudo_len, value, len);
+	out->p = b->pseudo + b->pseudo_len;
+	out->len = len;
+	b->pseudo_len += len;
+	return 0;
+}
+
+// hpack_emit callback building the HTTP/1 rendering of a request. Only
+// fields that render unchanged are let through: a CR, LF or NUL in a value
+// could otherwise smuggle header lines past the HTTP/1 parser.
+static void add_field(void *arg, const char *name, size_t name_len, const char *value, size_t value_len)
+{
+	struct request_builder *b = &((struct h2 *)arg)->req;
+	size_t i;
+
+	if (name_len == 0 || memchr(value, '\r', value_len) || memchr(value, '\n', value_len) ||
+			memchr(value, '\0', value_len)) {
+		b->malformed = 1;
+		return;
+	}
+	for (i = name[0] == ':'; i < name_len; i++) {
+		if ((name[i] >= 'A' && name[i] <= 'Z') || name[i] <= ' ' || name[i] == ':' ||
+				name[i] >= 0x7f) {
+			b->malformed = 1;  // HTTP/2 field names are lowercase tokens
+			return;
+		}
+	}
+
+	if (name[0] == ':') {
+		int rv = 0;
+		if (b->regular) {
+			rv = -1;
+		} else if (field_is(name, name_len, ":method")) {
+			rv = keep_pseudo(b, &b->method, value, value_len);
+		} else if (field_is(name, name_len, ":path")) {
+			rv = keep_pseudo(b, &b->path, value, value_len);
+		} else if (field_is(name, name_len, ":authority")) {
+			rv = keep_pseudo(b, &b->authority, value, value_len);
+		} else if (field_is(name, name_len, ":scheme")) {
+			rv = b->scheme ? -1 : 0;
+			b->scheme = 1;
+		} else {
+			rv = -1;
+		}
+		if (rv == -1) {
+			b->malformed = 1;
+		}
+		return;
+	}
+
+	b->regular = 1;
+	if (is_hop_header(name, name_len) ||
+			(field_is(name, name_len, "te") && !field_is(value, value_len, "trailers"))) {
+		b->malformed = 1;
+		return;
+	}
+	if (field_is(name, name_len, "host")) {
+		b->has_host = 1;
+	}
+	if (name_len + value_len + 4 > sizeof(b->fields) - b->fields_len) {
+		b->too_large = 1;
+		return;
+	}
+	memcpy(b->fields + b->fields_len, name, name_len);
+	b->fields_len += name_len;
+	memcpy(b->fields + b->fields_len, ": ", 2);
+	b->fields_len += 2;
+	memcpy(b->fields + b->fields_len, value, value_len);
+	b->fields_len += value_len;
+	memcpy(b->fields + b->fields_len, "\r\n", 2);
+	b->fields_len += 2;
+}
+
+// hpack_emit callback for blocks we only decode to keep the table in step
+static void ignore_field(void *arg, const char *name, size_t name_len, const char *value, size_t value_len)
+{
+	(void)arg;
+	(void)name;
+	(void)name_len;
+	(void)value;
+	(void)value_len;
+}
+
+// append to the request being rendered; -1 once it doesn't fit
+static int append(struct conn *s, const char *p, size_t len)
+{
+	if (len > sizeof(s->request) - s->request_len) {
+		return -1;
+	}
+	memcpy(s->request + s->request_len, p, len);
+	s->request_len += len;
+	return 0;
+}
+
+// write the built request into s as HTTP/1.1; one that doesn't fit is left
+// without its blank line, which the handler answers with 431
+static void render_request(struct request_builder *b, struct conn *s)
+{
+	s->request_len = 0;
+	if (append(s, b->method.p, b->method.len) == -1 || append(s, " ", 1) == -1 ||
+			append(s, b->path.p, b->path.len) == -1 || append(s, " HTTP/1.1\r\n", 11) == -1) {
+		return;
+	}
+	if (b->authority.p && !b->has_host && (append(s, "Host: ", 6) == -1 ||
+			append(s, b->authority.p, b->authority.len) == -1 || append(s, "\r\n", 2) == -1)) {
+		return;
+	}
+	if (b->too_large || append(s, b->fields, b->fields_len) == -1) {
+		return;
+	}
+	append(s, "\r\n", 2);
+}
+
+static struct stream *new_stream(struct h2 *h, unsigned int id, int client_open)
+{
+	struct stream *s = malloc(sizeof(*s));
+
+	if (!s) {
+		return NULL;
+	}
+	s->id = id;
+	s->header_sent = 0;
+	s->client_open = client_open;
+	s->window = h->initial_window;
+	s->body_sent = 0;
+	conn_init(&s->conn, -1, &h->c->peer, h->c->worker);
+	s->next = h->streams;
+	h->streams = s;
+	h->nstreams++;
+	STAT_INC(&h->c->worker->stats, h2_streams);
+	return s;
+}
+
+// a complete header block: decode it and, if it opens a stream, start
+// answering the request
+static void finish_block(struct h2 *h)
+{
+	struct request_builder *b = &h->req;
+	unsigned int id = h->block_stream, *slot;
+	int end = h->block_end_stream;
+	struct stream *s;
+
+	h->block_stream = 0;
+	if (id <= h->last_stream) {
+		// trailers if the client's side is still open, even when our
+		// response is done: we take no request bodies, so there is nothing
+		// to add them to. Either way the table has to follow the block.
+		if (hpack_decode(&h->dec, h->block, h->block_len, ignore_field, h) == -1) {
+			go_away(h, H2_COMPRESSION_ERROR);
+		} else if ((s = find_stream(h, id))) {
+			if (!s->client_open) {
+				// the client closed its side already (RFC 9113 5.1)
+				reset_stream(h, id, H2_STREAM_CLOSED);
+				end_stream(h, s, 0);
+			} else if (end) {
+				s->client_open = 0;
+			}
+		} else if ((slot = find_half_open(h, id))) {
+			if (end) {
+				*slot = 0;
+			}
+		} else {
+			go_away(h, H2_STREAM_CLOSED);  // closed on both sides
+		}
+		return;
+	}
+
+	h->last_stream = id;
+	b->pseudo_len = 0;
+	memset(&b->method, 0, sizeof(b->method));
+	memset(&b->path, 0, sizeof(b->path));
+	memset(&b->authority, 0, sizeof(b->authority));
+	b->scheme = 0;
+	b->fields_len = 0;
+	b->regular = b->has_host = b->malformed = b->too_large = 0;
+	if (hpack_decode(&h->dec, h->block, h->block_len, add_field, h) == -1) {
+		go_away(h, H2_COMPRESSION_ERROR);
+		return;
+	}
+
+	if (b->malformed || !b->method.p || !b->path.p || !b->scheme) {
+		reset_stream(h, id, H2_PROTOCOL_ERROR);
+		if (!end) {
+			add_half_open(h, id);
+		}
+		return;
+	}
+	if (h->nstreams >= H2_MAX_STREAMS || !(s = new_stream(h, id, !end))) {
+		reset_stream(h, id, H2_REFUSED_STREAM);
+		if (!end) {
+			add_half_open(h, id);
+		}
+		return;
+	}
+	render_request(b, &s->conn);
+	conn_stream_start(&s->conn);
+}
+
+// add a fragment to the header block; -1 if it grows beyond what we take
+static int add_fragment(struct h2 *h, const unsigned char *p, size_t len)
+{
+	unsigned char *block;
+
+	if (h->block_len + len > H2_MAX_HEADER_BLOCK) {
+		go_away(h, H2_ENHANCE_YOUR_CALM);
+		return -1;
+	}
+	if (!(block = realloc(h->block, h->block_len + len + 1))) {
+		go_away(h, H2_INTERNAL_ERROR);
+		return -1;
+	}
+	h->block = block;
+	memcpy(h->block + h->block_len, p, len);
+	h->block_len += len;
+	return 0;
+}
+
+static void on_headers(struct h2 *h, int flags, unsigned int id, const unsigned char *p, size_t len)
+{
+	if (id == 0 || !(id & 1)) {
+		go_away(h, H2_PROTOCOL_ERROR);  // stream 0, or one the server would open
+		return;
+	}
+	if (flags & FLAG_PADDED) {
+		if (len < 1 || p[0] >= len) {
+			go_away(h, H2_PROTOCOL_ERROR);
+			return;
+		}
+		len -= 1 + p[0];
+		p++;
+	}
+	if (flags & FLAG_PRIORITY) {
+		// priorities are advisory and we serve round robin regardless
+		if (len < 5) {
+			go_away(h, H2_FRAME_SIZE_ERROR);
+			return;
+		}
+		p += 5;
+		len -= 5;
+	}
+	h->block_len = 0;
+	h->block_stream = id;
+	h->block_end_stream = flags & FLAG_END_STREAM;
+	if (add_fragment(h, p, len) == 0 && (flags & FLAG_END_HEADERS)) {
+		finish_block(h);
+	}
+}
+
+static void on_data(struct h2 *h, int flags, unsigned int id, size_t len)
+{
+	struct stream *s;
+	unsigned int *slot;
+
+	if (id == 0 || id > h->last_stream) {
+		go_away(h, H2_PROTOCOL_ERROR);  // DATA on a stream that was never opened
+		return;
+	}
+	s = find_stream(h, id);
+	// request bodies aren't used; the bytes are dropped and the windows
+	// given straight back so the client never stalls on them
+	if (len > 0) {
+		window_update(h, 0, len);
+		if (s) {
+			window_update(h, id, len);
+		}
+	}
+	if (flags & FLAG_END_STREAM) {
+		if (s) {
+			s->client_open = 0;
+		} else if ((slot = find_half_open(h, id))) {
+			*slot = 0;
+		}
+	}
+}
+
+// apply a SETTINGS payload
+// returns 0, or the error code of the connection error it makes
+static enum h2_error apply_settings(struct h2 *h, const unsigned char *p, size_t len)
+{
+	struct stream *s;
+
+	for (; len >= 6; p += 6, len -= 6) {
+		unsigned int id = p[0] << 8 | p[1];
+		uint32_t value = get32(p + 2);
+
+		switch (id) {
+		case SETTINGS_HEADER_TABLE_SIZE:
+			hpack_encoder_resize(&h->enc, value);
+			break;
+		case SETTINGS_ENABLE_PUSH:
+			if (value > 1) {
+				return H2_PROTOCOL_ERROR;
+			}
+			break;
+		case SETTINGS_INITIAL_WINDOW_SIZE:
+			if (value > MAX_WINDOW) {
+				return H2_FLOW_CONTROL_ERROR;
+			}
+			// the change applies to the streams already open too
+			for (s = h->streams; s; s = s->next) {
+				s->window += (long long)value - h->initial_window;
+				if (s->window > MAX_WINDOW) {
+					return H2_FLOW_CONTROL_ERROR;
+				}
+			}
+			h->initial_window = value;
+			break;
+		case SETTINGS_MAX_FRAME_SIZE:
+			// we never send more than the default, which every peer takes
+			if (value < H2_FRAME_SIZE || value > MAX_FRAME_SIZE_LIMIT) {
+				return H2_PROTOCOL_ERROR;
+			}
+			break;
+		}
+	}
+	return H2_NO_ERROR;
+}
+
+static void on_settings(struct h2 *h, int flags, unsigned int id, const unsigned char *p, size_t len)
+{
+	enum h2_error error;
+
+	if (id != 0) {
+		go_away(h, H2_PROTOCOL_ERROR);
+		return;
+	}
+	if (flags & FLAG_ACK) {
+		if (len != 0) {
+			go_away(h, H2_FRAME_SIZE_ERROR);
+		}
+		return;
+	}
+	if (len % 6 != 0) {
+		go_away(h, H2_FRAME_SIZE_ERROR);
+		return;
+	}
+	if ((error = apply_settings(h, p, len)) != H2_NO_ERROR) {
+		go_away(h, error);
+		return;
+	}
+	put_frame(h, FRAME_SETTINGS, FLAG_ACK, 0, 0);
+}
+
+static void on_window_update(struct h2 *h, unsigned int id, const unsigned char *p, size_t len)
+{
+	struct stream *s;
+	uint32_t increment;
+
+	if (len != 4) {
+		go_away(h, H2_FRAME_SIZE_ERROR);
+		return;
+	}
+	increment = get32(p) & 0x7fffffff;
+	if (id == 0) {
+		if (increment == 0) {
+			go_away(h, H2_PROTOCOL_ERROR);
+		} else if ((h->window += increment) > MAX_WINDOW) {
+			go_away(h, H2_FLOW_CONTROL_ERROR);
+		}
+		return;
+	}
+	if (id > h->last_stream) {
+		go_away(h, H2_PROTOCOL_ERROR);
+		return;
+	}
+	if (!(s = find_stream(h, id))) {
+		return;  // a stream we finished; updates may still be on their way
+	}
+	if (increment == 0 || (s->window += increment) > MAX_WINDOW) {
+		reset_stream(h, id, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+		end_stream(h, s, 0);
+	}
+}
+
+static void on_frame(struct h2 *h, int type, int flags, unsigned int id,
+		const unsigned char *p, size_t len)
+{
+	struct stream *s;
+	unsigned int *slot;
+
+	// a header block must not be interleaved with anything else
+	if (h->block_stream && (type != FRAME_CONTINUATION || id != h->block_stream)) {
+		go_away(h, H2_PROTOCOL_ERROR);
+		return;
+	}
+
+	switch (type) {
+	case FRAME_DATA:
+		on_data(h, flags, id, len);
+		break;
+	case FRAME_HEADERS:
+		on_headers(h, flags, id, p, len);
+		break;
+	case FRAME_PRIORITY:
+		if (id == 0) {
+			go_away(h, H2_PROTOCOL_ERROR);
+		} else if (len != 5) {
+			go_away(h, H2_FRAME_SIZE_ERROR);
+		}
+		break;
+	case FRAME_RST_STREAM:
+		if (id == 0 || id > h->last_stream) {
+			go_away(h, H2_PROTOCOL_ERROR);
+		} else if (len != 4) {
+			go_away(h, H2_FRAME_SIZE_ERROR);
+		} else if ((s = find_stream(h, id))) {
+			s->client_open = 0;
+			end_stream(h, s, 0);  // the client no longer wants it
+		} else if ((slot = find_half_open(h, id))) {
+			*slot = 0;
+		}
+		break;
+	case FRAME_SETTINGS:
+		on_settings(h, flags, id, p, len);
+		break;
+	case FRAME_PUSH_PROMISE:
+		go_away(h, H2_PROTOCOL_ERROR);  // only servers push
+		break;
+	case FRAME_PING:
+		if (id != 0) {
+			go_away(h, H2_PROTOCOL_ERROR);
+		} else if (len != 8) {
+			go_away(h, H2_FRAME_SIZE_ERROR);
+		} else if (!(flags & FLAG_ACK)) {
+			memcpy(put_frame(h, FRAME_PING, FLAG_ACK, 0, 8), p, 8);
+		}
+		break;
+	case FRAME_GOAWAY:
+		if (id != 0) {
+			go_away(h, H2_PROTOCOL_ERROR);
+		} else {
+			h->peer_away = 1;
+		}
+		break;
+	case FRAME_WINDOW_UPDATE:
+		on_window_update(h, id, p, len);
+		break;
+	case FRAME_CONTINUATION:
+		if (!h->block_stream) {
+			go_away(h, H2_PROTOCOL_ERROR);
+		} else if (add_fragment(h, p, len) == 0 && (flags & FLAG_END_HEADERS)) {
+			finish_block(h);
+		}
+		break;
+	default:
+		break;  // unknown frame types are ignored
+	}
+}
+
+// handle the next frame (or preface bytes) in the input
+// returns 1 if something was consumed, 0 if more input is needed
+static int next_frame(struct h2 *h)
+{
+	unsigned char *p = h->in + h->in_start;
+	size_t avail = h->in_len - h->in_start, len;
+
+	if (h->preface_seen < PREFACE_LEN) {
+		size_t n = PREFACE_LEN - h->preface_seen;
+		n = n < avail ? n : avail;
+		if (memcmp(p, H2_PREFACE + h->preface_seen, n) != 0) {
+			go_away(h, H2_PROTOCOL_ERROR);
+			return 1;
+		}
+		h->preface_seen += n;
+		h->in_start += n;
+		return n > 0;
+	}
+
+	if (avail < FRAME_HEADER) {
+		return 0;
+	}
+	len = (size_t)p[0] << 16 | p[1] << 8 | p[2];
+	if (len > H2_FRAME_SIZE) {
+		go_away(h, H2_FRAME_SIZE_ERROR);
+		return 1;
+	}
+	if (avail < FRAME_HEADER + len) {
+		return 0;
+	}
+	h->in_start += FRAME_HEADER + len;
+	on_frame(h, p[3], p[4], get32(p + 5) & 0x7fffffff, p + FRAME_HEADER, len);
+	return 1;
+}
+
+// read and handle frames until the socket is drained, the output needs to
+// drain first or the connection is closing
+// returns -1 if the client went away, 0 otherwise
+static int receive(struct h2 *h)
+{
+	while (!h->closing && h->out_len < H2_OUT_SIZE) {
+		if (next_frame(h)) {
+			continue;
+		}
+		if (h->in_start > 0) {
+			memmove(h->in, h->in + h->in_start, h->in_len - h->in_start);
+			h->in_len -= h->in_start;
+			h->in_start = 0;
+		}
+
+		ssize_t n = read(h->c->fd, h->in + h->in_len, sizeof(h->in) - h->in_len);
+		if (n > 0) {
+			h->in_len += n;
+		} else if (n == 0) {
+			return -1;
+		} else if (errno == EINTR) {
+			continue;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		} else {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// queue the stream's response header as a HEADERS frame, translated from the
+// HTTP/1 header the handler formed
+// returns -1 if it can't be encoded, in which case the compression state is
+// lost with it
+static int send_headers(struct h2 *h, struct stream *s, int end_stream)
+{
+	struct conn *sc = &s->conn;
+	unsigned char *out = h->out + h->out_len + FRAME_HEADER;
+	size_t max = H2_FRAME_SIZE, n, m;
+	const char *line, *end = sc->header + sc->header_len;
+	char status[12];
+
+	n = hpack_encode_begin(&h->enc, out);
+	snprintf(status, sizeof(status), "%d", sc->status);
+	if (!(m = hpack_encode(&h->enc, out + n, max - n, ":status", 7, status, strlen(status), 1))) {
+		return -1;
+	}
+	n += m;
+
+	// skip the status line, then one field per line up to the blank one
+	line = memchr(sc->header, '\n', sc->header_len);
+	while (line && ++line < end && *line != '\r') {
+		const char *eol = memchr(line, '\n', end - line);
+		const char *colon = memchr(line, ':', end - line);
+		char name[64];
+		size_t i, name_len;
+
+		if (!eol || !colon || colon > eol) {
+			break;
+		}
+		name_len = colon - line;
+		if (name_len >= sizeof(name)) {
+			line = eol;
+			continue;
+		}
+		for (i = 0; i < name_len; i++) {
+			name[i] = line[i] >= 'A' && line[i] <= 'Z' ? line[i] - 'A' + 'a' : line[i];
+		}
+		const char *value = colon + 1;
+		while (value < eol && *value == ' ') {
+			value++;
+		}
+		size_t value_len = eol - value - (eol[-1] == '\r');
+		if (!is_hop_header(name, name_len)) {
+			if (!(m = hpack_encode(&h->enc, out + n, max - n, name, name_len, value, value_len,
+					!is_unindexed_header(name, name_len)))) {
+				return -1;
+			}
+			n += m;
+		}
+		line = eol;
+	}
+
+	put_frame(h, FRAME_HEADERS, FLAG_END_HEADERS | (end_stream ? FLAG_END_STREAM : 0), s->id, n);
+	return 0;
+}
+
+// let one stream add a frame
+// returns 1 if it did (or ended), 0 if it waits on a window or its upstream
+static int produce(struct h2 *h, struct stream *s)
+{
+	struct conn *sc = &s->conn;
+	unsigned char *payload;
+	size_t want;
+	ssize_t n;
+	int rv;
+
+	if (!s->header_sent) {
+		if ((rv = conn_stream_header(sc)) == 0) {
+			h->c->upstream_wait = 1;
+			return 0;
+		}
+		if (rv == -1) {
+			reset_stream(h, s->id, H2_INTERNAL_ERROR);
+			end_stream(h, s, 0);
+			return 1;
+		}
+		int body = conn_stream_has_body(sc);
+		if (send_headers(h, s, !body) == -1) {
+			go_away(h, H2_INTERNAL_ERROR);
+			return 1;
+		}
+		s->header_sent = 1;
+		if (!body) {
+			end_stream(h, s, 1);
+		}
+		return 1;
+	}
+
+	want = H2_FRAME_SIZE;
+	if ((long long)want > s->window) {
+		want = s->window > 0 ? s->window : 0;
+	}
+	if ((long long)want > h->window) {
+		want = h->window > 0 ? h->window : 0;
+	}
+	if (want == 0) {
+		return 0;
+	}
+
+	payload = h->out + h->out_len + FRAME_HEADER;
+	if ((n = conn_stream_body(sc, (char *)payload, want)) == CONN_STREAM_WAIT) {
+		h->c->upstream_wait = 1;
+		return 0;
+	}
+	if (n == -1) {
+		reset_stream(h, s->id, H2_INTERNAL_ERROR);
+		end_stream(h, s, 0);
+		return 1;
+	}
+	s->body_sent += n;
+	s->window -= n;
+	h->window -= n;
+	// END_STREAM rides on the last DATA frame when the length is known,
+	// otherwise on an empty one once the body says it is done
+	int last = n == 0 || (sc->content_length > 0 && s->body_sent >= sc->content_length);
+	put_frame(h, FRAME_DATA, last ? FLAG_END_STREAM : 0, s->id, n);
+	if (last) {
+		end_stream(h, s, 1);
+	}
+	return 1;
+}
+
+// let the streams fill the output, a frame each in turn so a large
+// response doesn't hold up the small ones behind it
+static void fill(struct h2 *h)
+{
+	struct stream *s, *next;
+	int progress = 1;
+
+	if (h->out_sent > 0) {
+		memmove(h->out, h->out + h->out_sent, h->out_len - h->out_sent);
+		h->out_len -= h->out_sent;
+		h->out_sent = 0;
+	}
+	// after an upgrade, stream 1 waits for the client's preface: until the
+	// client has seen the 101 it reads HTTP/1, and some buffer no more than
+	// a little of what follows it
+	if (h->preface_seen < PREFACE_LEN) {
+		return;
+	}
+	while (progress && !h->closing) {
+		progress = 0;
+		for (s = h->streams; s && room(h) > 0 && !h->closing; s = next) {
+			next = s->next;
+			progress |= produce(h, s);
+		}
+	}
+}
+
+// send the queued output
+// returns 1 once it is all sent, 0 if the socket would block, -1 on error
+static int flush(struct h2 *h)
+{
+	while (h->out_sent < h->out_len) {
+		ssize_t n = send(h->c->fd, h->out + h->out_sent, h->out_len - h->out_sent, MSG_NOSIGNAL);
+		if (n >= 0) {
+			h->out_sent += n;
+			conn_count_sent(h->c, n);
+		} else if (errno == EINTR) {
+			continue;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		} else {
+			return -1;
+		}
+	}
+	h->out_len = h->out_sent = 0;
+	return 1;
+}
+
+int h2_process(struct h2 *h)
+{
+	int rv;
+
+	while (1) {
+		if (receive(h) == -1) {
+			return -1;
+		}
+		fill(h);
+		if (h->out_len == 0) {
+			return h->closing || (h->peer_away && h->nstreams == 0) ? -1 : 0;
+		}
+		if ((rv = flush(h)) <= 0) {
+			return rv;
+		}
+	}
+}
+
+int h2_pending(const struct h2 *h)
+{
+	return h->out_sent < h->out_len;
+}
+
+// decode an HTTP2-Settings value (base64url, unpadded); -1 if malformed
+static long decode_settings(const struct http_str *value, unsigned char *out, size_t len)
+{
+	static const char alphabet[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+	uint32_t acc = 0;
+	size_t i, n = 0;
+	int bits = 0;
+
+	for (i = 0; i < value->len && value->p[i] != '='; i++) {
+		const char *c = memchr(alphabet, value->p[i], 64);
+		if (!c) {
+			return -1;
+		}
+		acc = acc << 6 | (c - alphabet);
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			if (n == len) {
+				return -1;
+			}
+			out[n++] = acc >> bits;
+		}
+	}
+	return n;
+}
+
+struct h2 *h2_create(struct conn *c, const struct http_str *settings)
+{
+	static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\n"
+		"Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+	unsigned char payload[H2_FRAME_SIZE], *p;
+	size_t handed = 0;
+	long len = 0;
+	struct h2 *h;
+	struct stream *s;
+
+	if (settings && ((len = decode_settings(settings, payload, sizeof(payload))) == -1 ||
+			len % 6 != 0)) {
+		return NULL;
+	}
+	if (!(h = calloc(1, sizeof(*h))) ||
+			!(h->out = malloc(H2_OUT_SIZE + FRAME_HEADER + H2_FRAME_SIZE))) {
+		free(h);
+		return NULL;
+	}
+	h->c = c;
+	hpack_table_init(&h->dec.table);
+	hpack_table_init(&h->enc.table);
+	h->window = H2_DEFAULT_WINDOW;
+	h->initial_window = H2_DEFAULT_WINDOW;
+
+	if (settings) {
+		memcpy(h->out, switching, sizeof(switching) - 1);
+		h->out_len = sizeof(switching) - 1;
+		if (apply_settings(h, payload, len) != H2_NO_ERROR) {
+			h2_free(h);
+			return NULL;
+		}
+		handed = c->req.header_len;
+	}
+
+	// our SETTINGS open the connection, right after the 101 if there is one
+	p = put_frame(h, FRAME_SETTINGS, 0, 0, 6);
+	p[0] = SETTINGS_MAX_CONCURRENT_STREAMS >> 8;
+	p[1] = SETTINGS_MAX_CONCURRENT_STREAMS & 0xff;
+	put32(p + 2, H2_MAX_STREAMS);
+
+	if (settings) {
+		// the upgraded request is stream 1, half closed by the client already
+		if (!(s = new_stream(h, 1, 0))) {
+			h2_free(h);
+			return NULL;
+		}
+		h->last_stream = 1;
+		memcpy(s->conn.request, c->request, handed);
+		s->conn.request_len = handed;
+		conn_stream_start(&s->conn);
+	}
+
+	// whatever came in behind the request (or the preface) is HTTP/2 input
+	memcpy(h->in, c->request + handed, c->request_len - handed);
+	h->in_len = c->request_len - handed;
+	STAT_INC(&c->worker->stats, h2_connections);
+	return h;
+}
+
+void h2_free(struct h2 *h)
+{
+	while (h->streams) {
+		end_stream(h, h->streams, 0);
+	}
+	hpack_table_free(&h->dec.table);
+	hpack_table_free(&h->enc.table);
+	free(h->block);
+	free(h->out);
+	free(h);
+}
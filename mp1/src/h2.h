@@ -0,0 +1,51 @@
+/*
+** h2.h -- HTTP/2 over cleartext TCP (h2c): framing, streams and flow control
+*/
+#ifndef H2_H
+#define H2_H
+
+#include <stddef.h>
+
+#include "http.h"
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"  // what a client opens with
+#define H2_MAX_STREAMS 100            // SETTINGS_MAX_CONCURRENT_STREAMS we advertise
+#define H2_FRAME_SIZE 16384           // largest frame payload we accept (the default)
+#define H2_DEFAULT_WINDOW 65535       // initial flow control window (the default)
+#define H2_MAX_HEADER_BLOCK 65536     // longest header block, HEADERS plus CONTINUATIONs
+#define H2_OUT_SIZE (256 * 1024)      // output queued before streams stop producing
+
+struct conn;
+struct h2;
+
+/*
+ * take over c for HTTP/2; the bytes already read into c->request are
+ * handed over as the start of the HTTP/2 input
+ * input settings - NULL for prior knowledge (the request in c->request is
+ *                  the preface); for an Upgrade: h2c request, the value of
+ *                  its HTTP2-Settings header, in which case that request
+ *                  becomes stream 1 and is answered after a 101
+ * output - the connection's HTTP/2 state, NULL if it couldn't be set up
+ *          (c is left as it was)
+ */
+struct h2 *h2_create(struct conn *c, const struct http_str *settings);
+
+/*
+ * read frames, answer streams and send as far as the socket allows
+ * output - 0 if waiting for the socket (or an upstream fetch, c->upstream_wait
+ *          is set then), -1 once the connection is finished and can be closed
+ */
+int h2_process(struct h2 *h);
+
+/*
+ * whether output is queued, i.e. the connection waits to write rather than
+ * for the client's next frames
+ */
+int h2_pending(const struct h2 *h);
+
+/*
+ * end every stream and free the state; the socket is left to the caller
+ */
+void h2_free(struct h2 *h);
+
+#endif
@@ -0,0 +1,572 @@
+/*
+** hpack.c -- HTTP/2 header compression (RFC 7541)
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "hpack.h"
+
+#define STATIC_ENTRIES 61
+#define ENTRY_OVERHEAD 32  // what RFC 7541 charges per table entry on top of its strings
+
+struct static_entry {
+	const char *name;
+	const char *value;
+};
+
+// RFC 7541 appendix A, index 1 first
+static const struct static_entry static_table[STATIC_ENTRIES] = {
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" },
+};
+
+struct huffman_code {
+	uint32_t code;  // right-aligned
+	uint8_t len;    // bits
+};
+
+// RFC 7541 appendix B, one code per octet; EOS is never sent and left out
+static const struct huffman_code huffman_codes[256] = {
+	{ 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 }, { 0xfffffe3, 28 },
+	{ 0xfffffe4, 28 }, { 0xfffffe5, 28 }, { 0xfffffe6, 28 }, { 0xfffffe7, 28 },
+	{ 0xfffffe8, 28 }, { 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 },
+	{ 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 }, { 0xfffffec, 28 },
+	{ 0xfffffed, 28 }, { 0xfffffee, 28 }, { 0xfffffef, 28 }, { 0xffffff0, 28 },
+	{ 0xffffff1, 28 }, { 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+	{ 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 }, { 0xffffff7, 28 },
+	{ 0xffffff8, 28 }, { 0xffffff9, 28 }, { 0xffffffa, 28 }, { 0xffffffb, 28 },
+	{ 0x14, 6 }, { 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 },
+	{ 0x1ff9, 13 }, { 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 },
+	{ 0x3fa, 10 }, { 0x3fb, 10 }, { 0xf9, 8 }, { 0x7fb, 11 },
+	{ 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 }, { 0x18, 6 },
+	{ 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 },
+	{ 0x1a, 6 }, { 0x1b, 6 }, { 0x1c, 6 }, { 0x1d, 6 },
+	{ 0x1e, 6 }, { 0x1f, 6 }, { 0x5c, 7 }, { 0xfb, 8 },
+	{ 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 }, { 0x3fc, 10 },
+	{ 0x1ffa, 13 }, { 0x21, 6 }, { 0x5d, 7 }, { 0x5e, 7 },
+	{ 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 }, { 0x62, 7 },
+	{ 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 },
+	{ 0x67, 7 }, { 0x68, 7 }, { 0x69, 7 }, { 0x6a, 7 },
+	{ 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 }, { 0x6e, 7 },
+	{ 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 }, { 0x72, 7 },
+	{ 0xfc, 8 }, { 0x73, 7 }, { 0xfd, 8 }, { 0x1ffb, 13 },
+	{ 0x7fff0, 19 }, { 0x1ffc, 13 }, { 0x3ffc, 14 }, { 0x22, 6 },
+	{ 0x7ffd, 15 }, { 0x3, 5 }, { 0x23, 6 }, { 0x4, 5 },
+	{ 0x24, 6 }, { 0x5, 5 }, { 0x25, 6 }, { 0x26, 6 },
+	{ 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 },
+	{ 0x28, 6 }, { 0x29, 6 }, { 0x2a, 6 }, { 0x7, 5 },
+	{ 0x2b, 6 }, { 0x76, 7 }, { 0x2c, 6 }, { 0x8, 5 },
+	{ 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 },
+	{ 0x79, 7 }, { 0x7a, 7 }, { 0x7b, 7 }, { 0x7ffe, 15 },
+	{ 0x7fc, 11 }, { 0x3ffd, 14 }, { 0x1ffd, 13 }, { 0xffffffc, 28 },
+	{ 0xfffe6, 20 }, { 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 },
+	{ 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 }, { 0x7fffd9, 23 },
+	{ 0x3fffd6, 22 }, { 0x7fffda, 23 }, { 0x7fffdb, 23 }, { 0x7fffdc, 23 },
+	{ 0x7fffdd, 23 }, { 0x7fffde, 23 }, { 0xffffeb, 24 }, { 0x7fffdf, 23 },
+	{ 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 }, { 0x7fffe0, 23 },
+	{ 0xffffee, 24 }, { 0x7fffe1, 23 }, { 0x7fffe2, 23 }, { 0x7fffe3, 23 },
+	{ 0x7fffe4, 23 }, { 0x1fffdc, 21 }, { 0x3fffd8, 22 }, { 0x7fffe5, 23 },
+	{ 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 }, { 0xffffef, 24 },
+	{ 0x3fffda, 22 }, { 0x1fffdd, 21 }, { 0xfffe9, 20 }, { 0x3fffdb, 22 },
+	{ 0x3fffdc, 22 }, { 0x7fffe8, 23 }, { 0x7fffe9, 23 }, { 0x1fffde, 21 },
+	{ 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 }, { 0xfffff0, 24 },
+	{ 0x1fffdf, 21 }, { 0x3fffdf, 22 }, { 0x7fffeb, 23 }, { 0x7fffec, 23 },
+	{ 0x1fffe0, 21 }, { 0x1fffe1, 21 }, { 0x3fffe0, 22 }, { 0x1fffe2, 21 },
+	{ 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 }, { 0x7fffef, 23 },
+	{ 0xfffea, 20 }, { 0x3fffe2, 22 }, { 0x3fffe3, 22 }, { 0x3fffe4, 22 },
+	{ 0x7ffff0, 23 }, { 0x3fffe5, 22 }, { 0x3fffe6, 22 }, { 0x7ffff1, 23 },
+	{ 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 }, { 0x7fff1, 19 },
+	{ 0x3fffe7, 22 }, { 0x7ffff2, 23 }, { 0x3fffe8, 22 }, { 0x1ffffec, 25 },
+	{ 0x3ffffe2, 26 }, { 0x3ffffe3, 26 }, { 0x3ffffe4, 26 }, { 0x7ffffde, 27 },
+	{ 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 }, { 0x1ffffed, 25 },
+	{ 0x7fff2, 19 }, { 0x1fffe3, 21 }, { 0x3ffffe6, 26 }, { 0x7ffffe0, 27 },
+	{ 0x7ffffe1, 27 }, { 0x3ffffe7, 26 }, { 0x7ffffe2, 27 }, { 0xfffff2, 24 },
+	{ 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 }, { 0x3ffffe9, 26 },
+	{ 0xffffffd, 28 }, { 0x7ffffe3, 27 }, { 0x7ffffe4, 27 }, { 0x7ffffe5, 27 },
+	{ 0xfffec, 20 }, { 0xfffff3, 24 }, { 0xfffed, 20 }, { 0x1fffe6, 21 },
+	{ 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 }, { 0x7ffff3, 23 },
+	{ 0x3fffea, 22 }, { 0x3fffeb, 22 }, { 0x1ffffee, 25 }, { 0x1ffffef, 25 },
+	{ 0xfffff4, 24 }, { 0xfffff5, 24 }, { 0x3ffffea, 26 }, { 0x7ffff4, 23 },
+	{ 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 }, { 0x3ffffed, 26 },
+	{ 0x7ffffe7, 27 }, { 0x7ffffe8, 27 }, { 0x7ffffe9, 27 }, { 0x7ffffea, 27 },
+	{ 0x7ffffeb, 27 }, { 0xffffffe, 28 }, { 0x7ffffec, 27 }, { 0x7ffffed, 27 },
+	{ 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 }, { 0x3ffffee, 26 },
+};
+
+// decoding tree built from huffman_codes: children of each internal node,
+// 0 where no code continues (node 0 is the root, so it is never a child),
+// -(symbol + 1) for a leaf
+static int16_t huffman_tree[512][2];
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+static void build_huffman_tree(void)
+{
+	int nodes = 1, sym, bit;
+
+	for (sym = 0; sym < 256; sym++) {
+		int node = 0;
+		for (bit = huffman_codes[sym].len - 1; bit > 0; bit--) {
+			int b = (huffman_codes[sym].code >> bit) & 1;
+			if (huffman_tree[node][b] == 0) {
+				huffman_tree[node][b] = nodes++;
+			}
+			node = huffman_tree[node][b];
+		}
+		huffman_tree[node][huffman_codes[sym].code & 1] = -(sym + 1);
+	}
+}
+
+// decode a Huffman string; -1 if it is malformed or longer than out_len
+static long huffman_decode(const unsigned char *in, size_t len, char *out, size_t out_len)
+{
+	size_t i, n = 0;
+	int node = 0, depth = 0, ones = 1, bit;
+
+	pthread_once(&huffman_once, build_huffman_tree);
+	for (i = 0; i < len; i++) {
+		for (bit = 7; bit >= 0; bit--) {
+			int b = (in[i] >> bit) & 1;
+			int next = huffman_tree[node][b];
+			if (next == 0) {
+				return -1;  // EOS, or a code that doesn't exist
+			}
+			if (next < 0) {
+				if (n == out_len) {
+					return -1;
+				}
+				out[n++] = -next - 1;
+				node = depth = 0;
+				ones = 1;
+			} else {
+				node = next;
+				depth++;
+				ones &= b;
+			}
+		}
+	}
+	// the last octet is padded with the start of EOS, fewer than 8 one bits
+	return depth > 7 || !ones ? -1 : (long)n;
+}
+
+static size_t huffman_length(const char *s, size_t len)
+{
+	size_t i, bits = 0;
+	for (i = 0; i < len; i++) {
+		bits += huffman_codes[(unsigned char)s[i]].len;
+	}
+	return (bits + 7) / 8;
+}
+
+static size_t huffman_encode(const char *s, size_t len, unsigned char *out)
+{
+	uint64_t acc = 0;
+	size_t i, n = 0;
+	int bits = 0;
+
+	for (i = 0; i < len; i++) {
+		const struct huffman_code *h = &huffman_codes[(unsigned char)s[i]];
+		acc = acc << h->len | h->code;
+		bits += h->len;
+		while (bits >= 8) {
+			bits -= 8;
+			out[n++] = acc >> bits;
+		}
+	}
+	if (bits > 0) {
+		out[n++] = acc << (8 - bits) | (0xff >> bits);  // EOS padding
+	}
+	return n;
+}
+
+void hpack_table_init(struct hpack_table *t)
+{
+	memset(t, 0, sizeof(*t));
+	t->max_size = HPACK_TABLE_SIZE;
+}
+
+// drop the oldest entry
+static void evict(struct hpack_table *t)
+{
+	struct hpack_entry *e = &t->ring[(t->newest + t->count - 1) % HPACK_MAX_ENTRIES];
+
+	t->size -= e->name_len + e->value_len + ENTRY_OVERHEAD;
+	free(e->name);
+	e->name = e->value = NULL;
+	t->count--;
+}
+
+void hpack_table_free(struct hpack_table *t)
+{
+	while (t->count > 0) {
+		evict(t);
+	}
+}
+
+static void table_resize(struct hpack_table *t, size_t max_size)
+{
+	t->max_size = max_size;
+	while (t->size > t->max_size) {
+		evict(t);
+	}
+}
+
+// add a field as dynamic index 1; a field larger than the whole table just
+// empties it; -1 if out of memory
+static int table_add(struct hpack_table *t, const char *name, size_t name_len,
+		const char *value, size_t value_len)
+{
+	size_t size = name_len + value_len + ENTRY_OVERHEAD;
+	struct hpack_entry *e;
+	char *p;
+
+	// name and value share one allocation; copied before anything is
+	// evicted from under them, as the name may point into the table
+	if (!(p = malloc(name_len + value_len + 1))) {
+		return -1;
+	}
+	memcpy(p, name, name_len);
+	memcpy(p + name_len, value, value_len);
+	while (t->count > 0 && t->size + size > t->max_size) {
+		evict(t);
+	}
+	if (size > t->max_size) {
+		free(p);
+		return 0;
+	}
+	t->newest = (t->newest + HPACK_MAX_ENTRIES - 1) % HPACK_MAX_ENTRIES;
+	e = &t->ring[t->newest];
+	e->name = p;
+	e->name_len = name_len;
+	e->value = p + name_len;
+	e->value_len = value_len;
+	t->count++;
+	t->size += size;
+	return 0;
+}
+
+// look up index (1-based, static entries first); -1 if there is no such entry
+static int table_get(const struct hpack_table *t, uint32_t index,
+		const char **name, size_t *name_len, const char **value, size_t *value_len)
+{
+	if (index >= 1 && index <= STATIC_ENTRIES) {
+		*name = static_table[index - 1].name;
+		*name_len = strlen(*name);
+		*value = static_table[index - 1].value;
+		*value_len = strlen(*value);
+		return 0;
+	}
+	index -= STATIC_ENTRIES + 1;
+	if (index >= t->count) {
+		return -1;
+	}
+	const struct hpack_entry *e = &t->ring[(t->newest + index) % HPACK_MAX_ENTRIES];
+	*name = e->name;
+	*name_len = e->name_len;
+	*value = e->value;
+	*value_len = e->value_len;
+	return 0;
+}
+
+// RFC 7541 5.1 integer with an n-bit prefix; -1 if truncated or absurdly large
+static int decode_int(const unsigned char **p, const unsigned char *end, int n, uint32_t *out)
+{
+	uint32_t mask = (1u << n) - 1, value;
+	int shift = 0;
+
+	if (*p == end) {
+		return -1;
+	}
+	value = *(*p)++ & mask;
+	if (value < mask) {
+		*out = value;
+		return 0;
+	}
+	while (*p < end) {
+		unsigned char b = *(*p)++;
+		if (shift > 21) {
+			return -1;
+		}
+		value += (uint32_t)(b & 0x7f) << shift;
+		shift += 7;
+		if (!(b & 0x80)) {
+			*out = value;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// a string literal, pointing into the block or, Huffman-coded, into buf
+static int decode_string(const unsigned char **p, const unsigned char *end, char *buf,
+		const char **out, size_t *out_len)
+{
+	uint32_t len;
+	int huffman;
+
+	if (*p == end) {
+		return -1;
+	}
+	huffman = **p & 0x80;
+	if (decode_int(p, end, 7, &len) == -1 || len > (size_t)(end - *p)) {
+		return -1;
+	}
+	if (huffman) {
+		long n = huffman_decode(*p, len, buf, HPACK_MAX_STRING);
+		if (n == -1) {
+			return -1;
+		}
+		*out = buf;
+		*out_len = n;
+	} else {
+		if (len > HPACK_MAX_STRING) {
+			return -1;
+		}
+		*out = (const char *)*p;
+		*out_len = len;
+	}
+	*p += len;
+	return 0;
+}
+
+int hpack_decode(struct hpack_decoder *d, const unsigned char *in, size_t len,
+		hpack_emit emit, void *arg)
+{
+	const unsigned char *p = in, *end = in + len;
+	const char *name, *value;
+	size_t name_len, value_len;
+	uint32_t index;
+	int fields = 0;
+
+	while (p < end) {
+		unsigned char b = *p;
+
+		if (b & 0x80) {
+			// indexed field
+			if (decode_int(&p, end, 7, &index) == -1 ||
+					table_get(&d->table, index, &name, &name_len, &value, &value_len) == -1) {
+				return -1;
+			}
+			emit(arg, name, name_len, value, value_len);
+			fields++;
+			continue;
+		}
+		if ((b & 0xe0) == 0x20) {
+			// table size update, only allowed before the first field
+			if (fields > 0 || decode_int(&p, end, 5, &index) == -1 || index > HPACK_TABLE_SIZE) {
+				return -1;
+			}
+			table_resize(&d->table, index);
+			continue;
+		}
+
+		// a literal, with incremental indexing (6-bit index) or without
+		// (4-bit index, never-indexed or not)
+		int add = (b & 0xc0) == 0x40;
+		if (decode_int(&p, end, add ? 6 : 4, &index) == -1) {
+			return -1;
+		}
+		if (index == 0) {
+			if (decode_string(&p, end, d->scratch[0], &name, &name_len) == -1) {
+				return -1;
+			}
+		} else if (table_get(&d->table, index, &name, &name_len, &value, &value_len) == -1) {
+			return -1;
+		}
+		if (decode_string(&p, end, d->scratch[1], &value, &value_len) == -1) {
+			return -1;
+		}
+		emit(arg, name, name_len, value, value_len);
+		fields++;
+		if (add && table_add(&d->table, name, name_len, value, value_len) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void hpack_encoder_resize(struct hpack_encoder *e, size_t size)
+{
+	if (size > HPACK_TABLE_SIZE) {
+		size = HPACK_TABLE_SIZE;
+	}
+	if (size == e->table.max_size) {
+		return;
+	}
+	if (!e->resized || size < e->pending_min) {
+		e->pending_min = size < e->table.max_size ? size : e->table.max_size;
+	}
+	e->resized = 1;
+	table_resize(&e->table, size);
+}
+
+static size_t encode_int(unsigned char *out, unsigned char first, int n, uint32_t value)
+{
+	uint32_t mask = (1u << n) - 1;
+	size_t i = 0;
+
+	if (value < mask) {
+		out[i++] = first | value;
+		return i;
+	}
+	out[i++] = first | mask;
+	value -= mask;
+	while (value >= 0x80) {
+		out[i++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	out[i++] = value;
+	return i;
+}
+
+size_t hpack_encode_begin(struct hpack_encoder *e, unsigned char *out)
+{
+	size_t n = 0;
+
+	if (e->resized) {
+		// a shrink in between has to be announced too, the peer's table
+		// may only grow back after it evicted down to it
+		if (e->pending_min < e->table.max_size) {
+			n += encode_int(out, 0x20, 5, e->pending_min);
+		}
+		n += encode_int(out + n, 0x20, 5, e->table.max_size);
+		e->resized = 0;
+	}
+	return n;
+}
+
+static size_t encode_string(unsigned char *out, const char *s, size_t len)
+{
+	size_t hlen = huffman_length(s, len), n;
+
+	if (hlen < len) {
+		n = encode_int(out, 0x80, 7, hlen);
+		return n + huffman_encode(s, len, out + n);
+	}
+	n = encode_int(out, 0, 7, len);
+	memcpy(out + n, s, len);
+	return n + len;
+}
+
+// the best index for a field: a full match if there is one (*exact set),
+// else one with the same name, else 0
+static uint32_t find_field(const struct hpack_table *t, const char *name, size_t name_len,
+		const char *value, size_t value_len, int *exact)
+{
+	uint32_t i, by_name = 0;
+
+	*exact = 0;
+	for (i = 0; i < STATIC_ENTRIES; i++) {
+		const struct static_entry *s = &static_table[i];
+		if (strlen(s->name) == name_len && memcmp(s->name, name, name_len) == 0) {
+			if (strlen(s->value) == value_len && memcmp(s->value, value, value_len) == 0) {
+				*exact = 1;
+				return i + 1;
+			}
+			if (!by_name) {
+				by_name = i + 1;
+			}
+		}
+	}
+	for (i = 0; i < t->count; i++) {
+		const struct hpack_entry *e = &t->ring[(t->newest + i) % HPACK_MAX_ENTRIES];
+		if (e->name_len == name_len && memcmp(e->name, name, name_len) == 0) {
+			if (e->value_len == value_len && memcmp(e->value, value, value_len) == 0) {
+				*exact = 1;
+				return STATIC_ENTRIES + 1 + i;
+			}
+			if (!by_name) {
+				by_name = STATIC_ENTRIES + 1 + i;
+			}
+		}
+	}
+	return by_name;
+}
+
+size_t hpack_encode(struct hpack_encoder *e, unsigned char *out, size_t out_len,
+		const char *name, size_t name_len, const char *value, size_t value_len, int index)
+{
+	uint32_t i;
+	size_t n;
+	int exact;
+
+	// the worst case is checked up front: once the field is in our table
+	// it must reach the peer's, or the two diverge
+	if (out_len < 5 + 5 + name_len + 5 + value_len) {
+		return 0;
+	}
+	i = find_field(&e->table, name, name_len, value, value_len, &exact);
+	if (exact) {
+		return encode_int(out, 0x80, 7, i);
+	}
+	if (index && table_add(&e->table, name, name_len, value, value_len) == -1) {
+		index = 0;
+	}
+
+	n = index ? encode_int(out, 0x40, 6, i) : encode_int(out, 0x00, 4, i);
+	if (i == 0) {
+		n += encode_string(out + n, name, name_len);
+	}
+	return n + encode_string(out + n, value, value_len);
+}
@@ -0,0 +1,88 @@
+/*
+** hpack.h -- HTTP/2 header compression (RFC 7541)
+*/
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+
+#define HPACK_TABLE_SIZE 4096    // dynamic table size both peers start with
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / 32)  // an entry costs at least 32
+#define HPACK_MAX_STRING 8192    // longest name or value we decode
+
+struct hpack_entry {
+	char *name;
+	char *value;
+	size_t name_len;
+	size_t value_len;
+};
+
+/*
+ * The dynamic table: a FIFO of recently sent fields, newest first, whose
+ * lengths plus 32 per entry stay within max_size. The decoder and the
+ * encoder each keep one, mirroring the table of the peer's opposite number.
+ */
+struct hpack_table {
+	struct hpack_entry ring[HPACK_MAX_ENTRIES];
+	unsigned int newest;  // ring index of dynamic index 1
+	unsigned int count;
+	size_t size;
+	size_t max_size;      // never above HPACK_TABLE_SIZE
+};
+
+struct hpack_decoder {
+	struct hpack_table table;
+	char scratch[2][HPACK_MAX_STRING];  // Huffman-decoded name and value
+};
+
+struct hpack_encoder {
+	struct hpack_table table;
+	size_t pending_min;   // smallest size the peer allowed since the last block,
+	int resized;          // and whether a table size update must open the next block
+};
+
+// called for each field of a decoded block, in order; the strings are only
+// valid during the call and not terminated
+typedef void (*hpack_emit)(void *arg, const char *name, size_t name_len,
+		const char *value, size_t value_len);
+
+/*
+ * set up an empty table of HPACK_TABLE_SIZE
+ */
+void hpack_table_init(struct hpack_table *t);
+
+/*
+ * free every entry of the table
+ */
+void hpack_table_free(struct hpack_table *t);
+
+/*
+ * decode one complete header block, updating the decoder's table as the
+ * block says; emit is called for every field
+ * output - 0 on success, -1 if the block is malformed or uses more than
+ *          we allow (a connection error, the tables are out of step)
+ */
+int hpack_decode(struct hpack_decoder *d, const unsigned char *in, size_t len,
+		hpack_emit emit, void *arg);
+
+/*
+ * the peer's SETTINGS_HEADER_TABLE_SIZE changed; our table follows it (up to
+ * HPACK_TABLE_SIZE) and the next block tells the peer so
+ */
+void hpack_encoder_resize(struct hpack_encoder *e, size_t size);
+
+/*
+ * start a header block at out with any table size update the peer is owed
+ * output - bytes written, at most 10
+ */
+size_t hpack_encode_begin(struct hpack_encoder *e, unsigned char *out);
+
+/*
+ * append one field to a header block; with index set the field goes into
+ * the table, so a later block can send it as a single byte
+ * output - bytes written, 0 if out_len isn't enough
+ */
+size_t hpack_encode(struct hpack_encoder *e, unsigned char *out, size_t out_len,
+		const char *name, size_t name_len, const char *value, size_t value_len, int index);
+
+#endif
@@ -0,0 +1,447 @@
+/*
+** http.c -- HTTP formatting helpers shared by the server modules
+*/
+
+#define _GNU_SOURCE  // strptime(), timegm()
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "http.h"
+
+size_t http_date(time_t t, char *buf, size_t len)
+{
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	return strftime(buf, len, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+size_t http_etag(const struct stat *st, char *buf, size_t len)
+{
+	int n = snprintf(buf, len, "\"%llx-%llx-%llx.%lx\"",
+			(unsigned long long)st->st_ino, (unsigned long long)st->st_size,
+			(unsigned long long)st->st_mtim.tv_sec, (unsigned long)st->st_mtim.tv_nsec);
+	return n < 0 ? 0 : (size_t)n < len ? (size_t)n : len - 1;
+}
+
+size_t http_validator_headers(const struct stat *st, char *buf, size_t len)
+{
+	char date[HTTP_DATE_LEN], etag[HTTP_ETAG_LEN];
+
+	http_date(st->st_mtime, date, sizeof(date));
+	http_etag(st, etag, sizeof(etag));
+	int n = snprintf(buf, len, "Last-Modified: %s\r\nETag: %s\r\n", date, etag);
+	return n < 0 ? 0 : (size_t)n < len ? (size_t)n : len - 1;
+}
+
+enum {
+	S_METHOD,
+	S_TARGET,
+	S_VERSION,
+	S_REQUEST_LINE_LF,
+	S_HEADER_START,
+	S_HEADER_NAME,
+	S_VALUE_START,
+	S_VALUE,
+	S_HEADER_LF,
+	S_END_LF,
+	S_DONE,
+	S_ERROR,
+};
+
+// RFC 7230 tchar: what may appear in a method or header name
+static int is_token_char(unsigned char ch)
+{
+	if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9')) {
+		return 1;
+	}
+	return ch != '\0' && strchr("!#$%&'*+-.^_`|~", ch) != NULL;
+}
+
+void http_parser_init(struct http_request *r)
+{
+	memset(r, 0, sizeof(*r));
+	r->state = S_METHOD;
+}
+
+static struct http_str view(const char *buf, size_t start, size_t end)
+{
+	struct http_str s = { buf + start, end - start };
+	return s;
+}
+
+// finish the header value that ends (exclusive) at i
+static void store_header(struct http_request *r, const char *buf, size_t i)
+{
+	size_t end = i;
+	while (end > r->mark && (buf[end - 1] == ' ' || buf[end - 1] == '\t')) {
+		end--;
+	}
+	if (r->nheaders < HTTP_MAX_HEADERS) {
+		r->headers[r->nheaders].name = r->pending_name;
+		r->headers[r->nheaders].value = view(buf, r->mark, end);
+		r->nheaders++;
+	}
+}
+
+int http_parse_request(struct http_request *r, const char *buf, size_t len)
+{
+	size_t i;
+
+	if (r->state == S_DONE) {
+		return HTTP_PARSE_DONE;
+	}
+	if (r->state == S_ERROR) {
+		return HTTP_PARSE_ERROR;
+	}
+
+	for (i = r->pos; i < len; i++) {
+		unsigned char ch = buf[i];
+
+		switch (r->state) {
+		case S_METHOD:
+			if (ch == ' ' && i > r->mark) {
+				r->method = view(buf, r->mark, i);
+				r->mark = i + 1;
+				r->state = S_TARGET;
+			} else if (!is_token_char(ch)) {
+				goto error;
+			}
+			break;
+
+		case S_TARGET:
+			if (ch == ' ' && i > r->mark) {
+				r->target = view(buf, r->mark, i);
+				r->mark = i + 1;
+				r->state = S_VERSION;
+			} else if (ch <= ' ' || ch == 0x7f) {
+				goto error;
+			}
+			break;
+
+		case S_VERSION:
+			if ((ch == '\r' || ch == '\n') && i > r->mark) {
+				r->version = view(buf, r->mark, i);
+				r->state = ch == '\r' ? S_REQUEST_LINE_LF : S_HEADER_START;
+			} else if (ch <= ' ' || ch == 0x7f) {
+				goto error;
+			}
+			break;
+
+		case S_REQUEST_LINE_LF:
+		case S_HEADER_LF:
+			if (ch != '\n') {
+				goto error;
+			}
+			r->state = S_HEADER_START;
+			break;
+
+		case S_HEADER_START:
+			if (ch == '\r') {
+				r->state = S_END_LF;
+			} else if (ch == '\n') {
+				goto done;
+			} else if (is_token_char(ch)) {
+				r->mark = i;
+				r->state = S_HEADER_NAME;
+			} else {
+				goto error;  // includes obsolete line folding
+			}
+			break;
+
+		case S_HEADER_NAME:
+			if (ch == ':') {
+				r->pending_name = view(buf, r->mark, i);
+				r->state = S_VALUE_START;
+			} else if (!is_token_char(ch)) {
+				goto error;
+			}
+			break;
+
+		case S_VALUE_START:
+			if (ch == ' ' || ch == '\t') {
+				break;
+			}
+			r->mark = i;
+			r->state = S_VALUE;
+			// fall through
+		case S_VALUE:
+			if (ch == '\r' || ch == '\n') {
+				store_header(r, buf, i);
+				r->state = ch == '\r' ? S_HEADER_LF : S_HEADER_START;
+			} else if (ch < ' ' && ch != '\t') {
+				goto error;
+			}
+			break;
+
+		case S_END_LF:
+			if (ch != '\n') {
+				goto error;
+			}
+			goto done;
+		}
+	}
+
+	r->pos = len;
+	return HTTP_PARSE_AGAIN;
+
+done:
+	r->header_len = i + 1;
+	r->pos = i + 1;
+	r->state = S_DONE;
+	return HTTP_PARSE_DONE;
+
+error:
+	r->pos = i;
+	r->state = S_ERROR;
+	return HTTP_PARSE_ERROR;
+}
+
+const struct http_str *http_find_header(const struct http_request *r, const char *name)
+{
+	int i;
+	for (i = 0; i < r->nheaders; i++) {
+		if (http_str_caseeq(r->headers[i].name, name)) {
+			return &r->headers[i].value;
+		}
+	}
+	return NULL;
+}
+
+// parse decimal digits at *p, advancing it; -1 if there are none or on overflow
+static off_t parse_offset(const char **p, const char *end)
+{
+	off_t n = 0;
+	const char *start = *p;
+
+	while (*p < end && **p >= '0' && **p <= '9') {
+		if (n > (((off_t)1 << 62) - 1) / 10) {
+			return -1;
+		}
+		n = n * 10 + (**p - '0');
+		(*p)++;
+	}
+	return *p == start ? -1 : n;
+}
+
+int http_parse_range(struct http_str value, off_t size, struct http_range *out, int max)
+{
+	const char *p = value.p, *end = value.p + value.len;
+	int count = 0, specs = 0;
+
+	if (value.len < 6 || strncasecmp(p, "bytes=", 6) != 0) {
+		return -1;
+	}
+	p += 6;
+
+	while (1) {
+		off_t first, last;
+
+		while (p < end && (*p == ' ' || *p == '\t')) {
+			p++;
+		}
+		if (p < end && *p == '-') {
+			// suffix range: the last n bytes
+			p++;
+			off_t n = parse_offset(&p, end);
+			if (n == -1) {
+				return -1;
+			}
+			first = n >= size ? 0 : size - n;
+			last = n == 0 ? -1 : size - 1;  // "-0" is never satisfiable
+		} else {
+			first = parse_offset(&p, end);
+			if (first == -1 || p == end || *p++ != '-') {
+				return -1;
+			}
+			last = size - 1;
+			if (p < end && *p >= '0' && *p <= '9') {
+				off_t n = parse_offset(&p, end);
+				if (n == -1 || n < first) {
+					return -1;
+				}
+				if (n < last) {
+					last = n;
+				}
+			}
+		}
+
+		if (++specs > max) {
+			return -1;
+		}
+		if (first <= last && first < size) {
+			out[count].first = first;
+			out[count].last = last;
+			count++;
+		}
+
+		while (p < end && (*p == ' ' || *p == '\t')) {
+			p++;
+		}
+		if (p == end) {
+			return count;
+		}
+		if (*p++ != ',') {
+			return -1;
+		}
+	}
+}
+
+int http_if_range_matches(struct http_str value, const struct stat *st)
+{
+	char buf[HTTP_ETAG_LEN > HTTP_DATE_LEN ? HTTP_ETAG_LEN : HTTP_DATE_LEN];
+
+	if (value.len > 0 && value.p[0] == '"') {
+		http_etag(st, buf, sizeof(buf));
+	} else {
+		http_date(st->st_mtime, buf, sizeof(buf));
+	}
+	return http_str_eq(value, buf);  // weak tags ("W/...") never match
+}
+
+int http_etag_list_matches(struct http_str value, const struct stat *st)
+{
+	char etag[HTTP_ETAG_LEN];
+	size_t etag_len = http_etag(st, etag, sizeof(etag));
+	const char *p = value.p, *end = value.p + value.len;
+
+	while (p < end) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+			p++;
+		}
+		if (p == end) {
+			break;
+		}
+		if (*p == '*') {
+			return 1;
+		}
+		if (end - p > 2 && p[0] == 'W' && p[1] == '/') {
+			p += 2;
+		}
+		// an entity tag is a quoted string without escapes
+		const char *tag = p;
+		if (*p != '"') {
+			return 0;
+		}
+		const char *close = memchr(p + 1, '"', end - p - 1);
+		if (!close) {
+			return 0;
+		}
+		p = close + 1;
+		if ((size_t)(p - tag) == etag_len && memcmp(tag, etag, etag_len) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// skip spaces and tabs
+static const char *skip_ws(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t')) {
+		p++;
+	}
+	return p;
+}
+
+int http_accepts_encoding(struct http_str value, const char *coding)
+{
+	const char *p = value.p, *end = value.p + value.len;
+	int star = 0;  // "*" seen with a non-zero weight
+
+	while (p < end) {
+		p = skip_ws(p, end);
+		const char *name = p;
+		while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') {
+			p++;
+		}
+		struct http_str token = { name, p - name };
+
+		// the weight is all that matters of the parameters, and only
+		// whether it is zero: "q=0", "q=0.0" and "q=0.000" refuse
+		int weighted = 1;
+		while ((p = skip_ws(p, end)) < end && *p == ';') {
+			p = skip_ws(p + 1, end);
+			if (end - p >= 2 && (p[0] == 'q' || p[0] == 'Q') && p[1] == '=') {
+				weighted = 0;
+				for (p += 2; p < end && ((*p >= '0' && *p <= '9') || *p == '.'); p++) {
+					weighted |= *p >= '1' && *p <= '9';
+				}
+			}
+			while (p < end && *p != ',' && *p != ';') {
+				p++;
+			}
+		}
+
+		if (http_str_caseeq(token, coding)) {
+			return weighted;
+		}
+		if (http_str_eq(token, "*")) {
+			star = weighted;
+		}
+		while (p < end && *p != ',') {
+			p++;
+		}
+		if (p < end) {
+			p++;
+		}
+	}
+	return star;
+}
+
+int http_has_token(struct http_str value, const char *token)
+{
+	const char *p = value.p, *end = value.p + value.len;
+
+	while (p < end) {
+		p = skip_ws(p, end);
+		const char *start = p;
+		while (p < end && *p != ',') {
+			p++;
+		}
+		const char *last = p;
+		while (last > start && (last[-1] == ' ' || last[-1] == '\t')) {
+			last--;
+		}
+		struct http_str element = { start, last - start };
+		if (http_str_caseeq(element, token)) {
+			return 1;
+		}
+		if (p < end) {
+			p++;
+		}
+	}
+	return 0;
+}
+
+int http_not_modified_since(struct http_str value, const struct stat *st)
+{
+	char date[HTTP_DATE_LEN];
+	struct tm tm;
+
+	if (value.len >= sizeof(date)) {
+		return 0;
+	}
+	memcpy(date, value.p, value.len);
+	date[value.len] = '\0';
+
+	memset(&tm, 0, sizeof(tm));
+	char *end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	if (!end || *end != '\0') {
+		return 0;
+	}
+	return st->st_mtime <= timegm(&tm);
+}
+
+int http_str_eq(struct http_str s, const char *lit)
+{
+	return s.len == strlen(lit) && memcmp(s.p, lit, s.len) == 0;
+}
+
+int http_str_caseeq(struct http_str s, const char *lit)
+{
+	return s.len == strlen(lit) && strncasecmp(s.p, lit, s.len) == 0;
+}
@@ -0,0 +1,149 @@
+/*
+** http.h -- HTTP formatting helpers shared by the server modules
+*/
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define HTTP_DATE_LEN 32  // "Sun, 06 Nov 1994 08:49:37 GMT" plus slack
+#define HTTP_ETAG_LEN 64
+
+#define HTTP_MAX_HEADERS 64  // headers past this many are parsed but not kept
+#define HTTP_MAX_RANGES 16   // Range requests with more parts are answered in full
+
+// a view into the caller's request buffer; not NUL terminated
+struct http_str {
+	const char *p;
+	size_t len;
+};
+
+struct http_header {
+	struct http_str name;
+	struct http_str value;  // leading and trailing whitespace trimmed
+};
+
+enum http_parse_result {
+	HTTP_PARSE_ERROR = -1,  // malformed request, answer 400 and close
+	HTTP_PARSE_AGAIN = 0,   // header incomplete, call again once more bytes arrive
+	HTTP_PARSE_DONE = 1,    // header complete, fields below are valid
+};
+
+/*
+ * Resumable request header parser. Each call picks up where the previous one
+ * stopped, so bytes are examined once no matter how the request was split
+ * across reads. The results point into the buffer, which must therefore stay
+ * put (and keep its earlier bytes) until the request has been answered.
+ */
+struct http_request {
+	// parser state
+	int state;
+	size_t pos;   // next byte to examine
+	size_t mark;  // start of the token being scanned
+	struct http_str pending_name;  // header name whose value is being scanned
+
+	// results
+	struct http_str method;
+	struct http_str target;
+	struct http_str version;
+	struct http_header headers[HTTP_MAX_HEADERS];
+	int nheaders;
+	size_t header_len;  // bytes of the request line and headers, blank line included
+};
+
+// an inclusive byte range of the representation
+struct http_range {
+	off_t first;
+	off_t last;
+};
+
+/*
+ * reset the parser for a new request
+ */
+void http_parser_init(struct http_request *r);
+
+/*
+ * continue parsing the request in buf
+ * input buf, len - everything received for this request so far
+ * output - one of enum http_parse_result
+ */
+int http_parse_request(struct http_request *r, const char *buf, size_t len);
+
+/*
+ * find a request header by case-insensitive name
+ * output - the header's value, or NULL if the request doesn't carry it
+ */
+const struct http_str *http_find_header(const struct http_request *r, const char *name);
+
+/*
+ * parse a Range header value ("bytes=0-99,200-,-50") against a file of
+ * size bytes, clamping each range to the file and dropping the ones that
+ * start past its end
+ * output - number of satisfiable ranges stored in out (0 means answer 416),
+ *          or -1 if the header is malformed, uses another unit or asks for
+ *          more than max ranges, in which case it must be ignored
+ */
+int http_parse_range(struct http_str value, off_t size, struct http_range *out, int max);
+
+/*
+ * check an If-Range value against the file's current validators: an entity
+ * tag must match strongly, a date must equal Last-Modified exactly
+ * output - 1 if the Range header may be honoured, 0 if the full file must be sent
+ */
+int http_if_range_matches(struct http_str value, const struct stat *st);
+
+/*
+ * evaluate If-None-Match: "*" or a comma separated list of entity tags,
+ * compared weakly (a W/ prefix is ignored) against the file's tag
+ * output - 1 if one of them matches, i.e. the client's copy is current
+ */
+int http_etag_list_matches(struct http_str value, const struct stat *st);
+
+/*
+ * evaluate If-Modified-Since
+ * output - 1 if value is a valid HTTP-date and the file hasn't been modified
+ *          after it, 0 otherwise (including unparseable dates)
+ */
+int http_not_modified_since(struct http_str value, const struct stat *st);
+
+/*
+ * evaluate Accept-Encoding for one content coding such as "gzip"
+ * output - 1 if the coding is listed, or covered by "*", with a non-zero
+ *          weight; 0 if it is absent or refused with q=0
+ */
+int http_accepts_encoding(struct http_str value, const char *coding);
+
+/*
+ * look for token in a comma-separated list such as Connection or Upgrade
+ * output - 1 if one of the list's elements is token, ignoring case
+ */
+int http_has_token(struct http_str value, const char *token);
+
+/*
+ * compare a view against a literal, exactly or ignoring case
+ */
+int http_str_eq(struct http_str s, const char *lit);
+int http_str_caseeq(struct http_str s, const char *lit);
+
+/*
+ * format t as an RFC 7231 HTTP-date
+ * output - length of the formatted date
+ */
+size_t http_date(time_t t, char *buf, size_t len);
+
+/*
+ * build a strong entity tag from the file's inode, size and mtime, so any
+ * rewrite of the file changes it; the result includes the double quotes
+ * output - length of the formatted tag
+ */
+size_t http_etag(const struct stat *st, char *buf, size_t len);
+
+/*
+ * format the Last-Modified and ETag header lines (CRLF terminated) for st
+ * output - number of bytes written to buf
+ */
+size_t http_validator_headers(const struct stat *st, char *buf, size_t len);
+
+#endif
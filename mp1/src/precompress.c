@@ -0,0 +1,233 @@
+/*
+** precompress.c -- background gzip of text files into sibling .gz variants
+*/
+
+#define _GNU_SOURCE  // FTW_ACTIONRETVAL, gettid()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <zlib.h>
+
+#include "precompress.h"
+
+#define COMPRESS_CHUNK 65536
+#define SWEEP_FDS 16  // directories nftw() may hold open at once
+
+// extensions of files that compress well; anything else is left alone
+static const char *text_extensions[] = {
+	".txt", ".log", ".csv", ".tsv", ".json", ".ndjson", ".xml", ".html", ".htm",
+	".css", ".js", ".mjs", ".map", ".svg", ".md",
+};
+
+static unsigned int sweep_interval;
+static int sweep_written;  // variants written by the current sweep
+
+static int same_mtime(const struct stat *a, const struct stat *b)
+{
+	return a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+int precompress_fresh(const struct stat *st, const struct stat *variant)
+{
+	// a variant that came out no smaller is kept only so the sweep doesn't
+	// redo it, it is never worth sending
+	return S_ISREG(variant->st_mode) && same_mtime(st, variant) && variant->st_size < st->st_size;
+}
+
+static int is_text(const char *path)
+{
+	const char *dot = strrchr(path, '.');
+	size_t i;
+
+	if (!dot || strchr(dot, '/')) {
+		return 0;
+	}
+	for (i = 0; i < sizeof(text_extensions) / sizeof(text_extensions[0]); i++) {
+		if (strcasecmp(dot, text_extensions[i]) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int precompress_candidate(const char *path, const struct stat *st)
+{
+	return S_ISREG(st->st_mode) && st->st_size >= PRECOMPRESS_MIN_SIZE && is_text(path);
+}
+
+// write every byte of buf, -1 on error
+static int write_all(int fd, const unsigned char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// gzip src into dst, -1 on a read, write or zlib error
+static int deflate_fd(int src, int dst)
+{
+	static unsigned char in[COMPRESS_CHUNK], out[COMPRESS_CHUNK];  // only the sweep thread uses them
+	z_stream zs;
+	int flush, rv = -1;
+
+	memset(&zs, 0, sizeof(zs));
+	// windowBits 15 + 16 asks for a gzip wrapper rather than a zlib one
+	if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return -1;
+	}
+	do {
+		ssize_t n = read(src, in, sizeof(in));
+		if (n == -1) {
+			if (errno == EINTR) {
+				flush = Z_NO_FLUSH;
+				continue;
+			}
+			goto out;
+		}
+		flush = n == 0 ? Z_FINISH : Z_NO_FLUSH;
+		zs.next_in = in;
+		zs.avail_in = n;
+		do {
+			zs.next_out = out;
+			zs.avail_out = sizeof(out);
+			if (deflate(&zs, flush) == Z_STREAM_ERROR) {
+				goto out;
+			}
+			if (write_all(dst, out, sizeof(out) - zs.avail_out) == -1) {
+				goto out;
+			}
+		} while (zs.avail_out == 0);
+	} while (flush != Z_FINISH);
+	rv = 0;
+
+out:
+	deflateEnd(&zs);
+	return rv;
+}
+
+// write path's variant next to it through a hidden temporary file, so the
+// server only ever sees a complete .gz
+static void compress_file(const char *path, const struct stat *st)
+{
+	char gz[PATH_MAX], tmp[PATH_MAX];
+	const char *base = strrchr(path, '/');
+	struct stat after;
+	int src, dst;
+
+	base = base ? base + 1 : path;
+	if (snprintf(gz, sizeof(gz), "%s%s", path, PRECOMPRESS_SUFFIX) >= (int)sizeof(gz) ||
+			snprintf(tmp, sizeof(tmp), "%.*s.%s%s.XXXXXX", (int)(base - path), path, base,
+				PRECOMPRESS_SUFFIX) >= (int)sizeof(tmp)) {
+		return;
+	}
+	if ((src = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		return;  // gone since the walk saw it
+	}
+	if ((dst = mkostemp(tmp, O_CLOEXEC)) == -1) {
+		perror(tmp);
+		close(src);
+		return;
+	}
+
+	// the original must not have changed while it was read, or the variant
+	// would claim an mtime its content doesn't match
+	if (deflate_fd(src, dst) == -1 || fstat(src, &after) == -1 || !same_mtime(st, &after) ||
+			after.st_size != st->st_size) {
+		goto fail;
+	}
+	struct timespec times[2] = { st->st_atim, st->st_mtim };
+	if (fchmod(dst, st->st_mode & 0777) == -1 || futimens(dst, times) == -1 ||
+			rename(tmp, gz) == -1) {
+		perror(gz);
+		goto fail;
+	}
+	close(src);
+	close(dst);
+	sweep_written++;
+	return;
+
+fail:
+	close(src);
+	close(dst);
+	unlink(tmp);
+}
+
+static int visit(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+	char gz[PATH_MAX];
+	struct stat variant;
+
+	// hidden entries include our own temporary files
+	if (ftw->level > 0 && path[ftw->base] == '.') {
+		return type == FTW_D ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+	}
+	if (type != FTW_F || !precompress_candidate(path, st)) {
+		return FTW_CONTINUE;
+	}
+	if (snprintf(gz, sizeof(gz), "%s%s", path, PRECOMPRESS_SUFFIX) < (int)sizeof(gz) &&
+			stat(gz, &variant) == 0 && S_ISREG(variant.st_mode) && same_mtime(st, &variant)) {
+		return FTW_CONTINUE;
+	}
+	compress_file(path, st);
+	return FTW_CONTINUE;
+}
+
+static void *sweep_main(void *arg)
+{
+	(void)arg;
+
+	// compression only uses time the workers leave over
+	setpriority(PRIO_PROCESS, gettid(), 19);
+
+	while (1) {
+		sweep_written = 0;
+		nftw(".", visit, SWEEP_FDS, FTW_PHYS | FTW_ACTIONRETVAL);
+		if (sweep_written > 0) {
+			printf("precompress: wrote %d gzip variant%s\n", sweep_written,
+					sweep_written > 1 ? "s" : "");
+		}
+		sleep(sweep_interval);
+	}
+	return NULL;
+}
+
+int precompress_start(unsigned int interval)
+{
+	pthread_t thread;
+	sigset_t all, old;
+	int err;
+
+	// the thread starts with every signal blocked, so it never takes one
+	// (such as SIGUSR1) meant for the threads that handle them
+	sweep_interval = interval;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	err = pthread_create(&thread, NULL, sweep_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err != 0) {
+		fprintf(stderr, "precompress: pthread_create: %s\n", strerror(err));
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
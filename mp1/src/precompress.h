@@ -0,0 +1,39 @@
+/*
+** precompress.h -- background gzip of text files into sibling .gz variants
+*/
+#ifndef PRECOMPRESS_H
+#define PRECOMPRESS_H
+
+#include <sys/stat.h>
+
+#define PRECOMPRESS_SUFFIX ".gz"
+#define PRECOMPRESS_MIN_SIZE 256  // smaller files gain less than the headers cost
+
+/*
+ * A variant "<file>.gz" stands for <file> while its mtime equals the
+ * original's; the compressor copies the mtime over when it writes one, as
+ * `gzip -k` does, so any later change to the original makes the variant
+ * stale until the next sweep replaces it.
+ */
+
+/*
+ * whether path, described by st, is a file the compressor makes a variant
+ * of; only those are worth looking for a variant of
+ */
+int precompress_candidate(const char *path, const struct stat *st);
+
+/*
+ * whether variant (the stat of <file>.gz) may be served in place of the
+ * file described by st
+ */
+int precompress_fresh(const struct stat *st, const struct stat *variant);
+
+/*
+ * start a thread that sweeps the tree under the working directory every
+ * interval seconds and (re)writes the .gz variant of every text file whose
+ * variant is missing or stale
+ * output - 0 on success, -1 if the thread can't be started
+ */
+int precompress_start(unsigned int interval);
+
+#endif
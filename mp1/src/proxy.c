@@ -0,0 +1,299 @@
+/*
+** proxy.c -- fetch misses from an upstream server into an on-disk cache
+*/
+
+#define _GNU_SOURCE  // mkostemp()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "counter.h"
+#include "event_loop.h"
+#include "fetch.h"
+#include "proxy.h"
+
+static char upstream_host[MAX_DOMAIN_SIZE];
+static char upstream_port[10];
+static char cache_root[PATH_MAX];
+static int enabled;
+
+// fetches in flight; a handful at a time, a list will do
+static struct proxy_fetch *inflight;
+static pthread_mutex_t inflight_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct proxy_stats stats;  // updated under inflight_lock, read with COUNTER_GET
+
+int proxy_init(const char *upstream, const char *cache_dir)
+{
+	char extra;
+
+	if (sscanf(upstream, "%99[^:]:%9[0-9]%c", upstream_host, upstream_port, &extra) != 2) {
+		return -1;
+	}
+	if (mkdir(cache_dir, 0777) == -1 && errno != EEXIST) {
+		perror(cache_dir);
+		return -1;
+	}
+	if (snprintf(cache_root, sizeof(cache_root), "%s", cache_dir) >= (int)sizeof(cache_root)) {
+		return -1;
+	}
+	enabled = 1;
+	return 0;
+}
+
+int proxy_enabled(void)
+{
+	return enabled;
+}
+
+int proxy_cache_path(const char *path, char *buf, size_t len)
+{
+	const char *p = path;
+
+	// the path names a file we will create, it must stay under the cache
+	// directory and clear of our temporary files
+	do {
+		size_t n = strcspn(p, "/");
+		if (n == 0 || p[0] == '.') {
+			return -1;
+		}
+		p += n;
+	} while (*p++ == '/');
+
+	return snprintf(buf, len, "%s/%s", cache_root, path) < (int)len ? 0 : -1;
+}
+
+// wake every worker that asked to hear about the fetch's next step
+static void wake_watchers(struct proxy_fetch *f)
+{
+	unsigned long long bits = __atomic_exchange_n(&f->watchers, 0, __ATOMIC_SEQ_CST);
+	uint64_t one = 1;
+	struct worker *workers;
+	int i, n;
+
+	if (bits == 0) {
+		return;
+	}
+	workers = registered_workers(&n);
+	for (i = 0; i < n; i++) {
+		if (bits & (1ULL << (workers[i].id % 64))) {
+			if (write(workers[i].wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+				perror("proxy: wake");
+			}
+		}
+	}
+}
+
+static void publish(struct proxy_fetch *f, enum proxy_state state)
+{
+	__atomic_store_n(&f->state, state, __ATOMIC_SEQ_CST);
+	wake_watchers(f);
+}
+
+static void body_progress(void *arg, size_t n)
+{
+	struct proxy_fetch *f = arg;
+	__atomic_add_fetch(&f->written, n, __ATOMIC_SEQ_CST);
+	wake_watchers(f);
+}
+
+// create the directories leading to path
+static void make_parents(char *path)
+{
+	char *slash = path + strlen(cache_root) + 1;
+
+	while ((slash = strchr(slash, '/'))) {
+		*slash = '\0';
+		if (mkdir(path, 0777) == -1 && errno != EEXIST) {
+			perror(path);
+		}
+		*slash++ = '/';
+	}
+}
+
+// fetch f->path from upstream into a temporary file and rename it into
+// place; returns 0 on success
+static int fetch(struct proxy_fetch *f, char *final, char *tmp, size_t tmp_len)
+{
+	char request[MAX_SENDLINE + MAX_DOMAIN_SIZE];
+	struct timeval tv = { PROXY_TIMEOUT, 0 };
+	struct response resp;
+	struct reader *r;
+	int sock, len, rv = -1;
+
+	if (proxy_cache_path(f->path, final, PATH_MAX) == -1) {
+		return -1;
+	}
+	make_parents(final);
+	const char *base = strrchr(final, '/') + 1;
+	snprintf(tmp, tmp_len, "%.*s.%s.XXXXXX", (int)(base - final), final, base);
+	if ((f->fd = mkostemp(tmp, O_CLOEXEC)) == -1) {
+		perror(tmp);
+		return -1;
+	}
+	fchmod(f->fd, 0644);
+
+	if ((sock = connect_to(upstream_host, upstream_port)) == -1) {
+		return -1;
+	}
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	if (!(r = malloc(sizeof(*r)))) {
+		close(sock);
+		return -1;
+	}
+	reader_init(r, sock);
+	r->progress = body_progress;
+	r->progress_arg = f;
+
+	len = snprintf(request, sizeof(request), "GET /%s HTTP/1.1\r\nHost: %s:%s\r\nConnection: close\r\n\r\n",
+			f->path, upstream_host, upstream_port);
+	if (len >= (int)sizeof(request) || send(sock, request, len, MSG_NOSIGNAL) != len ||
+			read_header(r, &resp, 0) == -1) {
+		goto out;
+	}
+
+	f->status = resp.status;
+	f->length = resp.status == 200 ? resp.body_length : 0;
+	publish(f, PROXY_STREAMING);
+
+	if (resp.status != 200) {
+		rv = 0;  // relayed, but not worth keeping
+		goto out;
+	}
+	if (read_body(r, &resp, f->fd, NULL) == -1 ||
+			(f->length != -1 && __atomic_load_n(&f->written, __ATOMIC_SEQ_CST) != f->length)) {
+		goto out;
+	}
+	if (rename(tmp, final) == -1) {
+		perror(final);
+		goto out;
+	}
+	tmp[0] = '\0';
+	rv = 0;
+
+out:
+	reader_release(r);
+	free(r);
+	close(sock);
+	return rv;
+}
+
+static void *fetch_main(void *arg)
+{
+	struct proxy_fetch *f = arg;
+	char final[PATH_MAX], tmp[PATH_MAX + 16];
+	struct proxy_fetch **pp;
+	int rv;
+
+	tmp[0] = '\0';
+	rv = fetch(f, final, tmp, sizeof(tmp));
+	if (tmp[0]) {
+		unlink(tmp);  // incomplete or not a 200, the readers keep their fd
+	}
+
+	// out of the table only now that the file is in place, so no miss in
+	// between starts a second fetch
+	pthread_mutex_lock(&inflight_lock);
+	for (pp = &inflight; *pp != f; pp = &(*pp)->next) {
+		;
+	}
+	*pp = f->next;
+	f->refs--;  // the table's; the thread still holds its own
+	if (rv == -1) {
+		COUNTER_INC(stats.failures);
+	}
+	pthread_mutex_unlock(&inflight_lock);
+
+	publish(f, rv == -1 ? PROXY_FAILED : PROXY_DONE);
+	proxy_release(f);
+	return NULL;
+}
+
+struct proxy_fetch *proxy_open(const char *path)
+{
+	struct proxy_fetch *f;
+	pthread_attr_t attr;
+	sigset_t all, old;
+	pthread_t thread;
+	int err;
+
+	pthread_mutex_lock(&inflight_lock);
+	for (f = inflight; f; f = f->next) {
+		if (strcmp(f->path, path) == 0) {
+			f->refs++;
+			COUNTER_INC(stats.collapsed);
+			pthread_mutex_unlock(&inflight_lock);
+			return f;
+		}
+	}
+
+	if (!(f = calloc(1, sizeof(*f))) || !(f->path = strdup(path))) {
+		free(f);
+		pthread_mutex_unlock(&inflight_lock);
+		return NULL;
+	}
+	f->fd = -1;
+	f->length = -1;
+	f->state = PROXY_PENDING;
+	f->refs = 3;  // the table's, the thread's and the caller's
+
+	// a detached thread per fetch, signals left to the workers' threads
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	err = pthread_create(&thread, &attr, fetch_main, f);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_attr_destroy(&attr);
+	if (err != 0) {
+		fprintf(stderr, "proxy: pthread_create: %s\n", strerror(err));
+		free(f->path);
+		free(f);
+		pthread_mutex_unlock(&inflight_lock);
+		return NULL;
+	}
+	f->next = inflight;
+	inflight = f;
+	COUNTER_INC(stats.fetches);
+	pthread_mutex_unlock(&inflight_lock);
+	return f;
+}
+
+void proxy_release(struct proxy_fetch *f)
+{
+	pthread_mutex_lock(&inflight_lock);
+	int last = --f->refs == 0;
+	pthread_mutex_unlock(&inflight_lock);
+	if (last) {
+		if (f->fd != -1) {
+			close(f->fd);
+		}
+		free(f->path);
+		free(f);
+	}
+}
+
+void proxy_watch(struct proxy_fetch *f, int id)
+{
+	__atomic_or_fetch(&f->watchers, 1ULL << (id % 64), __ATOMIC_SEQ_CST);
+}
+
+void proxy_get_stats(struct proxy_stats *out)
+{
+	out->fetches = COUNTER_GET(stats.fetches);
+	out->collapsed = COUNTER_GET(stats.collapsed);
+	out->failures = COUNTER_GET(stats.failures);
+}
@@ -0,0 +1,90 @@
+/*
+** proxy.h -- fetch misses from an upstream server into an on-disk cache
+*/
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <stddef.h>
+
+#define PROXY_CACHE_DIR ".proxy_cache"  // default, under the working directory
+#define PROXY_TIMEOUT 30  // seconds the upstream may stay silent before a fetch fails
+
+enum proxy_state {
+	PROXY_PENDING,    // waiting for the upstream's response header
+	PROXY_STREAMING,  // status and length known, the body is arriving
+	PROXY_DONE,       // the whole body is in the file, or there is none
+	PROXY_FAILED,     // the upstream couldn't be reached or broke off
+};
+
+/*
+ * One upstream fetch, shared by every request that missed on its path while
+ * it runs. The body is written to a temporary file next to its place in the
+ * cache directory and renamed into place once complete, so later requests
+ * find it there and never see a partial file; requests that came during the
+ * fetch follow the temporary file as it grows.
+ */
+struct proxy_fetch {
+	char *path;  // relative to the cache directory, the key of the in-flight table
+	int refs;    // the table's, the fetch thread's and one per request; under the table lock
+	int fd;      // the body file, readable from the start; stays valid after the rename
+
+	// published by the fetch thread, read with __atomic loads
+	int state;                    // enum proxy_state
+	int status;                   // upstream status code, valid from PROXY_STREAMING on
+	long long length;             // upstream Content-Length, -1 if it didn't send one
+	unsigned long long written;   // body bytes in fd so far
+	unsigned long long watchers;  // bit (id % 64) per worker to wake on progress
+
+	struct proxy_fetch *next;
+};
+
+struct proxy_stats {
+	unsigned long long fetches;    // upstream fetches started
+	unsigned long long collapsed;  // misses that joined a fetch already running
+	unsigned long long failures;   // fetches that failed
+};
+
+/*
+ * send misses to upstream ("host:port") and keep what comes back under
+ * cache_dir, which is created if needed
+ * output - 0 on success, -1 if upstream is malformed or cache_dir unusable
+ */
+int proxy_init(const char *upstream, const char *cache_dir);
+
+/*
+ * whether proxy_init() was called
+ */
+int proxy_enabled(void);
+
+/*
+ * where path would be kept in the cache directory
+ * output - 0 with the location in buf, -1 if path isn't one the proxy
+ *          handles (empty, or with ".", ".." or hidden components)
+ */
+int proxy_cache_path(const char *path, char *buf, size_t len);
+
+/*
+ * join the fetch of path, starting one if none is running
+ * output - a referenced fetch the caller gives back with proxy_release(),
+ *          NULL if the fetch can't be started
+ */
+struct proxy_fetch *proxy_open(const char *path);
+
+/*
+ * drop a reference returned by proxy_open()
+ */
+void proxy_release(struct proxy_fetch *f);
+
+/*
+ * ask for a wake-up of worker id's wake_fd at the fetch's next progress;
+ * the caller then checks the fetch once more before it waits, so progress
+ * made in between isn't missed
+ */
+void proxy_watch(struct proxy_fetch *f, int id);
+
+/*
+ * copy out the proxy counters; safe to call from any thread
+ */
+void proxy_get_stats(struct proxy_stats *out);
+
+#endif
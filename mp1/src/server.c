@@ -7,56 +7,154 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 #include <signal.h>
+#include <pthread.h>
 
-#define BACKLOG 10	 // how many pending connections queue will hold
+#include "admission.h"
+#include "cache.h"
+#include "conn.h"
+#include "event_loop.h"
+#include "h2.h"
+#include "precompress.h"
+#include "proxy.h"
+#include "stats.h"
+#include "uring_loop.h"
+
+#define BACKLOG SOMAXCONN	 // how many pending connections queue will hold
+
+enum server_mode {
+	MODE_FORK,   // one child process per connection
+	MODE_EPOLL,  // a single process multiplexing every connection
+	MODE_URING,  // the same, with io_uring doing the waiting and most syscalls
+};
 
 void sigchld_handler(int s)
 {
 	while(waitpid(-1, NULL, WNOHANG) > 0);
 }
 
-// get sockaddr, IPv4 or IPv6:
-void *get_in_addr(struct sockaddr *sa)
+// parse a byte count such as "65536", "512K" or "64M", -1 if malformed
+static long long parse_size(const char *str)
 {
-	if (sa->sa_family == AF_INET) {
-		return &(((struct sockaddr_in*)sa)->sin_addr);
+	char *end;
+	long long n = strtoll(str, &end, 10);
+	if (end == str || n < 0) {
+		return -1;
 	}
+	switch (*end) {
+	case 'G': case 'g': n <<= 10; // fall through
+	case 'M': case 'm': n <<= 10; // fall through
+	case 'K': case 'k': n <<= 10; end++; break;
+	case '\0': break;
+	default: return -1;
+	}
+	return *end == '\0' ? n : -1;
+}
 
-	return &(((struct sockaddr_in6*)sa)->sin6_addr);
+// parse "header,idle,send" timeouts in seconds, -1 if malformed
+static int parse_timeouts(const char *str, struct conn_timeouts *t)
+{
+	char extra;
+	return sscanf(str, "%u,%u,%u%c", &t->header, &t->idle, &t->send, &extra) == 3 ? 0 : -1;
 }
 
-int main(int argc, char* argv[])
+// parse "conns,bytes,depth,latency_ms" admission limits, -1 if malformed;
+// bytes takes the same suffixes as a cache size
+static int parse_limits(const char *str, struct admission_limits *l)
 {
-	int sockfd, new_fd;  // listen on sock_fd, new connection on new_fd
+	char bytes[32], extra;
+	long long n;
+
+	if (sscanf(str, "%u,%31[^,],%u,%u%c", &l->conns, bytes, &l->depth, &l->latency_ms,
+				&extra) != 4 || (n = parse_size(bytes)) == -1) {
+		return -1;
+	}
+	l->bytes = n;
+	return 0;
+}
+
+// parse "rate[,burst]" requests per second per client, -1 if malformed
+static int parse_rate(const char *str, double *rate, double *burst)
+{
+	char extra;
+	int n = sscanf(str, "%lf,%lf%c", rate, burst, &extra);
+
+	if (n == 1) {
+		*burst = *rate;
+	}
+	return (n == 1 || n == 2) && *rate > 0 && *burst >= 1 ? 0 : -1;
+}
+
+// a worker's share of a server-wide limit; 0 (no limit) stays 0
+static long long share(long long limit, int nworkers)
+{
+	return limit == 0 ? 0 : limit / nworkers > 0 ? limit / nworkers : 1;
+}
+
+// serve one connection in a fork child: the socket is made non-blocking so
+// that every wait can be cut short by the connection's deadline
+// returns 1 if the connection timed out, 0 otherwise
+static int serve_child(struct conn *c)
+{
+	int flags = fcntl(c->fd, F_GETFL, 0);
+	if (flags == -1 || fcntl(c->fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		return 0;
+	}
+
+	while (conn_process(c) == 0) {
+		struct pollfd pfd;
+		int wait = -1, rv;
+
+		pfd.fd = c->fd;
+		pfd.events = c->state == CONN_WRITING ? POLLOUT : POLLIN;
+		if (c->state == CONN_H2 && h2_pending(c->h2)) {
+			pfd.events |= POLLOUT;
+		}
+		if (c->deadline) {
+			unsigned long long now = stats_now_usec();
+			wait = now >= c->deadline ? 0 : (int)((c->deadline - now + 999) / 1000);
+		}
+		while ((rv = poll(&pfd, 1, wait)) == -1 && errno == EINTR) {
+			;
+		}
+		if (rv == 0) {
+			STAT_INC(&c->worker->stats, timed_out[c->timeout]);
+			return 1;
+		}
+		if (rv == -1) {
+			return 0;
+		}
+	}
+	return 0;
+}
+
+// bind a listening socket to port; with reuseport several sockets may share
+// the port and the kernel balances new connections across them
+// returns the socket, or -1 on failure
+static int open_listener(const char *port, int reuseport)
+{
+	int sockfd;
 	struct addrinfo hints, *servinfo, *p;
-	struct sockaddr_storage their_addr; // connector's address information
-	socklen_t sin_size;
-	struct sigaction sa;
 	int yes=1;
-	char s[INET6_ADDRSTRLEN];
 	int rv;
 
-	if (argc != 2) {
-		fprintf(stderr, "usage: server port\n");
-		fprintf(stderr, "Example:\n");
-		fprintf(stderr, "./server 8000");
-	}
-
 	memset(&hints, 0, sizeof hints);
 	hints.ai_family = AF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_flags = AI_PASSIVE; // use my IP
 
-	if ((rv = getaddrinfo(NULL, argv[1], &hints, &servinfo)) != 0) {
+	if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
 		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-		return 1;
+		return -1;
 	}
 
 	// loop through all the results and bind to the first we can
@@ -73,6 +171,12 @@ int main(int argc, char* argv[])
 			exit(1);
 		}
 
+		if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes,
+				sizeof(int)) == -1) {
+			perror("setsockopt");
+			exit(1);
+		}
+
 		if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
 			close(sockfd);
 			perror("server: bind");
@@ -82,18 +186,242 @@ int main(int argc, char* argv[])
 		break;
 	}
 
+	freeaddrinfo(servinfo); // all done with this structure
+
 	if (p == NULL)  {
 		fprintf(stderr, "server: failed to bind\n");
-		return 2;
+		return -1;
 	}
 
-	freeaddrinfo(servinfo); // all done with this structure
-
 	if (listen(sockfd, BACKLOG) == -1) {
 		perror("listen");
+		close(sockfd);
+		return -1;
+	}
+
+	return sockfd;
+}
+
+// start the event loop workers and then sit waiting for SIGUSR1 stats requests
+static int run_workers(const char *port, int nworkers, int pin, int uring, long long cache_capacity,
+		const struct conn_timeouts *timeouts, const struct admission_limits *limits,
+		struct rate_limiter *limiter)
+{
+	struct worker *workers;
+	sigset_t set;
+	int i, sig;
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (ncpus < 1) {
+		ncpus = 1;
+	}
+	if (nworkers == 0) {
+		nworkers = ncpus;
+	}
+	if (!(workers = calloc(nworkers, sizeof(*workers)))) {
+		perror("calloc");
+		return 1;
+	}
+	if (uring && !uring_available()) {
+		fprintf(stderr, "server: io_uring unavailable, using epoll\n");
+		uring = 0;
+	}
+
+	// only this thread handles SIGUSR1; the workers inherit the blocked mask
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	for (i = 0; i < nworkers; i++) {
+		struct worker *w = &workers[i];
+		w->id = i;
+		w->cpu = pin ? i % ncpus : -1;
+		w->uring = uring;
+		if ((w->listen_fd = open_listener(port, nworkers > 1)) == -1) {
+			return 2;
+		}
+		// the cache budget is split, each worker caches its own hot set
+		w->cache = cache_create(cache_capacity / nworkers);
+		w->timeouts = *timeouts;
+		// likewise the load limits, except that lag is each worker's own
+		w->limits.conns = share(limits->conns, nworkers);
+		w->limits.bytes = share(limits->bytes, nworkers);
+		w->limits.depth = share(limits->depth, nworkers);
+		w->limits.latency_ms = limits->latency_ms;
+		w->limiter = limiter;
+	}
+	register_workers(workers, nworkers);
+	for (i = 0; i < nworkers; i++) {
+		if (start_worker(&workers[i]) == -1) {
+			return 1;
+		}
+	}
+
+	printf("server: waiting for connections (%d %s worker%s)...\n",
+			nworkers, uring ? "io_uring" : "epoll", nworkers > 1 ? "s" : "");
+	fflush(stdout);  // scripts wait for this line
+
+	// `kill -USR1 <pid>` prints the counters without disturbing the workers
+	while (sigwait(&set, &sig) == 0) {
+		for (i = 0; i < nworkers; i++) {
+			print_worker_stats(&workers[i], stderr);
+		}
+	}
+	return 1;
+}
+
+int main(int argc, char* argv[])
+{
+	int sockfd, new_fd;  // listen on sock_fd, new connection on new_fd
+	struct sockaddr_storage their_addr; // connector's address information
+	socklen_t sin_size;
+	struct sigaction sa;
+	struct worker *shared;
+	int opt;
+	enum server_mode mode = MODE_EPOLL;
+	long long cache_capacity = CACHE_DEFAULT_CAPACITY;
+	int nworkers = 1, pin = 0;
+	struct conn_timeouts timeouts = { CONN_HEADER_TIMEOUT, CONN_IDLE_TIMEOUT, CONN_SEND_TIMEOUT };
+	long precompress_interval = 0;
+	struct admission_limits limits = { ADMIT_MAX_CONNS, ADMIT_MAX_BYTES, ADMIT_MAX_DEPTH,
+		ADMIT_MAX_LATENCY_MS };
+	struct rate_limiter *limiter = NULL;
+	double rate = 0, burst = 0;
+	const char *upstream = NULL, *proxy_dir = PROXY_CACHE_DIR;
+	int bad_usage = 0;
+	char *end;
+
+	while ((opt = getopt(argc, argv, "m:c:w:pt:z:A:r:u:d:")) != -1) {
+		switch (opt) {
+		case 'm':
+			if (strcmp(optarg, "fork") == 0) {
+				mode = MODE_FORK;
+			} else if (strcmp(optarg, "epoll") == 0) {
+				mode = MODE_EPOLL;
+			} else if (strcmp(optarg, "uring") == 0) {
+				mode = MODE_URING;
+			} else {
+				bad_usage = 1;
+			}
+			break;
+		case 'c':
+			if ((cache_capacity = parse_size(optarg)) == -1) {
+				bad_usage = 1;
+			}
+			break;
+		case 'w':
+			nworkers = strtol(optarg, &end, 10);
+			if (*end != '\0' || nworkers < 0) {
+				bad_usage = 1;
+			}
+			break;
+		case 'p':
+			pin = 1;
+			break;
+		case 't':
+			if (parse_timeouts(optarg, &timeouts) == -1) {
+				bad_usage = 1;
+			}
+			break;
+		case 'A':
+			if (parse_limits(optarg, &limits) == -1) {
+				bad_usage = 1;
+			}
+			break;
+		case 'r':
+			if (parse_rate(optarg, &rate, &burst) == -1) {
+				bad_usage = 1;
+			}
+			break;
+		case 'u':
+			upstream = optarg;
+			break;
+		case 'd':
+			proxy_dir = optarg;
+			break;
+		case 'z':
+			precompress_interval = strtol(optarg, &end, 10);
+			if (*end != '\0' || precompress_interval <= 0) {
+				bad_usage = 1;
+			}
+			break;
+		default:
+			bad_usage = 1;
+		}
+	}
+
+	// proxied responses follow their fetch from an event loop
+	if (upstream && mode == MODE_FORK) {
+		bad_usage = 1;
+	}
+
+	if (bad_usage || argc - optind != 1) {
+		fprintf(stderr, "usage: server [-m fork|epoll|uring] [-w workers] [-p] [-c cache_size] [-t header,idle,send]\n"
+				"              [-A conns,bytes,depth,latency_ms] [-r rate[,burst]] [-z interval]\n"
+				"              [-u host:port [-d cache_dir]] port\n");
+		fprintf(stderr, "  -m  connection model, epoll (default), one process per connection, or\n");
+		fprintf(stderr, "      epoll's workers on io_uring (falls back to epoll on kernels before 5.19);\n");
+		fprintf(stderr, "      an io_uring worker serves up to %d connections at once\n", URING_MAX_SLOTS);
+		fprintf(stderr, "  -w  epoll worker threads, each with its own SO_REUSEPORT listener;\n");
+		fprintf(stderr, "      1 by default, 0 for one per online CPU\n");
+		fprintf(stderr, "  -p  pin worker i to CPU i\n");
+		fprintf(stderr, "  -c  bytes of small files cached in memory in epoll mode, e.g. 64M (default), 0 disables\n");
+		fprintf(stderr, "  -t  seconds allowed to receive a request header, to sit idle between\n");
+		fprintf(stderr, "      keep-alive requests and to go without send progress (default %d,%d,%d);\n",
+				CONN_HEADER_TIMEOUT, CONN_IDLE_TIMEOUT, CONN_SEND_TIMEOUT);
+		fprintf(stderr, "      0 disables one\n");
+		fprintf(stderr, "  -A  admission limits: connections open and response bytes not yet sent\n");
+		fprintf(stderr, "      (whole server), responses in progress, and milliseconds an epoll\n");
+		fprintf(stderr, "      worker may lag (default %d,%lldM,%d,%d); past one of them new work\n",
+				ADMIT_MAX_CONNS, ADMIT_MAX_BYTES >> 20, ADMIT_MAX_DEPTH, ADMIT_MAX_LATENCY_MS);
+		fprintf(stderr, "      gets a fast 503 with Retry-After, 0 disables one; fork mode only\n");
+		fprintf(stderr, "      applies the connection cap\n");
+		fprintf(stderr, "  -r  requests per second allowed to each client address, with bursts\n");
+		fprintf(stderr, "      of up to burst (default rate); excess requests get a 429\n");
+		fprintf(stderr, "  -u  reverse proxy: fetch files not found here from host:port, keeping\n");
+		fprintf(stderr, "      them in cache_dir (default %s); epoll mode only\n", PROXY_CACHE_DIR);
+		fprintf(stderr, "  -z  every interval seconds, gzip text files (.txt, .log, .json, .csv, ...)\n");
+		fprintf(stderr, "      into a sibling .gz, replacing any that is older than its original\n");
+		fprintf(stderr, "Fresh .gz siblings (same mtime as the original) are sent to clients that\n");
+		fprintf(stderr, "accept gzip, whether -z or `gzip -k` made them\n");
+		fprintf(stderr, "GET /__stats returns the server's counters in Prometheus text format\n");
+		fprintf(stderr, "Clients that open with the HTTP/2 preface or ask for Upgrade: h2c are\n");
+		fprintf(stderr, "served over HTTP/2, with up to 100 requests multiplexed on one connection\n");
+		fprintf(stderr, "Example:\n");
+		fprintf(stderr, "./server 8000\n");
+		fprintf(stderr, "./server -w 0 -p 8000\n");
+		fprintf(stderr, "./server -m fork 8000\n");
+		fprintf(stderr, "./server -m uring -w 0 8000\n");
+		fprintf(stderr, "./server -z 60 8000\n");
+		fprintf(stderr, "./server -u origin.example.com:8000 8080\n");
+		exit(1);
+	}
+
+	// a client hanging up mid-response must not kill the server
+	signal(SIGPIPE, SIG_IGN);
+
+	if (precompress_interval && precompress_start(precompress_interval) == -1) {
+		exit(1);
+	}
+	if (rate > 0 && !(limiter = rate_limiter_create(rate, burst))) {
+		exit(1);
+	}
+	if (upstream && proxy_init(upstream, proxy_dir) == -1) {
+		fprintf(stderr, "server: bad upstream %s or cache directory %s\n", upstream, proxy_dir);
 		exit(1);
 	}
 
+	if (mode != MODE_FORK) {
+		// fork children would each start from an empty copy, so only the
+		// long-lived event loops cache
+		return run_workers(argv[optind], nworkers, pin, mode == MODE_URING, cache_capacity,
+				&timeouts, &limits, limiter);
+	}
+
+	if ((sockfd = open_listener(argv[optind], 0)) == -1) {
+		return 2;
+	}
+
 	sa.sa_handler = sigchld_handler; // reap all dead processes
 	sigemptyset(&sa.sa_mask);
 	sa.sa_flags = SA_RESTART;
@@ -102,7 +430,24 @@ int main(int argc, char* argv[])
 		exit(1);
 	}
 
+	// one cacheless worker stands for every child; its counters live in
+	// shared memory so /__stats sees them all, and are updated atomically
+	shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	memset(shared, 0, sizeof(*shared));
+	shared->listen_fd = sockfd;
+	shared->cpu = -1;
+	shared->timeouts = timeouts;
+	shared->limits = limits;
+	shared->limiter = limiter;
+	shared->stats.shared = 1;
+	register_workers(shared, 1);
+
 	printf("server: waiting for connections...\n");
+	fflush(stdout);  // scripts wait for this line
 
 	while(1) {  // main accept() loop
 		sin_size = sizeof their_addr;
@@ -112,49 +457,40 @@ int main(int argc, char* argv[])
 			continue;
 		}
 
-		inet_ntop(their_addr.ss_family,
-			get_in_addr((struct sockaddr *)&their_addr),
-			s, sizeof s);
-		printf("server: got connection from %s\n", s);
+		// past the cap, answer from here rather than fork yet another child
+		if (limits.conns && COUNTER_GET(shared->stats.accepted) -
+				COUNTER_GET(shared->stats.closed) >= limits.conns) {
+			admission_refuse(new_fd);
+			STAT_INC(&shared->stats, shed[SHED_CONNS]);
+			stats_count_response(&shared->stats, 503);
+			continue;
+		}
+
+		// initialized before the fork so accept-to-first-byte includes it
+		struct conn c;
+		conn_init(&c, new_fd, &their_addr, shared);
+		STAT_INC(&shared->stats, accepted);
 
-		if (!fork()) { // this is the child process
-			char request[4096];
-			char filepath[1000];
+		pid_t pid = fork();
+		if (pid == -1) {
+			// out of processes: the overload the cap is for. Turn the client
+			// away, and close the books on it, or its slot is lost for good.
+			perror("fork");
+			admission_refuse(new_fd);
+			STAT_INC(&shared->stats, closed);
+			STAT_INC(&shared->stats, shed[SHED_CONNS]);
+			stats_count_response(&shared->stats, 503);
+			continue;
+		}
+		if (pid == 0) { // this is the child process
 			close(sockfd); // child doesn't need the listener
-			if (read(new_fd, request, sizeof(request)) >= 0) {
-				sscanf(request, "%*s /%s %*s\r\n\r\n", filepath);
-				// try to find file
-				char header[2048];
-				FILE* fptr = fopen(filepath, "r");
-
-				if (!fptr) {
-					fprintf(stderr, "file not found\n");
-					fprintf(stderr, "%s\n", strerror(errno));
-					strcpy(header, "HTTP/1.0 404 Not Found\r\n\r\n");
-					// pad by four to account for "\r" chars
-					if (send(new_fd, header, strlen(header), 0) == -1) {
-						perror("send");
-					}
-				} else {
-					strcpy(header, "HTTP/1.0 200 OK\r\n\r\n");
-					// pad by four to account for "\r" chars
-					if (send(new_fd, header, strlen(header), 0) == -1) {
-						perror("send");
-					} else {
-						char response[4096];
-						int bytes_read = 0;
-						while ((bytes_read = fread(response, 1, sizeof(response), fptr)) > 0) {
-							if (send(new_fd, response, bytes_read, 0) == -1) {
-								perror("send");
-								break;
-							}
-   						}
-					}
-				}
-
-				close(new_fd);
-				exit(0);
+			if (serve_child(&c)) {
+				conn_expire(&c);
+			} else {
+				conn_close(&c);
 			}
+			STAT_INC(&shared->stats, closed);
+			exit(0);
 		}
 
 		close(new_fd);  // parent doesn't need this
@@ -162,4 +498,3 @@ int main(int argc, char* argv[])
 
 	return 0;
 }
-
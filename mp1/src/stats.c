@@ -0,0 +1,300 @@
+/*
+** stats.c -- lock-free per-worker counters and latency histograms
+*/
+
+#define _GNU_SOURCE  // open_memstream()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cache.h"
+#include "event_loop.h"
+#include "proxy.h"
+#include "stats.h"
+
+static const int status_codes[] = { STATUS_CODES };
+#define NUM_STATUS_CODES ((int)(sizeof(status_codes) / sizeof(status_codes[0])))
+_Static_assert(NUM_STATUS_CODES + 1 == STATUS_SLOTS, "STATUS_SLOTS must match STATUS_CODES");
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+// label values of worker_stats.timed_out[], indexed by enum conn_timeout
+static const char *const timeout_names[CONN_TIMEOUT_KINDS] = { "header", "idle", "send" };
+
+// label values of worker_stats.shed[], indexed by enum shed_reason
+static const char *const shed_names[SHED_REASONS] = {
+	"connections", "bytes", "depth", "latency", "rate",
+};
+
+unsigned long long stats_now_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void stats_count_response(struct worker_stats *stats, int status)
+{
+	int i;
+	for (i = 0; i < NUM_STATUS_CODES && status_codes[i] != status; i++) {
+		;
+	}
+	STAT_INC(stats, responses[i]);  // i == NUM_STATUS_CODES is the "other" slot
+}
+
+static int bucket_index(unsigned long long v)
+{
+	if (v < HIST_SUB_BUCKETS) {
+		return v;
+	}
+	int shift = (63 - __builtin_clzll(v)) - 4;  // leaves v >> shift in [16, 32)
+	if (shift > HIST_MAX_SHIFT) {
+		return HIST_BUCKETS - 1;
+	}
+	return HIST_SUB_BUCKETS * (shift + 1) + (int)((v >> shift) - HIST_SUB_BUCKETS);
+}
+
+// largest value that lands in bucket i
+static unsigned long long bucket_upper(int i)
+{
+	if (i < HIST_SUB_BUCKETS) {
+		return i;
+	}
+	int shift = i / HIST_SUB_BUCKETS - 1;
+	unsigned long long sub = i % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS;
+	return ((sub + 1) << shift) - 1;
+}
+
+void stats_record(struct worker_stats *stats, struct histogram *h, unsigned long long usec)
+{
+	int i = bucket_index(usec);
+	if (stats->shared) {
+		__atomic_fetch_add(&h->counts[i], 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&h->sum, usec, __ATOMIC_RELAXED);
+		unsigned long long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+		while (usec > max && !__atomic_compare_exchange_n(&h->max, &max, usec, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			;
+		}
+	} else {
+		COUNTER_INC(h->counts[i]);
+		COUNTER_INC(h->count);
+		COUNTER_ADD(h->sum, usec);
+		if (usec > h->max) {
+			__atomic_store_n(&h->max, usec, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+// snapshot src into dst, summing with what dst already holds
+static void merge_histogram(struct histogram *dst, struct histogram *src)
+{
+	int i;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		dst->counts[i] += COUNTER_GET(src->counts[i]);
+	}
+	dst->count += COUNTER_GET(src->count);
+	dst->sum += COUNTER_GET(src->sum);
+	unsigned long long max = COUNTER_GET(src->max);
+	if (max > dst->max) {
+		dst->max = max;
+	}
+}
+
+// the value below which a fraction q of the recorded values fall
+static unsigned long long histogram_quantile(const struct histogram *h, double q)
+{
+	unsigned long long total = 0, seen = 0;
+	int i;
+
+	// count is bumped separately from the buckets, so sum the buckets for
+	// a snapshot that is consistent with itself
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		total += h->counts[i];
+	}
+	if (total == 0) {
+		return 0;
+	}
+	unsigned long long rank = (unsigned long long)(q * total + 0.5);
+	if (rank == 0) {
+		rank = 1;
+	}
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen >= rank) {
+			unsigned long long v = bucket_upper(i);
+			return v < h->max ? v : h->max;
+		}
+	}
+	return h->max;
+}
+
+static void render_summary(FILE *f, const char *name, const char *help, struct histogram *h)
+{
+	size_t i;
+
+	fprintf(f, "# HELP %s %s\n# TYPE %s summary\n", name, help, name);
+	for (i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+		fprintf(f, "%s{quantile=\"%g\"} %.6f\n", name, quantiles[i],
+				histogram_quantile(h, quantiles[i]) / 1e6);
+	}
+	fprintf(f, "%s_sum %.6f\n%s_count %llu\n", name, h->sum / 1e6, name, h->count);
+	fprintf(f, "# HELP %s_max Largest observed value.\n# TYPE %s_max gauge\n", name, name);
+	fprintf(f, "%s_max %.6f\n", name, h->max / 1e6);
+}
+
+// one line per worker for a counter or gauge read through get()
+static void render_per_worker(FILE *f, const char *name, const char *type, const char *help,
+		struct worker *workers, int n,
+		unsigned long long (*get)(struct worker *w))
+{
+	int i;
+	fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+	for (i = 0; i < n; i++) {
+		fprintf(f, "%s{worker=\"%d\"} %llu\n", name, workers[i].id, get(&workers[i]));
+	}
+}
+
+static unsigned long long get_accepted(struct worker *w) { return COUNTER_GET(w->stats.accepted); }
+static unsigned long long get_open(struct worker *w)
+{
+	return COUNTER_GET(w->stats.accepted) - COUNTER_GET(w->stats.closed);
+}
+static unsigned long long get_requests(struct worker *w) { return COUNTER_GET(w->stats.requests); }
+static unsigned long long get_bytes_sent(struct worker *w) { return COUNTER_GET(w->stats.bytes_sent); }
+static unsigned long long get_gzip_responses(struct worker *w)
+{
+	return COUNTER_GET(w->stats.gzip_responses);
+}
+static unsigned long long get_h2_connections(struct worker *w)
+{
+	return COUNTER_GET(w->stats.h2_connections);
+}
+static unsigned long long get_h2_streams(struct worker *w) { return COUNTER_GET(w->stats.h2_streams); }
+static unsigned long long get_outstanding(struct worker *w) { return COUNTER_GET(w->outstanding); }
+
+// a worker without a cache reports zeros
+static struct cache_stats cache_stats_of(struct worker *w)
+{
+	struct cache_stats cs;
+	memset(&cs, 0, sizeof(cs));
+	if (w->cache) {
+		cache_get_stats(w->cache, &cs);
+	}
+	return cs;
+}
+
+static unsigned long long get_cache_hits(struct worker *w) { return cache_stats_of(w).hits; }
+static unsigned long long get_cache_misses(struct worker *w) { return cache_stats_of(w).misses; }
+static unsigned long long get_cache_evictions(struct worker *w) { return cache_stats_of(w).evictions; }
+static unsigned long long get_cache_bytes(struct worker *w) { return cache_stats_of(w).bytes; }
+
+char *stats_render(struct worker *workers, int n, size_t *len)
+{
+	struct histogram *first_byte, *request_time;
+	char *buf = NULL;
+	FILE *f;
+	int i, j;
+
+	first_byte = calloc(1, sizeof(*first_byte));
+	request_time = calloc(1, sizeof(*request_time));
+	if (!first_byte || !request_time || !(f = open_memstream(&buf, len))) {
+		free(first_byte);
+		free(request_time);
+		return NULL;
+	}
+
+	render_per_worker(f, "mp1_connections_accepted_total", "counter",
+			"Connections accepted.", workers, n, get_accepted);
+	render_per_worker(f, "mp1_connections_open", "gauge",
+			"Connections currently open.", workers, n, get_open);
+	render_per_worker(f, "mp1_requests_total", "counter",
+			"Requests answered.", workers, n, get_requests);
+	render_per_worker(f, "mp1_sent_bytes_total", "counter",
+			"Header and body bytes written to client sockets.", workers, n, get_bytes_sent);
+	render_per_worker(f, "mp1_gzip_responses_total", "counter",
+			"Responses answered from a pre-compressed .gz variant.", workers, n, get_gzip_responses);
+	render_per_worker(f, "mp1_h2_connections_total", "counter",
+			"Connections that switched to HTTP/2.", workers, n, get_h2_connections);
+	render_per_worker(f, "mp1_h2_streams_total", "counter",
+			"HTTP/2 streams opened by clients.", workers, n, get_h2_streams);
+
+	fprintf(f, "# HELP mp1_responses_total Responses by status code.\n");
+	fprintf(f, "# TYPE mp1_responses_total counter\n");
+	for (i = 0; i < n; i++) {
+		for (j = 0; j <= NUM_STATUS_CODES; j++) {
+			unsigned long long v = COUNTER_GET(workers[i].stats.responses[j]);
+			if (j < NUM_STATUS_CODES) {
+				fprintf(f, "mp1_responses_total{worker=\"%d\",code=\"%d\"} %llu\n",
+						workers[i].id, status_codes[j], v);
+			} else {
+				fprintf(f, "mp1_responses_total{worker=\"%d\",code=\"other\"} %llu\n",
+						workers[i].id, v);
+			}
+		}
+	}
+
+	fprintf(f, "# HELP mp1_timeouts_total Connections closed because a timeout expired.\n");
+	fprintf(f, "# TYPE mp1_timeouts_total counter\n");
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < CONN_TIMEOUT_KINDS; j++) {
+			fprintf(f, "mp1_timeouts_total{worker=\"%d\",kind=\"%s\"} %llu\n",
+					workers[i].id, timeout_names[j], COUNTER_GET(workers[i].stats.timed_out[j]));
+		}
+	}
+
+	fprintf(f, "# HELP mp1_shed_total Connections and requests turned away by admission control.\n");
+	fprintf(f, "# TYPE mp1_shed_total counter\n");
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < SHED_REASONS; j++) {
+			fprintf(f, "mp1_shed_total{worker=\"%d\",reason=\"%s\"} %llu\n",
+					workers[i].id, shed_names[j], COUNTER_GET(workers[i].stats.shed[j]));
+		}
+	}
+	render_per_worker(f, "mp1_outstanding_bytes", "gauge",
+			"Response bytes owed to clients and not yet sent.", workers, n, get_outstanding);
+
+	for (i = 0; i < n; i++) {
+		merge_histogram(first_byte, &workers[i].stats.first_byte);
+		merge_histogram(request_time, &workers[i].stats.request_time);
+	}
+	render_summary(f, "mp1_first_byte_seconds",
+			"Time from accept to the first response byte sent.", first_byte);
+	render_summary(f, "mp1_request_duration_seconds",
+			"Time from the first request byte received to the last response byte sent.",
+			request_time);
+
+	render_per_worker(f, "mp1_cache_hits_total", "counter",
+			"File cache hits.", workers, n, get_cache_hits);
+	render_per_worker(f, "mp1_cache_misses_total", "counter",
+			"File cache misses.", workers, n, get_cache_misses);
+	render_per_worker(f, "mp1_cache_evictions_total", "counter",
+			"File cache LRU evictions.", workers, n, get_cache_evictions);
+	render_per_worker(f, "mp1_cache_bytes", "gauge",
+			"File content held in memory.", workers, n, get_cache_bytes);
+
+	if (proxy_enabled()) {
+		struct proxy_stats ps;
+		proxy_get_stats(&ps);
+		fprintf(f, "# HELP mp1_upstream_fetches_total Misses fetched from the upstream.\n");
+		fprintf(f, "# TYPE mp1_upstream_fetches_total counter\n");
+		fprintf(f, "mp1_upstream_fetches_total %llu\n", ps.fetches);
+		fprintf(f, "# HELP mp1_upstream_collapsed_total Misses that joined a fetch already running.\n");
+		fprintf(f, "# TYPE mp1_upstream_collapsed_total counter\n");
+		fprintf(f, "mp1_upstream_collapsed_total %llu\n", ps.collapsed);
+		fprintf(f, "# HELP mp1_upstream_failures_total Upstream fetches that failed.\n");
+		fprintf(f, "# TYPE mp1_upstream_failures_total counter\n");
+		fprintf(f, "mp1_upstream_failures_total %llu\n", ps.failures);
+	}
+
+	free(first_byte);
+	free(request_time);
+	if (fclose(f) != 0) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
@@ -0,0 +1,87 @@
+/*
+** stats.h -- lock-free per-worker counters and latency histograms
+*/
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <time.h>
+
+#include "admission.h"
+#include "conn.h"
+#include "counter.h"
+
+struct worker;
+
+/*
+ * Log-linear ("HDR") histogram of microsecond values: values below 16 get a
+ * bucket each, above that every power of two is split into 16 buckets, so
+ * any recorded value is known to within 1/16 (6.25%) of itself.
+ */
+#define HIST_SUB_BUCKETS 16
+#define HIST_MAX_SHIFT 36  // top bucket starts at 2^40us, about 12 days
+#define HIST_BUCKETS (HIST_SUB_BUCKETS * (HIST_MAX_SHIFT + 2))
+
+struct histogram {
+	unsigned long long counts[HIST_BUCKETS];
+	unsigned long long count;
+	unsigned long long sum;  // microseconds
+	unsigned long long max;
+};
+
+// response status codes we count individually, everything else is "other"
+#define STATUS_CODES 200, 206, 304, 400, 404, 416, 429, 431, 501, 502, 503, 505
+#define STATUS_SLOTS 13  // one per code above, plus "other"
+
+struct worker_stats {
+	// set when several processes update this struct (fork mode); then every
+	// update is an atomic add instead of the single-writer load + store
+	int shared;
+
+	unsigned long long accepted;   // connections accepted
+	unsigned long long closed;     // connections closed; accepted - closed are open
+	unsigned long long requests;   // requests answered
+	unsigned long long bytes_sent; // header and body bytes handed to sockets
+	unsigned long long gzip_responses;  // responses answered from a .gz variant
+	unsigned long long h2_connections;  // connections switched to HTTP/2
+	unsigned long long h2_streams;      // HTTP/2 streams opened by clients
+	unsigned long long responses[STATUS_SLOTS];
+	unsigned long long timed_out[CONN_TIMEOUT_KINDS];  // connections closed by a timeout
+	unsigned long long shed[SHED_REASONS];  // connections and requests turned away
+
+	struct histogram first_byte;    // accept to first response byte sent
+	struct histogram request_time;  // first request byte received to last response byte sent
+};
+
+#define STAT_ADD(stats, field, n) do { \
+		if ((stats)->shared) { \
+			__atomic_fetch_add(&(stats)->field, (n), __ATOMIC_RELAXED); \
+		} else { \
+			COUNTER_ADD((stats)->field, (n)); \
+		} \
+	} while (0)
+#define STAT_INC(stats, field) STAT_ADD(stats, field, 1)
+
+/*
+ * current CLOCK_MONOTONIC time in microseconds
+ */
+unsigned long long stats_now_usec(void);
+
+/*
+ * count one response with the given status code
+ */
+void stats_count_response(struct worker_stats *stats, int status);
+
+/*
+ * add a microsecond value to one of the stats' histograms
+ */
+void stats_record(struct worker_stats *stats, struct histogram *h, unsigned long long usec);
+
+/*
+ * render the counters of workers[0..n) in the Prometheus text exposition
+ * format; latency histograms are merged over all workers
+ * output - a malloc'd buffer of *len bytes the caller frees, NULL if memory is short
+ */
+char *stats_render(struct worker *workers, int n, size_t *len);
+
+#endif
@@ -0,0 +1,81 @@
+/*
+** timer_wheel.c -- hashed timer wheel for per-connection deadlines
+*/
+
+#include <stddef.h>
+#include <string.h>
+
+#include "timer_wheel.h"
+
+void timer_wheel_init(struct timer_wheel *wheel, unsigned long long now)
+{
+	memset(wheel->slots, 0, sizeof(wheel->slots));
+	wheel->now = now;
+}
+
+void timer_cancel(struct timer_node *t)
+{
+	if (!t->pprev) {
+		return;
+	}
+	*t->pprev = t->next;
+	if (t->next) {
+		t->next->pprev = t->pprev;
+	}
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+void timer_schedule(struct timer_wheel *wheel, struct timer_node *t, unsigned long long expires)
+{
+	if (t->pprev && t->expires == expires) {
+		return;  // the common case for a busy connection within one tick
+	}
+	timer_cancel(t);
+
+	// a deadline already in the past fires on the next tick
+	if (expires <= wheel->now) {
+		expires = wheel->now + 1;
+	}
+	t->expires = expires;
+
+	struct timer_node **slot = &wheel->slots[expires % TIMER_SLOTS];
+	t->next = *slot;
+	if (t->next) {
+		t->next->pprev = &t->next;
+	}
+	t->pprev = slot;
+	*slot = t;
+}
+
+// fire the due timers of one slot, leaving those a lap or more away
+static void expire_slot(struct timer_node **slot, unsigned long long now,
+		void (*expire)(struct timer_node *t, void *arg), void *arg)
+{
+	struct timer_node *t = *slot;
+	while (t) {
+		struct timer_node *next = t->next;  // the callback may free t
+		if (t->expires <= now) {
+			timer_cancel(t);
+			expire(t, arg);
+		}
+		t = next;
+	}
+}
+
+void timer_wheel_advance(struct timer_wheel *wheel, unsigned long long now,
+		void (*expire)(struct timer_node *t, void *arg), void *arg)
+{
+	unsigned long long tick;
+
+	if (now <= wheel->now) {
+		return;
+	}
+	// after a stall longer than a lap every slot is due for a look, once
+	tick = now - wheel->now > TIMER_SLOTS ? now - TIMER_SLOTS : wheel->now;
+	while (tick < now) {
+		tick++;
+		expire_slot(&wheel->slots[tick % TIMER_SLOTS], now, expire, arg);
+	}
+	wheel->now = now;
+}
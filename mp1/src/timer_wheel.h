@@ -0,0 +1,54 @@
+/*
+** timer_wheel.h -- hashed timer wheel for per-connection deadlines
+*/
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#define TIMER_TICK_MS 100  // wheel resolution
+#define TIMER_SLOTS 1024   // one lap is about 100 seconds; later deadlines go round again
+
+/*
+ * Intrusive list node, embedded in whatever owns the deadline. Adding,
+ * moving and removing a timer are O(1); a tick only looks at the timers
+ * hashed into its own slot, so the cost per tick does not grow with the
+ * number of idle connections spread over the other slots.
+ */
+struct timer_node {
+	unsigned long long expires;  // tick at or after which the timer fires
+	struct timer_node *next;
+	struct timer_node **pprev;   // NULL while the timer is not armed
+};
+
+struct timer_wheel {
+	unsigned long long now;  // last tick processed
+	struct timer_node *slots[TIMER_SLOTS];
+};
+
+/*
+ * start an empty wheel at the given tick
+ */
+void timer_wheel_init(struct timer_wheel *wheel, unsigned long long now);
+
+/*
+ * arm t to fire at tick expires, moving it if it was already armed
+ */
+void timer_schedule(struct timer_wheel *wheel, struct timer_node *t, unsigned long long expires);
+
+/*
+ * disarm t; harmless if it is not armed
+ */
+void timer_cancel(struct timer_node *t);
+
+static inline int timer_armed(const struct timer_node *t)
+{
+	return t->pprev != NULL;
+}
+
+/*
+ * move the wheel forward to tick now and call expire(t, arg) on every timer
+ * that is due; a timer is disarmed before its callback runs, which may free it
+ */
+void timer_wheel_advance(struct timer_wheel *wheel, unsigned long long now,
+		void (*expire)(struct timer_node *t, void *arg), void *arg);
+
+#endif
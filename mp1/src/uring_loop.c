@@ -0,0 +1,801 @@
+/*
+** uring_loop.c -- io_uring workers: batched accept, reads and sends
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "admission.h"
+#include "conn.h"
+#include "counter.h"
+#include "event_loop.h"
+#include "h2.h"
+#include "stats.h"
+#include "timer_wheel.h"
+#include "uring_loop.h"
+
+#define TICK_USEC (TIMER_TICK_MS * 1000ULL)
+#define LAG_SHIFT 3  // as in event_loop.c
+
+// what a completion is for: the low byte of its user_data, the slot above it
+enum op {
+	OP_ACCEPT,     // the multishot accept on the listener
+	OP_WAKE,       // a read of wake_fd
+	OP_CLOSE,      // a finished connection's socket
+	OP_READ,       // request bytes into the slot's c->request
+	OP_SEND,       // the response header, and the body if it is in memory
+	OP_FILE_READ,  // a chunk of the body file into the slot's buffer, linked to
+	OP_FILE_SEND,  // that chunk going out
+	OP_POLL,       // readiness of a connection conn_process() drives
+	OP_POLL_REMOVE,
+};
+
+#define USER_DATA(slot, op) ((uint64_t)(slot) << 8 | (op))
+
+// the mapped submission and completion rings
+struct ring {
+	int fd;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int tail;          // ours, published to *sq_tail before each enter
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned int features;
+	void *mem;
+	size_t mem_size;
+	size_t sqes_size;
+};
+
+/*
+ * A connection slot. Requests are read straight into c->request, which is
+ * registered with the ring, and responses sent from c->header plus the cache
+ * or a body buffer. A connection that needs what only conn_process() does
+ * (HTTP/2, proxying, multipart ranges, sendfile() once the body buffers run
+ * out) is made non-blocking and handed to it, run on poll completions the
+ * way the epoll loop runs it on events.
+ */
+struct uconn {
+	struct conn conn;   // first: timers and the parked list hand back a conn
+	int slot;           // index in the slab, and of c->request's registered buffer
+	int inflight;       // operations submitted and not completed
+	int closing;        // released once inflight drops to 0
+	int expired;
+	int poll_armed;     // events of the poll in flight, 0 if none
+	int buf;            // body buffer held, -1 if none
+	size_t expect;      // bytes the send in flight must complete with
+	size_t chunk;       // bytes of the file chunk in flight
+	struct iovec iov[2];
+	struct msghdr msg;
+	struct uconn *next_free;
+};
+
+struct loop {
+	struct worker *w;
+	struct ring ring;
+	struct timer_wheel wheel;
+	struct uconn *slots;
+	int nslots;
+	struct uconn *free_slots;
+	char *bufs;             // URING_BODY_BUFS chunks, registered after the slots
+	int free_bufs[URING_BODY_BUFS];
+	int nfree_bufs;
+	int fixed;              // the buffers are registered, reads use READ_FIXED
+	int accepting;          // the multishot accept is armed
+	int woken;
+	uint64_t wake_count;
+};
+
+static int ring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int ring_enter(int fd, unsigned int submit, unsigned int wait, unsigned int flags,
+		void *arg, size_t arg_len)
+{
+	return syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, arg_len);
+}
+
+static int ring_register(int fd, unsigned int op, void *arg, unsigned int n)
+{
+	return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+static void ring_close(struct ring *r)
+{
+	munmap(r->sqes, r->sqes_size);
+	munmap(r->mem, r->mem_size);
+	close(r->fd);
+}
+
+static int ring_open(struct ring *r, unsigned int entries)
+{
+	struct io_uring_params p;
+	unsigned int *array, i;
+	size_t sq_size, cq_size;
+	char *mem;
+
+	// completions are only needed when the loop comes to wait for them;
+	// kernels before 6.1 refuse the flags, they only save work
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	if ((r->fd = ring_setup(entries, &p)) == -1 && errno == EINVAL) {
+		memset(&p, 0, sizeof(p));
+		r->fd = ring_setup(entries, &p);
+	}
+	if (r->fd == -1) {
+		return -1;
+	}
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		close(r->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->mem_size = sq_size > cq_size ? sq_size : cq_size;
+	mem = mmap(NULL, r->mem_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			r->fd, IORING_OFF_SQ_RING);
+	if (mem == MAP_FAILED) {
+		close(r->fd);
+		return -1;
+	}
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		munmap(mem, r->mem_size);
+		close(r->fd);
+		return -1;
+	}
+
+	r->mem = mem;
+	r->features = p.features;
+	r->sq_head = (unsigned int *)(mem + p.sq_off.head);
+	r->sq_tail = (unsigned int *)(mem + p.sq_off.tail);
+	r->sq_mask = *(unsigned int *)(mem + p.sq_off.ring_mask);
+	r->sq_entries = p.sq_entries;
+	r->tail = *r->sq_tail;
+	r->cq_head = (unsigned int *)(mem + p.cq_off.head);
+	r->cq_tail = (unsigned int *)(mem + p.cq_off.tail);
+	r->cq_mask = *(unsigned int *)(mem + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(mem + p.cq_off.cqes);
+
+	// entries are always filled in ring order
+	array = (unsigned int *)(mem + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++) {
+		array[i] = i;
+	}
+	return 0;
+}
+
+// hand the queued entries to the kernel, and with wait set block until a
+// completion arrives or a wheel tick passes
+static int ring_submit(struct ring *r, int wait)
+{
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	unsigned int queued;
+
+	__atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+	queued = r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	if (!wait) {
+		return queued ? ring_enter(r->fd, queued, 0, 0, NULL, 0) : 0;
+	}
+
+	ts.tv_sec = TIMER_TICK_MS / 1000;
+	ts.tv_nsec = (TIMER_TICK_MS % 1000) * 1000000L;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = (uint64_t)(uintptr_t)&ts;
+	if (ring_enter(r->fd, queued, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+			&arg, sizeof(arg)) == -1 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+		return -1;
+	}
+	return 0;
+}
+
+static struct io_uring_sqe *get_sqe(struct ring *r)
+{
+	struct io_uring_sqe *sqe;
+
+	// the ring has room for every operation the slots can have outstanding,
+	// so a full ring only means the kernel hasn't taken the queue yet
+	if (r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) == r->sq_entries) {
+		ring_submit(r, 0);
+	}
+	sqe = &r->sqes[r->tail & r->sq_mask];
+	r->tail++;
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+int uring_available(void)
+{
+	// multishot accept and MSG_WAITALL sends came with IORING_OP_SOCKET in
+	// 5.19; they can't be probed for themselves
+	static const int needed[] = {
+		IORING_OP_ACCEPT, IORING_OP_READ, IORING_OP_READ_FIXED, IORING_OP_SEND,
+		IORING_OP_SENDMSG, IORING_OP_POLL_ADD, IORING_OP_POLL_REMOVE, IORING_OP_CLOSE,
+		IORING_OP_SOCKET,
+	};
+	unsigned int features = IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+	struct io_uring_probe *probe;
+	struct ring r;
+	size_t i;
+	int ok;
+
+	if (ring_open(&r, 8) == -1) {
+		return 0;
+	}
+	ok = (r.features & features) == features;
+	if (ok && (probe = calloc(1, sizeof(*probe) + 256 * sizeof(probe->ops[0])))) {
+		ok = ring_register(r.fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+		for (i = 0; ok && i < sizeof(needed) / sizeof(needed[0]); i++) {
+			ok = needed[i] <= probe->last_op &&
+					(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+		}
+		free(probe);
+	} else {
+		ok = 0;
+	}
+	ring_close(&r);
+	return ok;
+}
+
+static void submit_accept(struct loop *l)
+{
+	struct io_uring_sqe *sqe = get_sqe(&l->ring);
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = l->w->listen_fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;  // blocking: the ring polls for us
+	sqe->user_data = USER_DATA(0, OP_ACCEPT);
+	l->accepting = 1;
+}
+
+static void submit_wake(struct loop *l)
+{
+	struct io_uring_sqe *sqe = get_sqe(&l->ring);
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = l->w->wake_fd;
+	sqe->addr = (uintptr_t)&l->wake_count;
+	sqe->len = sizeof(l->wake_count);
+	sqe->user_data = USER_DATA(0, OP_WAKE);
+}
+
+static void submit_read(struct loop *l, struct uconn *u)
+{
+	struct conn *c = &u->conn;
+	struct io_uring_sqe *sqe = get_sqe(&l->ring);
+
+	sqe->opcode = l->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+	sqe->fd = c->fd;
+	sqe->addr = (uintptr_t)(c->request + c->request_len);
+	sqe->len = sizeof(c->request) - c->request_len;
+	sqe->buf_index = u->slot;
+	sqe->user_data = USER_DATA(u->slot, OP_READ);
+	u->inflight++;
+}
+
+// send u->iov[0..n) in full, or fail
+static void submit_send(struct loop *l, struct uconn *u, int n, int flags, int link)
+{
+	struct io_uring_sqe *sqe = get_sqe(&l->ring);
+	int i;
+
+	memset(&u->msg, 0, sizeof(u->msg));
+	u->msg.msg_iov = u->iov;
+	u->msg.msg_iovlen = n;
+	u->expect = 0;
+	for (i = 0; i < n; i++) {
+		u->expect += u->iov[i].iov_len;
+	}
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = u->conn.fd;
+	sqe->addr = (uintptr_t)&u->msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | flags;
+	sqe->flags = link ? IOSQE_IO_LINK : 0;
+	sqe->user_data = USER_DATA(u->slot, OP_SEND);
+	u->inflight++;
+}
+
+// read the next chunk of the body file into the slot's buffer and send it
+// once it is there, as one linked pair
+static void submit_chunk(struct loop *l, struct uconn *u)
+{
+	struct conn *c = &u->conn;
+	char *buf = l->bufs + (size_t)u->buf * URING_CHUNK;
+	off_t left = c->body_end - c->body_offset;
+	struct io_uring_sqe *sqe;
+
+	u->chunk = left < URING_CHUNK ? (size_t)left : URING_CHUNK;
+
+	sqe = get_sqe(&l->ring);
+	sqe->opcode = l->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+	sqe->fd = c->file_fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = u->chunk;
+	sqe->off = c->body_offset;
+	sqe->buf_index = l->nslots + u->buf;
+	sqe->flags = IOSQE_IO_LINK;  // a short read breaks the link, nothing is sent
+	sqe->user_data = USER_DATA(u->slot, OP_FILE_READ);
+
+	sqe = get_sqe(&l->ring);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = c->fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = u->chunk;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | ((off_t)u->chunk < left ? MSG_MORE : 0);
+	sqe->user_data = USER_DATA(u->slot, OP_FILE_SEND);
+	u->inflight += 2;
+}
+
+static void release(struct loop *l, struct uconn *u)
+{
+	struct conn *c = &u->conn;
+
+	if (u->buf != -1) {
+		l->free_bufs[l->nfree_bufs++] = u->buf;
+		u->buf = -1;
+	}
+	if (u->expired) {
+		conn_expire(c);
+	} else {
+		struct io_uring_sqe *sqe = get_sqe(&l->ring);
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = c->fd;
+		sqe->user_data = USER_DATA(0, OP_CLOSE);
+		c->fd = -1;
+		conn_close(c);
+	}
+	u->next_free = l->free_slots;
+	l->free_slots = u;
+	STAT_INC(&l->w->stats, closed);
+}
+
+// the slot is released once nothing in flight can still refer to it
+static void begin_close(struct loop *l, struct uconn *u, int expired)
+{
+	struct conn *c = &u->conn;
+
+	timer_cancel(&c->timer);
+	worker_unpark(c);
+	u->closing = 1;
+	u->expired |= expired;
+	if (u->inflight > 0) {
+		shutdown(c->fd, SHUT_RDWR);  // whatever waits on the socket fails now
+		return;
+	}
+	release(l, u);
+}
+
+static void expire_connection(struct timer_node *t, void *arg)
+{
+	struct loop *l = arg;
+	struct uconn *u = (struct uconn *)((char *)t - offsetof(struct conn, timer));
+
+	STAT_INC(&l->w->stats, timed_out[u->conn.timeout]);
+	begin_close(l, u, 1);
+}
+
+// run conn_process() and poll for whatever it waits on next
+static void drive(struct loop *l, struct uconn *u)
+{
+	struct conn *c = &u->conn;
+	struct io_uring_sqe *sqe;
+	int events;
+
+	worker_unpark(c);
+	if (conn_process(c) == -1) {
+		begin_close(l, u, 0);
+		return;
+	}
+	if (c->upstream_wait) {
+		worker_park(l->w, c);
+	}
+
+	switch (c->state) {
+	case CONN_READING:
+		events = POLLIN;
+		break;
+	case CONN_WRITING:
+		// a socket that is writable but waits on upstream hears from wake_fd
+		events = c->upstream_wait ? 0 : POLLOUT;
+		break;
+	default:
+		events = POLLIN | (h2_pending(c->h2) ? POLLOUT : 0);
+		break;
+	}
+	if (u->poll_armed) {
+		if (events & ~u->poll_armed) {
+			// the poll in flight would miss it: cancel, drive() runs again
+			sqe = get_sqe(&l->ring);
+			sqe->opcode = IORING_OP_POLL_REMOVE;
+			sqe->addr = USER_DATA(u->slot, OP_POLL);
+			sqe->user_data = USER_DATA(u->slot, OP_POLL_REMOVE);
+			u->inflight++;
+		}
+		return;
+	}
+	if (events) {
+		sqe = get_sqe(&l->ring);
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = c->fd;
+		sqe->poll32_events = events;
+		sqe->user_data = USER_DATA(u->slot, OP_POLL);
+		u->poll_armed = events;
+		u->inflight++;
+	}
+}
+
+static void hand_to_conn_process(struct loop *l, struct uconn *u)
+{
+	// conn_process() expects a non-blocking socket; no other flag is set on it
+	fcntl(u->conn.fd, F_SETFL, O_NONBLOCK);
+	drive(l, u);
+}
+
+// send the response conn_received() prepared
+static void respond(struct loop *l, struct uconn *u)
+{
+	struct conn *c = &u->conn;
+
+	if (c->state != CONN_WRITING || c->fetch || c->nranges > 1) {
+		hand_to_conn_process(l, u);
+		return;
+	}
+
+	u->iov[0].iov_base = c->header;
+	u->iov[0].iov_len = c->header_len;
+	if (c->mem) {
+		u->iov[1].iov_base = c->mem + c->body_offset;
+		u->iov[1].iov_len = c->body_end - c->body_offset;
+		submit_send(l, u, u->iov[1].iov_len > 0 ? 2 : 1, 0, 0);
+		return;
+	}
+	if (c->file_fd == -1 || c->body_offset == c->body_end) {
+		submit_send(l, u, 1, 0, 0);  // HEAD, or no body
+		return;
+	}
+
+	if (l->nfree_bufs == 0) {
+		hand_to_conn_process(l, u);
+		return;
+	}
+	u->buf = l->free_bufs[--l->nfree_bufs];
+	submit_send(l, u, 1, MSG_MORE, 1);
+	submit_chunk(l, u);
+}
+
+static void finished(struct loop *l, struct uconn *u)
+{
+	struct conn *c = &u->conn;
+
+	if (u->buf != -1) {
+		l->free_bufs[l->nfree_bufs++] = u->buf;
+		u->buf = -1;
+	}
+	if (!conn_response_done(c)) {
+		begin_close(l, u, 0);
+		return;
+	}
+	if (conn_received(c, 0)) {
+		respond(l, u);  // pipelined
+	} else {
+		submit_read(l, u);
+	}
+}
+
+static void accepted(struct loop *l, struct io_uring_cqe *cqe)
+{
+	struct worker *w = l->w;
+	struct sockaddr_storage peer;
+	socklen_t peer_len = sizeof(peer);
+	struct uconn *u;
+	int fd = cqe->res;
+
+	if (fd < 0) {
+		if (fd != -ECONNABORTED && fd != -EINTR) {
+			fprintf(stderr, "accept: %s\n", strerror(-fd));
+		}
+		if (!(cqe->flags & IORING_CQE_F_MORE)) {
+			l->accepting = 0;  // armed again on the next tick, not in a hot loop
+		}
+		return;
+	}
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		submit_accept(l);
+	}
+
+	if ((w->limits.conns &&
+			COUNTER_GET(w->stats.accepted) - COUNTER_GET(w->stats.closed) >= w->limits.conns) ||
+			!l->free_slots) {
+		admission_refuse(fd);
+		STAT_INC(&w->stats, shed[SHED_CONNS]);
+		stats_count_response(&w->stats, 503);
+		return;
+	}
+	u = l->free_slots;
+	l->free_slots = u->next_free;
+
+	// a multishot accept has nowhere to put each peer's address; only the
+	// rate limiter needs it, the rest of the time it stays AF_UNSPEC
+	memset(&peer, 0, sizeof(peer));
+	if (w->limiter) {
+		getpeername(fd, (struct sockaddr *)&peer, &peer_len);
+	}
+	conn_init(&u->conn, fd, &peer, w);
+	u->inflight = 0;
+	u->closing = 0;
+	u->expired = 0;
+	u->poll_armed = 0;
+	u->buf = -1;
+	STAT_INC(&w->stats, accepted);
+	submit_read(l, u);
+	worker_schedule(&l->wheel, &u->conn);
+}
+
+static void complete(struct loop *l, struct io_uring_cqe *cqe)
+{
+	enum op op = cqe->user_data & 0xff;
+	int res = cqe->res;
+	struct uconn *u;
+	struct conn *c;
+
+	switch (op) {
+	case OP_ACCEPT:
+		accepted(l, cqe);
+		return;
+	case OP_WAKE:
+		l->woken = 1;
+		submit_wake(l);
+		return;
+	case OP_CLOSE:
+		return;
+	default:
+		break;
+	}
+
+	u = &l->slots[cqe->user_data >> 8];
+	c = &u->conn;
+	u->inflight--;
+	if (op == OP_POLL) {
+		u->poll_armed = 0;
+	}
+	if (u->closing) {
+		if (u->inflight == 0) {
+			release(l, u);
+		}
+		return;
+	}
+
+	switch (op) {
+	case OP_READ:
+		if (res <= 0) {
+			begin_close(l, u, 0);
+			return;
+		}
+		if (conn_received(c, res)) {
+			respond(l, u);
+		} else {
+			submit_read(l, u);
+		}
+		break;
+	case OP_SEND:
+		if (res < 0 || (size_t)res != u->expect) {
+			begin_close(l, u, 0);  // MSG_WAITALL: short only if the socket broke
+			return;
+		}
+		conn_response_sent(c, res);
+		if (u->buf == -1) {
+			finished(l, u);
+		}
+		break;  // else the body follows in chunks
+	case OP_FILE_READ:
+		if (res < 0 || (size_t)res != u->chunk) {
+			begin_close(l, u, 0);  // the file shrank under us
+		}
+		return;  // the linked send carries on
+	case OP_FILE_SEND:
+		if (res < 0 || (size_t)res != u->chunk) {
+			begin_close(l, u, 0);
+			return;
+		}
+		conn_response_sent(c, res);
+		c->body_offset += res;
+		if (c->body_offset < c->body_end) {
+			submit_chunk(l, u);
+		} else {
+			finished(l, u);
+		}
+		break;
+	case OP_POLL:
+		drive(l, u);
+		break;
+	default:
+		return;
+	}
+	if (!u->closing) {
+		worker_schedule(&l->wheel, c);
+	}
+}
+
+// give every parked connection another go, as the epoll loop does
+static void wake_parked(struct loop *l)
+{
+	struct conn *list = l->w->parked, *c;
+
+	l->w->parked = NULL;
+	if (list) {
+		list->park_pprev = &list;
+	}
+	while ((c = list)) {
+		struct uconn *u = (struct uconn *)c;
+		drive(l, u);
+		if (!u->closing) {
+			worker_schedule(&l->wheel, c);
+		}
+	}
+}
+
+// the request buffers of every slot, then the body buffers
+static int register_buffers(struct loop *l)
+{
+	int n = l->nslots + URING_BODY_BUFS, i, rv;
+	struct iovec *iov;
+
+	if (!(iov = malloc(n * sizeof(*iov)))) {
+		return -1;
+	}
+	for (i = 0; i < l->nslots; i++) {
+		iov[i].iov_base = l->slots[i].conn.request;
+		iov[i].iov_len = sizeof(l->slots[i].conn.request);
+	}
+	for (i = 0; i < URING_BODY_BUFS; i++) {
+		iov[l->nslots + i].iov_base = l->bufs + (size_t)i * URING_CHUNK;
+		iov[l->nslots + i].iov_len = URING_CHUNK;
+	}
+	rv = ring_register(l->ring.fd, IORING_REGISTER_BUFFERS, iov, n);
+	free(iov);
+	return rv;
+}
+
+static struct loop *loop_create(struct worker *w)
+{
+	struct loop *l;
+	unsigned int entries = 1;
+	int i;
+
+	if (!(l = calloc(1, sizeof(*l)))) {
+		perror("calloc");
+		return NULL;
+	}
+	l->w = w;
+	l->nslots = w->limits.conns && w->limits.conns < URING_MAX_SLOTS ?
+			(int)w->limits.conns : URING_MAX_SLOTS;
+	// a slot has at most a send and a linked pair in flight, plus the close
+	// of its previous socket
+	while (entries < 4U * l->nslots + 8) {
+		entries <<= 1;
+	}
+
+	if (!(l->slots = calloc(l->nslots, sizeof(*l->slots)))) {
+		perror("calloc");
+		free(l);
+		return NULL;
+	}
+	l->bufs = mmap(NULL, (size_t)URING_BODY_BUFS * URING_CHUNK, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (l->bufs == MAP_FAILED) {
+		perror("mmap");
+		free(l->slots);
+		free(l);
+		return NULL;
+	}
+	if (ring_open(&l->ring, entries) == -1) {
+		perror("io_uring_setup");
+		munmap(l->bufs, (size_t)URING_BODY_BUFS * URING_CHUNK);
+		free(l->slots);
+		free(l);
+		return NULL;
+	}
+
+	// registering pins the buffers, which RLIMIT_MEMLOCK may not allow;
+	// plain reads do the same job with a page walk each
+	l->fixed = register_buffers(l) == 0;
+	if (!l->fixed) {
+		fprintf(stderr, "worker %d: can't register buffers (%s), reading without\n",
+				w->id, strerror(errno));
+	}
+
+	for (i = l->nslots - 1; i >= 0; i--) {
+		l->slots[i].slot = i;
+		l->slots[i].next_free = l->free_slots;
+		l->free_slots = &l->slots[i];
+	}
+	for (i = 0; i < URING_BODY_BUFS; i++) {
+		l->free_bufs[i] = i;
+	}
+	l->nfree_bufs = URING_BODY_BUFS;
+	timer_wheel_init(&l->wheel, stats_now_usec() / TICK_USEC);
+	return l;
+}
+
+int run_uring_loop(struct worker *w)
+{
+	struct loop *l;
+	struct ring *r;
+	unsigned int head, tail;
+	unsigned long long start, took;
+
+	if (!(l = loop_create(w))) {
+		return -1;
+	}
+	r = &l->ring;
+
+	// blocking, like the sockets: the ring waits on it rather than failing
+	if ((w->wake_fd = eventfd(0, EFD_CLOEXEC)) == -1) {
+		perror("eventfd");
+		return -1;
+	}
+	submit_accept(l);
+	submit_wake(l);
+
+	while (1) {
+		if (ring_submit(r, 1) == -1) {
+			perror("io_uring_enter");
+			return -1;
+		}
+
+		start = stats_now_usec();
+		l->woken = 0;
+		head = *r->cq_head;
+		while (head != (tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))) {
+			while (head != tail) {
+				complete(l, &r->cqes[head & r->cq_mask]);
+				head++;
+			}
+			__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+		}
+
+		if (l->woken) {
+			wake_parked(l);
+		}
+		if (!l->accepting) {
+			submit_accept(l);
+		}
+
+		// nothing refers to a slot by pointer across completions, so expiry
+		// needn't wait for a batch boundary the way the epoll loop's does
+		timer_wheel_advance(&l->wheel, stats_now_usec() / TICK_USEC, expire_connection, l);
+
+		took = stats_now_usec() - start;
+		w->lag = w->lag - (w->lag >> LAG_SHIFT) + (took >> LAG_SHIFT);
+	}
+}
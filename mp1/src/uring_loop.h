@@ -0,0 +1,28 @@
+/*
+** uring_loop.h -- io_uring workers: batched accept, reads and sends
+*/
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#define URING_MAX_SLOTS 1024    // connections one worker serves at once
+#define URING_BODY_BUFS 32      // file chunks in flight per worker
+#define URING_CHUNK (128 * 1024)  // bytes of file read and sent per linked pair
+
+struct worker;
+
+/*
+ * whether this kernel has what run_uring_loop() needs (io_uring itself,
+ * multishot accept, MSG_WAITALL sends, timed waits); io_uring may also be
+ * compiled out or disabled by sysctl or seccomp
+ */
+int uring_available(void);
+
+/*
+ * serve connections accepted on w->listen_fd in the calling thread, like
+ * run_event_loop() but with a single io_uring in place of the epoll set
+ * and most of the syscalls
+ * output - only returns on failure, with -1
+ */
+int run_uring_loop(struct worker *w);
+
+#endif
@@ -23,7 +23,7 @@
 #include <math.h>
 
 #include <iostream>
-#include <deque>
+#include <vector>
 
 #include "sender.h"
 
@@ -31,6 +31,7 @@
 #define RECV_BUF_SIZE 4096
 #define CONTENT_SIZE 4088
 #define MSS 1
+#define WINDOW_SLOTS 2048  // power of two: the most packets in flight at once
 #define SOCKET_TIMEOUT_MILLISEC 25
 #define SOCKET_TIMEOUT_MICROSEC SOCKET_TIMEOUT_MILLISEC * 1000
 
@@ -67,28 +68,55 @@ void diep(const char *s) {
     exit(1);
 }
 
-class Packet {
-    private:
+/*
+ * A packet laid out exactly as it goes on the wire, so the file is read
+ * straight into content and the slot itself is what gets sent.
+ */
+struct PacketSlot {
+    int id;                      // 4 bytes
+    int contentLen;              // 4 bytes
+    char content[CONTENT_SIZE];  // 4088 bytes
+};
+static_assert(sizeof(PacketSlot) == SENDER_BUF_SIZE, "a slot must be one whole packet");
 
-    int id_, content_len_;
-    char content_[CONTENT_SIZE];
+/*
+ * The packets sent but not yet ACKed, oldest first, in a ring of slots
+ * allocated once. Packet id maps to slot id & (WINDOW_SLOTS - 1), so a
+ * packet stays in its slot from loading until it is ACKed.
+ */
+class SendWindow {
+    private:
+    vector<PacketSlot> slots_;
+    int firstId_;  // the oldest packet in the window
+    int endId_;    // one past the newest
 
     public:
+    SendWindow() : slots_(WINDOW_SLOTS), firstId_(0), endId_(0) {}
 
-    Packet(int id, int content_len, char* buf) {
-        id_ = id;
-        content_len_ = content_len;
-        memcpy(content_, buf, CONTENT_SIZE);
+    int size() { return endId_ - firstId_; }
+    bool empty() { return endId_ == firstId_; }
+    int freeSlots() { return WINDOW_SLOTS - size(); }
+    int firstId() { return firstId_; }
+    int endId() { return endId_; }
+
+    // only while empty: the next packet loaded gets this id
+    void restartAt(int id) {
+        firstId_ = endId_ = id;
+    }
+
+    PacketSlot *slot(int id) {
+        return &slots_[id & (WINDOW_SLOTS - 1)];
     }
 
-    int id() {
-        return id_;
+    // the slot for the next packet; it joins the window with its id set
+    PacketSlot *append() {
+        PacketSlot *packet = slot(endId_);
+        packet->id = endId_++;
+        return packet;
     }
 
-    void fillData(char *buf) {
-        memcpy(buf, &id_, 4);                   // int, 4 bytes
-        memcpy(buf+4, &content_len_, 4);        // int, 4 bytes
-        memcpy(buf+8, content_, CONTENT_SIZE);  // 4088 bytes
+    void popFront() {
+        firstId_++;
     }
 };
 
@@ -110,57 +138,59 @@ class ReliableSender {
     bool isFileExhausted_;  // true if either the file is exhausted or
                             // remainingBytesToRead_ turns to 0 or negative
     State *state_;
-    deque<Packet> sentButNotAckedPackets;
-    char fileReadBuf_[CONTENT_SIZE];
-    char sendBuf_[SENDER_BUF_SIZE];
+    SendWindow sentButNotAckedPackets;
     char recvBuf_[RECV_BUF_SIZE];
     int socket_;
     struct addrinfo *receiverinfo_;
     struct timeval timeoutVal_;
 
-    deque<Packet> loadNewPacketsFromFile() {
-        deque<Packet> new_deq;
-        if (isFileExhausted_) return new_deq;
+    // read the packets the window has room for into its slots; they get
+    // ids from endId() on, returns how many were added
+    int loadNewPacketsFromFile() {
+        if (isFileExhausted_) return 0;
 
-        int packetIdToAdd = sentButNotAckedPackets.size() == 0 ?
-                leftPacketId_ : sentButNotAckedPackets.back().id() + 1;
+        if (sentButNotAckedPackets.empty()) {
+            sentButNotAckedPackets.restartAt(leftPacketId_);
+        }
         int bytesRead;
         int contentSize;
-        int newPacketCnt = ((int)ceil(windowSize_)) - sentButNotAckedPackets.size();
+        int loaded = 0;
+        int newPacketCnt = min(((int)ceil(windowSize_)) - sentButNotAckedPackets.size(),
+                sentButNotAckedPackets.freeSlots());
         if (DEBUG_LOAD_PACKET) {
-            printf("newPacketCnt: %d, windowSize: %d, deq size: %lu\n",
+            printf("newPacketCnt: %d, windowSize: %d, window size: %d\n",
                     newPacketCnt, ((int)ceil(windowSize_)), sentButNotAckedPackets.size());
         }
         while (newPacketCnt-- > 0) {
+            PacketSlot *packet = sentButNotAckedPackets.append();
+            loaded++;
             if (remainingBytesToRead_ == 0) {
                 // creat FIN packet
-                Packet packet(packetIdToAdd++, 0, fileReadBuf_);
-                new_deq.push_back(move(packet));
+                packet->contentLen = 0;
                 if (DEBUG_LOAD_PACKET) {
                     printf("create FIN packet: %d, size: %d\n",
-                            packet.id(), 0);
+                            packet->id, 0);
                 }
                 isFileExhausted_ = true;
                 break;
             }
-            bytesRead = fread(fileReadBuf_, 1, CONTENT_SIZE, fp_);
+            bytesRead = fread(packet->content, 1, CONTENT_SIZE, fp_);
             contentSize = remainingBytesToRead_ >= bytesRead ?
                     bytesRead : remainingBytesToRead_;
-            Packet packet(packetIdToAdd++, contentSize, fileReadBuf_);
+            packet->contentLen = contentSize;
             if (DEBUG_LOAD_PACKET) {
                 printf("create packet: %d, size: %d, bytes read: %d\n",
-                        packet.id(), contentSize, bytesRead);
+                        packet->id, contentSize, bytesRead);
             }
             remainingBytesToRead_ = remainingBytesToRead_ <= bytesRead ?
                     0 : remainingBytesToRead_ - bytesRead;
-            new_deq.push_back(move(packet));
 
             if (bytesRead == 0) {
                 isFileExhausted_ = true;
                 break;
             }
         }
-        return new_deq;
+        return loaded;
     }
 
     static int getLargestACKId(char *buf, int bytesRead) {
@@ -208,13 +238,12 @@ class ReliableSender {
         state_ = state;
     }
 
-    int sendSinglePacket(Packet *packet) {
+    int sendSinglePacket(PacketSlot *packet) {
         int sentBytes;
         if (DEBUG_PACKET_TRAFFIC) {
-            printf("sending packet %d\n", packet->id());
+            printf("sending packet %d\n", packet->id);
         }
-        packet->fillData(sendBuf_);
-        sentBytes = sendto(socket_, sendBuf_, SENDER_BUF_SIZE, 0,
+        sentBytes = sendto(socket_, packet, SENDER_BUF_SIZE, 0,
                 receiverinfo_->ai_addr, receiverinfo_->ai_addrlen);
         if (sentBytes == -1) {
             perror("fail to send packet");
@@ -223,18 +252,16 @@ class ReliableSender {
     }
 
     void sendNewPackets() {
-        deque<Packet> newPackets = loadNewPacketsFromFile();
-        for (auto it = newPackets.begin(); it != newPackets.end(); it++) {
-            // send packet
-            sendSinglePacket(&(*it));
-
-            // push to sliding window
-            sentButNotAckedPackets.push_back(*it);
+        int newPacketCnt = loadNewPacketsFromFile();
+        int endId = sentButNotAckedPackets.endId();
+        for (int id = endId - newPacketCnt; id < endId; id++) {
+            // already in the sliding window, straight from its slot
+            sendSinglePacket(sentButNotAckedPackets.slot(id));
         }
     }
 
     void resendOldPacket() {
-        sendSinglePacket(&sentButNotAckedPackets[0]);
+        sendSinglePacket(sentButNotAckedPackets.slot(sentButNotAckedPackets.firstId()));
     }
 
     void setSocketRecvTimeout() {
@@ -259,12 +286,12 @@ class ReliableSender {
     }
 
     bool isFinished() {
-        return isFileExhausted_ && sentButNotAckedPackets.size() == 0;
+        return isFileExhausted_ && sentButNotAckedPackets.empty();
     }
 
     void removeACKedPacketsFromWindow(int ackId) {
-        while (sentButNotAckedPackets.size() > 0 && sentButNotAckedPackets[0].id() <= ackId) {
-            sentButNotAckedPackets.pop_front();
+        while (!sentButNotAckedPackets.empty() && sentButNotAckedPackets.firstId() <= ackId) {
+            sentButNotAckedPackets.popFront();
         }
     }
 
@@ -354,9 +381,10 @@ void FastRecovery::newACK(int ackId) {
     context_->dupACKCnt_ = 0;
     context_->windowSize_ = context_->ssthresh_;
     context_->nextAction_ = sendNew;
+    context_->leftPacketId_ = ackId + 1;
+    // last: changeState() deletes this state, context_ with it
     CongAvoid *congAvoidState = new CongAvoid(context_);
     context_->changeState((State *) congAvoidState);
-    context_->leftPacketId_ = ackId + 1;
 }
 
 void timeoutBase(ReliableSender *context) {